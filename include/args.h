@@ -1,13 +1,38 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// how a member of the upstream group is selected for a request
+typedef enum
+{
+  ROUND_ROBIN,       // smooth weighted round robin
+  LEAST_OUTSTANDING, // fewest requests in flight, relative to weight
+  TWO_CHOICES,       // lower of two random members, on ewma latency & requests in flight
+  PATH_HASH          // consistent hashing of the request path, for cache affinity
+} LbPolicy;
 
 typedef struct config
 {
   char *port;
   char *canonical_host;
   char *upstream;
+  unsigned int threads;   // worker threads, each with its own listener & event loop
+  unsigned int processes; // worker processes, forked by a master on a shared listener
+  size_t max_conns;       // capacity of the conn table of every worker
+  size_t max_idle;        // idle upstream conns kept by every worker, 0 disables pooling
+  LbPolicy lb_policy;
+  bool adaptive_limit;           // cap the requests in flight of a member by its latency
+  char *health_path;             // GET by the health probes
+  int64_t health_interval;       // ms between the health probes of a member
+  bool health_checks;            // with more than one upstream, or if -g or -i is passed
+  unsigned int dns_ttl;          // secs between re-resolutions of the upstreams, 0 disables
+  char *upstream_ca;             // CA bundle to verify https upstreams with, system store if NULL
+  unsigned int hedge_percentile; // latency percentile slow requests are hedged at, 0 disables
+  bool upstream_h2;              // multiplex requests over http/2 sessions to the upstreams
   bool accept_all;
+  bool huge_pages; // back the conn pool with huge pages
   bool log_warnings;
   bool client_https;
   bool upstream_https;
@@ -22,4 +47,38 @@ void print_args(unsigned int args_parsed, const Config *config);
 
 bool validate_port(char *port);
 
+// parses num of workers, from 1 to MAX_WORKERS
+bool validate_workers(const char *workers, unsigned int *out);
+
+// parses max num of conns per worker, from 1 to MAX_CONNECTIONS_LIMIT
+bool validate_max_conns(const char *max_conns, size_t *out);
+
+// parses max num of idle upstream conns per worker, from 0 to MAX_IDLE_UPSTREAMS_LIMIT
+bool validate_max_idle(const char *max_idle, size_t *out);
+
+// parses a balancing policy name: rr, least, p2c or hash
+bool validate_lb_policy(const char *name, LbPolicy *out);
+
+// checks every member of a comma separated upstream list, and the weights
+bool validate_upstreams(const char *list);
+
+// checks the path of a unix: member, absolute & short enough for sun_path
+bool validate_unix_path(const char *path);
+
+// an absolute path, without whitespace, of at most HEALTH_PATH_MAX bytes
+bool validate_health_path(const char *path);
+
+// parses ms between health probes, from HEALTH_INTERVAL_MIN to HEALTH_INTERVAL_MAX
+bool validate_health_interval(const char *interval, int64_t *out);
+
+// checks if the CA bundle file can be read
+bool validate_ca_file(const char *path);
+
+// parses the latency percentile requests are hedged at, 0 or from HEDGE_PERCENTILE_MIN to
+// HEDGE_PERCENTILE_MAX
+bool validate_hedge_percentile(const char *percentile, unsigned int *out);
+
+// parses secs between re-resolutions of the upstreams, from 0 to DNS_TTL_MAX
+bool validate_dns_ttl(const char *ttl, unsigned int *out);
+
 void free_config(Config *config);
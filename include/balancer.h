@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "connection.h"
+
+// selection of an upstream member for every request, by config.lb_policy
+// the hash ring is built once & shared, while the counters the other policies balance on are
+// kept per worker, so selecting never takes a lock
+// with config.adaptive_limit, members past their concurrency limit are skipped like unhealthy
+// ones, and a request finding every member full waits in a fifo for a slot, getting a 503 if
+// none frees up in time
+// OUTLIER_FAILURES failures in a row eject a member for a while, like a failed health check
+// without waiting for the probes, but never more than OUTLIER_MAX_EJECTED percent of the group
+
+// per worker view of a member
+typedef struct member_stats
+{
+  int64_t current_weight; // smooth weighted round robin
+  size_t outstanding;     // requests selected for the member & not finished yet
+  size_t completed;       // requests finished with a full response
+  size_t samples;         // latencies sampled, one per response the headers were read of
+  double ewma;            // ms, moving average of the latency of the response headers
+  bool healthy;           // in rotation, set by the health checks of the worker
+
+  // adaptive concurrency limit, aimd on the latency of the response headers
+  double limit;       // outstanding requests the member is allowed, CONCURRENCY_MIN at least
+  double min_latency; // ms, baseline latency, the lowest seen & slowly drifting up
+  int64_t backed_off; // ms, loop_time of the last decrease, limit is cut once per round trip
+  size_t backoffs;
+
+  // passive outlier detection, on the requests of the worker
+  unsigned int failures; // connect failures & 5xx responses in a row
+  unsigned int ejected;  // ejections since the last success, each one lasts longer
+  int64_t ejected_till;  // ms, loop_time the member is back in rotation at
+  size_t ejections;
+  size_t retries; // requests sent again elsewhere after failing on the member
+} MemberStats;
+
+// requests that found every healthy member at its limit, oldest first
+// intrusive through wait_next & wait_prev of the conns, bounded by WAIT_QUEUE_MAX
+typedef struct wait_queue
+{
+  Connection *head;
+  Connection *tail;
+  size_t len;
+  size_t queued;   // all time
+  size_t rejected; // found the queue full
+  size_t expired;  // waited past the QUEUE_WAIT deadline
+} WaitQueue;
+
+// point on the consistent hash ring, every member owns weight * HASH_POINTS_PER_WEIGHT points
+typedef struct hash_point
+{
+  uint64_t hash;
+  size_t member;
+} HashPoint;
+
+// sorted by hash, read only after setup
+extern HashPoint *hash_ring;
+extern size_t hash_ring_len;
+
+extern _Thread_local MemberStats *member_stats;
+extern _Thread_local WaitQueue wait_queue;
+
+// builds the hash ring from upstreams, only needed for PATH_HASH
+bool setup_hash_ring(void);
+
+void free_hash_ring(void);
+
+// allocates the member stats of the calling thread
+bool setup_member_stats(void);
+
+void free_member_stats(void);
+
+// selects a healthy member below its limit for the request of conn, and counts the request as
+// outstanding on it
+// returns false with errno set to EAGAIN if a member in rotation is at its limit, or to
+// EHOSTUNREACH if every member is down or ejected
+bool select_member(Connection *conn);
+
+// select_member(), unless older requests are still waiting, so the queue stays first come first
+// served
+bool admit_request(Connection *conn);
+
+// counts a connect failure or a response of the member, 5xx responses count as failures
+// too many failures in a row eject the member
+void record_outcome(size_t member, bool failed);
+
+// select_member() for a hedge or a retry of a request, preferring a member other than avoid
+bool select_other_member(Connection *conn, size_t avoid);
+
+// adds the latency from the selection of the member of conn to its response headers to the ewma
+// & limit of the member, once per request. the body is paced by the client, so it is not part of
+// the sample
+void sample_member(Connection *conn);
+
+// finishes the request on the member of conn, if any, 502s & 504s cut the limit of the member
+void finish_member(Connection *conn, bool completed);
+
+// parks conn at the tail of the wait queue, till a member has room or its deadline passes
+// returns false if the queue is full
+bool queue_request(Connection *conn);
+
+// unlinks conn from the wait queue, if it is in it
+void leave_wait_queue(Connection *conn);
+
+// hands members that have room to the waiting requests, oldest first
+// called once per loop iteration, after every slot freed by the iteration
+void drain_wait_queue(void);
+
+// 64 bit FNV-1a
+uint64_t hash_str(const char *data, size_t len);
+
+const char *get_policy_string(LbPolicy policy);
+
+// logging & debugging
+void print_member_stats(void);
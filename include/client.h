@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <sys/types.h>
 
 #include "connection.h"
 
@@ -17,5 +18,16 @@ bool verify_read(Connection *conn);
 // host header verification
 bool verify_request(Connection *conn);
 
-// writing client request to upstream
+// makes the buffer after the request headers the ring of the body, with the body read along with
+// the headers in it. decode drops the framing of a chunked body, for a stream
+// returns false with status 400 if the chunked body is malformed
+bool start_body(Connection *conn, bool decode);
+
+// reads the request body into the ring while the client is readable & the ring has room, after
+// writing the 100 Continue the client may wait for
+// returns the bytes read, or -1 if the conn was given a closing state
+ssize_t read_body(Connection *conn, bool decode);
+
+// writing client request to upstream, the headers & then the body as it arrives, without
+// buffering more of it than the ring holds. READ_RESPONSE once the body was written in full
 void write_request(Connection *conn);
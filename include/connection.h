@@ -3,6 +3,7 @@
 #include <openssl/crypto.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
@@ -12,41 +13,77 @@
 
 typedef enum
 {
-  ACCEPT_CLIENT, // only if proxy_fd is set
+  ACCEPT_CLIENT,  // only if proxy_fd is set
+  PROBE_UPSTREAM, // health probe of a member, driven by health.c instead of handle_state
+  H2_SESSION,     // http/2 upstream conn shared by streams, driven by h2.c instead of handle_state
   TLS_CLIENT,
   READ_REQUEST,
   VERIFY_REQUEST,
   WRITE_ERROR,
   CONNECT_UPSTREAM,
+  WAIT_UPSTREAM,       // in the wait queue, every healthy member is at its concurrency limit
+  CONNECTING_UPSTREAM, // waiting for EPOLLOUT on the attempt fds
   TLS_UPSTREAM,
   WRITE_REQUEST,
   READ_RESPONSE,
-  WRITE_RESPONSE,
+  WRITE_RESPONSE,  // response of a stream, written in turns with read_stream()
+  RELAY_RESPONSE,  // body read from the upstream into the ring & written to the client at once
+  SPLICE_RESPONSE, // rest of a plaintext content-length body, upstream to pipe to client
   CHECK_CONN,
   CLOSE_CONN
 } State;
 
+// where parse_chunks() is in a chunked body
+typedef enum
+{
+  CHUNK_START,   // first hex digit of a size line
+  CHUNK_SIZE,    // rest of the size
+  CHUNK_EXT,     // extensions after the size, ignored
+  CHUNK_SIZE_LF, // \n of the size line
+  CHUNK_DATA,    // chunk_left bytes of data
+  CHUNK_DATA_CR, // \r\n after the data
+  CHUNK_DATA_LF,
+  CHUNK_TRAILER, // start of a trailer line, or the empty line that ends the body
+  CHUNK_FIELD,   // rest of a trailer line, ignored
+  CHUNK_END_LF,  // \n of the empty line
+  CHUNK_DONE
+} ChunkState;
+
+// lengths of bodies are counted in size_t, whatever their size
+_Static_assert(sizeof(size_t) >= sizeof(uint64_t), "size_t cannot hold 64-bit body lengths");
+
 typedef struct endpoint
 {
   char buffer[BUFFER_SIZE];
+  struct connection *conn; // owner, event data of the fd points to the endpoint
   SSL *ssl;
   int fd;
   Str headers;           // buffer may contain more bytes than this
   ptrdiff_t read_index;  // where to start reading again
   ptrdiff_t write_index; // where to start writing from
-  size_t to_read;        // more bytes to read, incase content-length is provided
-  size_t to_write;       // bytes remaining to write, across writes
+  size_t to_read;        // more bytes of the body to read, SIZE_MAX till the EOF of until_eof
+  size_t to_write;       // bytes remaining to write, across writes, in the ring once it is one
   ptrdiff_t next_index;  // incase 2 or more requests/responses arrive back to back
   size_t content_len;    // for client - len of req body,upstream - len of res body
   bool chunked;          // transfer encoding
+  bool until_eof;        // response without a length, its body ends when the upstream closes
   bool headers_found;    // if nothing more is needed to be read from the current request,
                          // stop reading if new request is detected, in case of client
-  char last_chunk_found[sizeof LAST_CHUNK]; // how much of the last chunk was read
+  ChunkState chunk_state; // progress of parse_chunks() in a chunked body
+  size_t chunk_left;      // data bytes left in the current chunk, or its size while parsed
+  bool paused;            // ring reached RING_HIGH_WATERMARK, reads wait for RING_LOW_WATERMARK
+  ptrdiff_t ring_start;   // the ring wraps to here, after the headers of a request with a body
+  size_t held;            // ring bytes before write_index sent zerocopy, kept till acked
+  int handshake_flags; // EPOLLIN or EPOLLOUT, what the tls handshake is waiting on
+
+  // cached edge triggered readiness, set by events & cleared when I/O on the fd would block
+  // states only do I/O on an endpoint that is ready, instead of re-arming the fd
+  bool readable;
+  bool writable;
 } Endpoint;
 
-// struct to be used for adding/modding/deleting to the epoll instance
-// every epoll_event.data in the epoll instance will have its data as a pointer to this struct
-// target fd will depend on the state of the conn
+// both fds of a conn are in the epoll instance at once, every epoll_event.data points to
+// the endpoint of the fd, which points back to the conn
 typedef struct connection
 {
   struct sockaddr_storage client_addr; // filled by accept()
@@ -64,66 +101,158 @@ typedef struct connection
 
   uint status;   // http status code
   bool complete; // full response received and sent
-  bool keep_alive;
+  bool keep_alive;          // client side
+  bool upstream_keep_alive; // upstream can be put in the idle pool after the response
+  size_t sent;              // bytes of the request written upstream, headers first
+  size_t continue_left;     // bytes of the 100 Continue the client waits for, not written yet
 
   struct connection **self_ptr; // this will be an element of active_conns array, used to
                                 // deactive/remove from active_conns(just make this NULL)
   Timeout conn_timeout;         // full conn timeout, also use for keep-alive
   Timeout state_timeout;        // timeout for individual read/write states
+
+  int attempt_fds[MAX_CONNECT_ATTEMPTS]; // pending non-blocking upstream connects, -1 if unused
+  size_t attempts_num;                   // num of attempt fds in use
+  struct addr_set *addrs;                // addresses of the member the attempts go through
+  size_t next_addr;                      // index of the next address in addrs to try
+  Timeout attempt_timeout;               // races the next address if the attempts are slow
+
+  size_t member;        // index in upstreams selected for the request, NO_MEMBER if none
+  int64_t member_since; // ms, loop_time when the member was selected, 0 once sampled
+  int64_t latency;      // ms, from member_since to the response headers, -1 till they came
+  unsigned int retries; // times the request was sent again, after upstream failures
+  bool reused;          // upstream was checked out of the idle pool
+
+  struct connection *wait_next; // wait queue links, only valid while waiting
+  struct connection *wait_prev;
+  bool waiting;
+
+  struct connection *hedge; // the other conn of a hedged request, linked both ways
+  bool shadow;              // a hedge conn, without a client of its own
+  Timeout hedge_timeout;    // sends the hedge if the response has not started by then
+
+  struct h2_session *session;     // run by a H2_SESSION conn, or the one the request is a stream of
+  int32_t stream_id;              // 0 if the request is not a stream, -1 once the stream closed
+  struct connection *stream_next; // streams of the session, only valid while open
+  struct connection *stream_prev;
+  size_t unconsumed;     // stream data in the upstream buffer, not given back to the window yet
+  ptrdiff_t chunk_start; // size line of the open chunk, -1 once it started being written
+  size_t chunk_len;      // data in the open chunk, 0 if none is open
+
+  int pipe_fds[2];  // read & write end of the splice relay pipe, -1 if none
+  size_t piped;     // body bytes in the pipe, not spliced to the client yet
+  bool pipe_failed; // no pipe could be opened, the rest of the response stays in the ring
+
+  bool zerocopy;                      // SO_ZEROCOPY is set on the client fd
+  bool zerocopy_off;                  // the client only gets plain writes, see send_ring()
+  uint32_t zc_next;                   // id of the next zerocopy send, counted by the kernel too
+  size_t zc_num;                      // zerocopy sends in flight, the oldest is zc_next - zc_num
+  size_t zc_lens[ZEROCOPY_SENDS_MAX]; // ring bytes held by the send in flight, by id
+  bool zc_done[ZEROCOPY_SENDS_MAX];   // acked, but an older send still holds the ring
 } Connection;
 
 // global array of conn structs that were added to the epoll table
 // init & free conn() add and remove from this array automatically
-extern Connection *active_conns[MAX_CONNECTIONS];
-extern int active_conns_num; // for future use, should not be used as index for active_conns array
+// thread local, as every worker only tracks its own conns
+// sized at startup by setup_active_conns(), with active_conns_cap entries
+extern _Thread_local Connection **active_conns;
+extern _Thread_local size_t active_conns_cap;
+extern _Thread_local int
+    active_conns_num; // for future use, should not be used as index for active_conns array
+
+// stack of free indices of active_conns, so a slot is found in O(1) on every accept
+// free_slots_top is the num of free indices on the stack
+extern _Thread_local size_t *free_slots;
+extern _Thread_local size_t free_slots_top;
+
+// allocates active_conns & free_slots for capacity conns, for the calling thread
+bool setup_active_conns(size_t capacity);
 
 // Returns a pointer to conn that needs to be added to the epoll_instance & activates it
 Connection *init_conn(void);
 
 void free_conn(Connection **conn);
 
-// adds conn to the active_conns array
+// deregisters & closes the upstream fd of conn, along with its ssl
+void close_upstream(Connection *conn);
+
+// adds conn to the active_conns array, at the index on top of free_slots
 // and starts its timeout
 bool activate_conn(Connection *conn);
 
 // removes event from active_conns array by making self_ptr NULL which make the array entry NULL
+// & pushes the index back to free_slots
 // also removes all conn timeouts
 void deactivate_conn(Connection *conn);
 
 // resets connection variables to their defaults to start a new request
 void reset_conn(Connection *conn);
 
+// resets the read & write progress of an endpoint, for a new request or response
+void reset_endpoint(Endpoint *endpoint);
+
 // calls fcntl to set non block option on a socket
 bool set_non_block(int fd);
 
-// calls epoll_ctl with EPOLL_CTL_ADD
-bool add_to_epoll(Connection *conn, int fd, int flags);
+// copies bytes from next_index to starting of buffer till read_index & sets read index accordingly
+void pull_buf(Endpoint *endpoint);
 
-// epoll_ctl with EPOLL_CTL_MOD
-bool mod_in_epoll(Connection *conn, int fd, int flags);
+// parses len bytes of a chunked body from data on, resuming where the last call stopped, so
+// the body can arrive in any number of pieces & anywhere in the buffer
+// sets parsed to the bytes that belong to the body, less than len only if the last chunk &
+// trailers ended it, in which case chunk_state is CHUNK_DONE
+// if decoded is not NULL, the chunk data is moved to the start of data without the framing, &
+// decoded is set to its len
+// returns false if the encoding is malformed
+bool parse_chunks(Endpoint *endpoint, char *data, size_t len, size_t *parsed, size_t *decoded);
 
-// epoll_ctl with EPOLL_CTL_DEL
-bool del_from_epoll(int fd);
+// true once the body of endpoint was read in full, content-length or chunked
+bool body_received(const Endpoint *endpoint);
 
-// copies bytes from next_index to starting of buffer till read_index & sets read index accordingly
-void pull_buf(Endpoint *endpoint);
+// once its headers are handled, the buffer of an endpoint is a ring: to_write bytes wait to be
+// written from write_index on, & the next read goes to read_index, both wrapping at RING_SIZE
+// back to ring_start, so the endpoint is read & written at once, without waiting for the buffer
+// to be drained. bytes sent with MSG_ZEROCOPY stay held behind write_index till the kernel is
+// done with them
+
+// bytes that one read at read_index can take, 0 while the ring is paused
+// pauses the ring at RING_HIGH_WATERMARK & resumes it at RING_LOW_WATERMARK
+size_t ring_space(Endpoint *endpoint);
+
+// bytes that one write from write_index can take
+size_t ring_data(const Endpoint *endpoint);
 
-// dynamically checks for last_chunk (fragmented or full) depending on the
-// chars in endpoint.last_chunk_found
-// starts to check from end of headers in client_buffer
-// returns true if chunk is received in full, or false if need to read more
-bool find_last_chunk(Endpoint *endpoint);
+// adds len bytes read at read_index to the ring
+void ring_push(Endpoint *endpoint, size_t len);
+
+// drops len bytes written from write_index, starting over at ring_start once the ring is empty
+// bytes sent zerocopy are added to held before, so they are kept
+void ring_pop(Endpoint *endpoint, size_t len);
+
+// frees the oldest len held bytes, once the kernel acked their zerocopy send
+void ring_release(Endpoint *endpoint, size_t len);
 
 // parsing common headers for both client and upstream only call once per request/response
 bool parse_headers(Connection *conn, Endpoint *endpoint);
 
 // used to continue the conn, if keep alive is true
+// the upstream is released to the idle pool if it can be reused, else closed
 void check_conn(Connection *conn);
 
 // for debugging
 void print_endpoint(const Endpoint *endpoint);
 
-// setups ssl object for the specific endpoint
+// setups ssl object for the specific endpoint, in accept state for the client
+// and connect state for the upstream. the handshake itself is done by continue_handshake()
+// upstreams get sni & hostname verification for the member of the conn, and resume the
+// session cached for it, if any
 // DOES NOT verify, if the config option is set to true or not
 // verify before calling
-bool setup_endpoint_tls(Endpoint *endpoint);
+bool setup_endpoint_tls(Endpoint *endpoint, bool upstream);
+
+// advances the non-blocking handshake of the endpoint by as much as the socket allows
+// on completion, sets conn state to the first read/write state of the endpoint,
+// otherwise stores the direction the handshake waits on in endpoint->handshake_flags,
+// and clears the cached readiness of that direction
+// a failed client handshake closes the conn, a failed upstream one writes 502
+void continue_handshake(Connection *conn, Endpoint *endpoint);
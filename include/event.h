@@ -0,0 +1,62 @@
+#pragma once
+
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "connection.h"
+
+// event backend, selected at compile time
+// the default backend is epoll, building with USE_IO_URING uses io_uring instead
+// both backends take & report events as epoll flags (poll masks use the same bits), so the
+// state machine does not depend on the backend
+// the epoll names are kept for both backends, io_uring emulates their semantics:
+// flags with EPOLLONESHOT are disarmed after one event, others stay armed (multishot poll)
+// event data is the endpoint of the fd, the listening conn uses its client endpoint
+// plaintext sockets are read & written through the *_socket() calls, which io_uring serves
+// from its completions, i.e., an fd is readable again once a recv has completed on it
+
+// epoll instance of the calling thread, -1 with the io_uring backend
+extern _Thread_local int EPOLL_FD;
+
+// creates the event instance of the calling thread
+bool setup_events(void);
+
+// waits at most timeout ms (-1 to wait forever) for events and fills at most max_events of them
+// wait_mask is used as the signal mask while waiting
+// returns num of events filled, or -1 with errno set
+int wait_events(struct epoll_event *events, int max_events, int timeout,
+                const sigset_t *wait_mask);
+
+// frees the event instance of the calling thread
+void free_events(void);
+
+// name of the compiled backend, for logging
+const char *get_backend_string(void);
+
+// calls epoll_ctl with EPOLL_CTL_ADD
+bool add_to_epoll(Endpoint *endpoint, int fd, int flags);
+
+// epoll_ctl with EPOLL_CTL_MOD
+bool mod_in_epoll(Endpoint *endpoint, int fd, int flags);
+
+// epoll_ctl with EPOLL_CTL_DEL
+bool del_from_epoll(int fd);
+
+// read() of a plaintext socket
+ssize_t read_socket(int fd, void *buffer, size_t len);
+
+// send() of a plaintext socket, without SIGPIPE
+// io_uring sends a copy of BUFFER_SIZE bytes at most, one send in flight per fd
+ssize_t write_socket(int fd, const void *buffer, size_t len);
+
+// accept4() of a listening fd, returning a nonblocking fd
+int accept_socket(int fd, struct sockaddr *addr, socklen_t *addr_len);
+
+// true if bytes, an EOF or an error wait on a socket nobody reads, like an idle upstream
+bool peek_socket(int fd);
+
+// close() of a socket, every fd that has been in the event instance is closed through it
+int close_socket(int fd);
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "connection.h"
+
+// http/2 upstreams, with -2 in a build with USE_NGHTTP2
+// an upstream conn that speaks h2, selected by ALPN for https members or by prior knowledge (h2c)
+// for http ones, becomes a session: a H2_SESSION conn that owns the fd & multiplexes the requests
+// of client conns to its member as streams. a client conn with a stream has no upstream fd, the
+// session writes the response into its upstream buffer as http/1.1 & handles it, so READ_RESPONSE
+// & WRITE_RESPONSE go on as with an upstream conn of its own
+// a stream gets its window back only once its data was written to the client, so a slow client
+// holds up its stream & never the session, whose window is given back right away
+// requests connecting while every session of the member is full open one more, up to
+// H2_SESSIONS_MAX per worker. sessions without streams are closed after IDLE_UPSTREAM_TIMEOUT
+
+struct nghttp2_session;
+
+typedef struct h2_session
+{
+  struct nghttp2_session *session;
+  Connection *conn;    // H2_SESSION conn, owns the fd, ssl & the idle timeout
+  size_t member;       // index in upstreams
+  Connection *streams; // conns with an open stream, linked through stream_next
+  size_t streams_num;
+  Connection *woken[H2_MAX_STREAMS]; // streams given data by the frames just read, to handle
+  size_t woken_num;
+  bool dirty;              // frames were queued outside of the session's own events
+  struct h2_session *next; // sessions of the member, oldest first
+} H2Session;
+
+typedef struct h2_stats
+{
+  size_t sessions; // opened
+  size_t streams;  // requests sent as streams
+  size_t reset;    // streams closed before the response was in full
+} H2Stats;
+
+extern _Thread_local H2Stats h2_stats;
+
+// allocates the session lists of the calling thread, if config.upstream_h2 is set
+bool setup_h2(void);
+
+void free_h2(void);
+
+// conn slots every worker keeps for sessions, 0 without -2
+size_t max_sessions(void);
+
+// true if the connected upstream endpoint speaks h2: ALPN selected it, or -2 for plaintext
+bool speaks_h2(const Endpoint *upstream);
+
+// makes the new upstream conn of conn a session of its member, and sends the request of conn as
+// its first stream. sets conn state like attach_stream(), or WRITE_ERROR if it cannot be retried
+void open_session(Connection *conn);
+
+// sends the request of conn as a stream of a session to its member with room for one, & sets
+// conn state to WRITE_REQUEST if it has a body, else READ_RESPONSE
+// returns false if there is none
+bool attach_stream(Connection *conn);
+
+// WRITE_REQUEST of a stream: reads the request body into the client ring, which the session
+// sends as DATA frames as its window allows, READ_RESPONSE once the body was read in full
+void write_stream(Connection *conn);
+
+// READ_RESPONSE of a stream: takes up the headers & data the session wrote into the upstream
+// buffer, a stream closed before the response was in full is handled like an upstream EOF
+void read_stream(Connection *conn);
+
+// gives the data of the stream of conn back to its window, once written to the client
+void ack_stream(Connection *conn);
+
+// resets the stream of conn if still open, detaching it from its session
+void close_stream(Connection *conn);
+
+// hands the stream of a winning hedge conn over to its client conn, which takes its place in
+// the session, so freeing the hedge conn does not reset it
+void move_stream(Connection *from, Connection *to);
+
+// reads & sends frames of a session while its fd is ready, then handles the woken streams
+// a failed session closes its streams, which are retried or answered like an upstream EOF
+void continue_session(Connection *conn);
+
+// closes a session without streams, on the SESSION_IDLE timeout
+void close_session(Connection *conn);
+
+// frees the session of a H2_SESSION conn being freed, its streams are left closed
+void free_session(Connection *conn);
+
+// sends the frames streams queued during the loop iteration, like window updates & resets
+void flush_sessions(void);
+
+// fills the buffer of a health probe with the connection preface, an empty SETTINGS frame &
+// a HEADERS frame that GETs config.health_path from member
+bool fill_h2_probe(Endpoint *upstream, size_t member);
+
+// looks for the response HEADERS of a probe in the frames read so far, returns true once found
+// (or on a GOAWAY), with status 0 if there was none
+bool find_h2_status(const Endpoint *upstream, unsigned int *status);
+
+// logging & debugging
+void print_h2_stats(void);
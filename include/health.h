@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "connection.h"
+
+// active health checks of the upstream group, run by every worker from its own event loop
+// every member has a probe conn per worker, marked by the PROBE_UPSTREAM state, that sends a GET
+// for config.health_path over a fresh connection, config.health_interval ms after the last probe
+// HEALTH_FALL failed probes in a row take a member out of rotation, HEALTH_RISE passed probes
+// bring it back. the first probe of a member decides right away, so a member that is dead at
+// startup never gets a request
+
+typedef enum
+{
+  PROBE_IDLE,       // waiting for the interval timeout
+  PROBE_CONNECTING, // waiting for EPOLLOUT on the non-blocking connect
+  PROBE_HANDSHAKE,  // https members only
+  PROBE_WRITING,
+  PROBE_READING // till the status line is read
+} ProbeStep;
+
+typedef struct member_health
+{
+  Connection *probe; // owns the probe fd & timeouts, its member is the index of this entry
+  ProbeStep step;
+  bool h2;             // the probe was sent as http/2 frames, see fill_h2_probe()
+  size_t next_addr;    // addresses of the member are probed in turns
+  unsigned int passes; // in a row, while unhealthy
+  unsigned int fails;  // in a row, while healthy
+  size_t checks;
+  size_t downs; // times the member was taken out of rotation
+} MemberHealth;
+
+extern _Thread_local MemberHealth *member_health;
+
+// allocates the probe conns of the calling thread, if config.health_checks is set
+bool setup_health_checks(void);
+
+// schedules the first probe of every member for the next loop iteration
+// called after the timeouts of the worker are set up
+void start_health_checks(void);
+
+// starts a non-blocking connect to the next address of the member of probe
+void start_probe(Connection *probe);
+
+// continues the step of probe while its fd is ready
+void continue_probe(Connection *probe);
+
+// counts the probe as failed, on the HEALTH_PROBE timeout
+void fail_probe(Connection *probe);
+
+// counts a finished probe of the member of probe, HEALTH_RISE passes or HEALTH_FALL fails in a
+// row move it in or out of rotation, & schedules the next probe
+void finish_probe(Connection *probe, bool passed);
+
+void free_health_checks(void);
+
+// logging & debugging
+void print_health_stats(void);
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "connection.h"
+
+// hedged requests, against the tail latency of a slow member
+// a request whose response has not started config.hedge_percentile of the worker's latencies
+// after its member was selected gets a copy, sent by a hedge conn through another member if one
+// has room. the first of the two to find response headers carries on, the other is closed
+// a hedge conn has no client fd: it runs the upstream states of handle_state on a copy of the
+// request, and its upstream endpoint is moved into the client conn if it wins
+// only GET & HEAD requests are hedged, and at most HEDGE_BUDGET percent of the requests
+
+typedef struct hedge_stats
+{
+  size_t histogram[HEDGE_DELAY_MAX + 1]; // ms from member selection to response headers
+  size_t samples;                        // in the histogram, halved at HEDGE_SAMPLES_MAX
+  int64_t delay;    // ms, the percentile, -1 till there are HEDGE_SAMPLES_MIN samples
+  size_t requests;  // armed with a hedge timeout
+  size_t hedges;    // hedge conns started
+  size_t in_flight; // hedge conns open, at most max_hedges()
+  size_t wins;      // hedges whose response came first
+} HedgeStats;
+
+extern _Thread_local HedgeStats *hedge_stats;
+
+// conn slots every worker keeps for hedge conns, 0 if hedging is disabled
+size_t max_hedges(void);
+
+// allocates the latency histogram of the calling thread, if config.hedge_percentile is set
+bool setup_hedging(void);
+
+void free_hedging(void);
+
+// starts the HEDGE_DELAY timeout of conn, once its member is selected
+void arm_hedge(Connection *conn);
+
+// sends a copy of the request of conn through a hedge conn, on the HEDGE_DELAY timeout
+void start_hedge(Connection *conn);
+
+// called once the response headers of conn are found, records the latency & settles the race
+// returns false if conn was a hedge conn, it is freed after handing its upstream to the client
+// conn, which is handled right away
+bool finish_hedge_race(Connection *conn);
+
+// disarms the hedge timeout of conn, closes its hedge conn if any, or unlinks conn from its
+// client conn if it is a hedge conn itself
+void stop_hedge(Connection *conn);
+
+// logging & debugging
+void print_hedge_stats(void);
@@ -10,6 +10,9 @@ bool validate_host(const Str *header);
 
 bool validate_method(const Str method);
 
+// if the method in the request line of request has no side effects, so it can be sent twice
+bool is_idempotent(const char *request);
+
 bool validate_http(const Str http_ver);
 
 // finds header_name from headers and points header_value to a Str containing
@@ -27,6 +30,9 @@ bool set_date_string(char *date);
 // finds connection header in buffer (can be client's or upstream's) and respects its value
 void set_connection(const char *buffer, Connection *conn);
 
+// status code in the status line of response, 0 if there is none
+uint get_response_status(const char *response);
+
 // for logging request to stdout
 void print_request(const Connection *conn);
 
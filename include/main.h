@@ -3,6 +3,7 @@
 #include "openssl/crypto.h"
 #include <regex.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "args.h"
 
@@ -34,15 +35,48 @@
 // event.h specific
 #define BUFFER_SIZE (size_t)8192
 #define MB (size_t)1048576
-#define READ_FLAGS (int)(EPOLLIN | EPOLLET | EPOLLONESHOT | EPOLLHUP | EPOLLRDHUP | EPOLLERR)
-#define WRITE_FLAGS (int)(EPOLLOUT | EPOLLET | EPOLLONESHOT | EPOLLHUP | EPOLLRDHUP | EPOLLERR)
-#define ERROR_FLAGS (int)(EPOLLHUP | EPOLLRDHUP | EPOLLERR)
+// conn fds are registered once with both directions, edge triggered
+// EPOLLERR & EPOLLHUP are always reported
+#define EVENT_FLAGS (int)(EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP)
+#define READABLE_FLAGS (uint32_t)(EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)
+#define WRITABLE_FLAGS (uint32_t)(EPOLLOUT | EPOLLHUP | EPOLLERR)
+// if the endpoint is ready in the direction of flags, EPOLLIN or EPOLLOUT
+#define IS_READY(endpoint_p, flags)                                                                \
+  ((flags) & EPOLLIN ? (endpoint_p)->readable : (endpoint_p)->writable)
+#define RING_ENTRIES 1024 // submission entries of the io_uring backend, per worker
+#define RECV_BUFFERS_MAX 32768 // provided buffers of the io_uring backend, per worker
+
+// connection.h specific
+#define RING_SIZE (BUFFER_SIZE - 1) // the last byte of a buffer stays a null terminator
+#ifndef RING_HIGH_WATERMARK
+#define RING_HIGH_WATERMARK RING_SIZE // bytes in a ring that pause reads into it
+#endif
+#ifndef RING_LOW_WATERMARK
+#define RING_LOW_WATERMARK (RING_SIZE / 4) // bytes left in a paused ring when reads resume
+#endif
 
 // proxy.h specific
 #define BACKLOG 25
 #define MAX_EVENTS 32
-#define MAX_CONNECTIONS 256
+#define MAX_CONNECTIONS 256          // default capacity of the conn table, per worker
+#define MAX_CONNECTIONS_LIMIT 1048576 // max capacity that can be set with a flag
+#define RESERVED_FDS 64               // fds not used by conns, like listeners & std streams
 #define FALLBACK_UPSTREAM_PORT "80" // change this to 443 after SSL
+
+// upstream.h specific
+#define MAX_CONNECT_ATTEMPTS 4 // connects raced at once per conn, RFC 8305 happy eyeballs
+#define MAX_UPSTREAMS 64              // members of the upstream group
+#define MAX_UPSTREAM_WEIGHT 100
+#define NO_MEMBER SIZE_MAX            // conn has no member selected
+#define UNIX_SCHEME "unix:"           // members that are a unix domain socket path
+#define MAX_IDLE_UPSTREAMS 32         // default idle upstream conns kept, per worker
+#define MAX_IDLE_UPSTREAMS_LIMIT 65536 // max that can be set with a flag
+#ifndef UPSTREAM_RETRIES
+#define UPSTREAM_RETRIES 2 // times a request is sent again after an upstream failure
+#endif
+#ifndef IDLE_UPSTREAM_TIMEOUT
+#define IDLE_UPSTREAM_TIMEOUT 15000 // ms, idle upstream conns are closed after this
+#endif
 #ifndef DOMAIN_CERT
 #define DOMAIN_CERT "/etc/ssl/domain/domain.cert"
 #endif
@@ -50,25 +84,134 @@
 #define PRIVATE_KEY "/etc/ssl/domain/private.key"
 #endif
 
+// worker.h specific
+#define MAX_WORKERS 256
+#define WAKEUP_SIGNAL SIGUSR1  // interrupts epoll_wait() of workers on shutdown
+#define MIN_WORKER_LIFETIME 1 // secs, worker processes dying sooner are respawned with a delay
+
+// pool.h specific
+#define POOL_SLAB_SIZE (2 * MB) // size of a huge page
+#define CACHE_LINE (size_t)64
+
+// balancer.h specific
+#define EWMA_ALPHA 0.3            // weight of the newest latency sample
+#define HASH_POINTS_PER_WEIGHT 40 // points on the consistent hash ring, per unit of weight
+#ifndef CONCURRENCY_INITIAL
+#define CONCURRENCY_INITIAL 32 // outstanding requests a member is allowed before any sample
+#endif
+#ifndef CONCURRENCY_MIN
+#define CONCURRENCY_MIN 1
+#endif
+#ifndef CONCURRENCY_MAX
+#define CONCURRENCY_MAX 1024
+#endif
+#define LIMIT_BACKOFF 0.9      // multiplicative decrease of the limit
+#define LIMIT_TOLERANCE 2.0    // latency over this times the baseline cuts the limit
+#define LIMIT_SLACK 5          // ms, added to the baseline, as latencies are only ms precise
+#define MIN_LATENCY_DRIFT 0.01 // of every sample above the baseline, added to it
+#ifndef WAIT_QUEUE_MAX
+#define WAIT_QUEUE_MAX 1024 // requests waiting for a member per worker, more get a 503 right away
+#endif
+#ifndef OUTLIER_FAILURES
+#define OUTLIER_FAILURES 5 // connect failures or 5xx responses in a row that eject a member
+#endif
+#define OUTLIER_EJECTION 10000      // ms, first ejection of a member, doubled on every next one
+#define OUTLIER_EJECTION_MAX 300000 // ms
+#define OUTLIER_MAX_EJECTED 50      // percent of the members that can be ejected at once
+#ifndef QUEUE_TIMEOUT
+#define QUEUE_TIMEOUT 1000 // ms, a request waiting longer gets a 503
+#endif
+
+// health.h specific
+#define HEALTH_CHECK_PATH "/" // default path of the health probes
+#define HEALTH_PATH_MAX 1024
+#define DEFAULT_HEALTH_INTERVAL 2000 // ms, default time between the probes of a member
+#define HEALTH_INTERVAL_MIN 100      // ms, range that can be set with a flag
+#define HEALTH_INTERVAL_MAX 3600000
+#ifndef HEALTH_TIMEOUT
+#define HEALTH_TIMEOUT 1000 // ms, a probe taking longer fails
+#endif
+#ifndef HEALTH_RISE
+#define HEALTH_RISE 2 // passed probes in a row to bring a member back
+#endif
+#ifndef HEALTH_FALL
+#define HEALTH_FALL 2 // failed probes in a row to take a member out of rotation
+#endif
+
+// hedge.h specific
+#define HEDGE_PERCENTILE_MIN 50 // range that can be set with a flag
+#define HEDGE_PERCENTILE_MAX 99
+#define HEDGE_DELAY_MIN 5       // ms, requests are never hedged sooner
+#define HEDGE_DELAY_MAX 1000    // ms, latencies above are counted at this, the histogram size
+#define HEDGE_SAMPLES_MIN 100   // latencies recorded before the first hedge
+#define HEDGE_SAMPLES_MAX 10000 // the histogram is halved at this
+#define HEDGE_RECOMPUTE 64      // samples between updates of the percentile
+#ifndef HEDGE_BUDGET
+#define HEDGE_BUDGET 10 // percent of the requests that can be hedged
+#endif
+
+// h2.h specific
+#define H2_ALPN "\x02h2\x08http/1.1" // offered to https upstreams with -2, h2 preferred
+#define H2_STREAM_WINDOW (BUFFER_SIZE / 2) // flow control window of a stream, fits its buffer
+#define H2_SESSION_WINDOW (1 << 24)        // of a session, given back as soon as data arrives
+#define H2_HEADERS_MAX (BUFFER_SIZE - H2_STREAM_WINDOW - 64) // response headers, as http/1.1
+#ifndef H2_MAX_STREAMS
+#define H2_MAX_STREAMS 100 // concurrent streams of a session, if the upstream allows as many
+#endif
+#ifndef H2_MAX_FIELDS
+#define H2_MAX_FIELDS 128 // request header fields sent in a HEADERS frame
+#endif
+#ifndef H2_SESSIONS_MAX
+#define H2_SESSIONS_MAX 4 // sessions kept to a member, per worker
+#endif
+
+// splice.h specific
+#define SPLICE_PIPE_SIZE (1 << 16) // bytes a relay pipe is asked to hold, the linux default
+#ifndef SPLICE_MIN
+#define SPLICE_MIN (4 * BUFFER_SIZE) // body bytes left for a response to be spliced, not copied
+#endif
+#ifndef PIPES_MAX
+#define PIPES_MAX 64 // empty pipes kept per worker for the next relays
+#endif
+
+// zerocopy.h specific
+#ifndef ZEROCOPY_MIN
+#define ZEROCOPY_MIN (BUFFER_SIZE / 2) // ring bytes in one piece for a send to be zerocopy
+#endif
+#ifndef ZEROCOPY_SENDS_MAX
+#define ZEROCOPY_SENDS_MAX 8 // zerocopy sends in flight per client, a power of 2
+#endif
+
+// resolver.h specific
+#define DNS_TTL 30        // secs, default time between re-resolutions of the upstreams
+#define DNS_TTL_MAX 86400 // max that can be set with a flag
+
 // client.h specific
 #define TRAILER "\r\n\r\n"
 #define LINEBREAK "\r\n"
 #define SPACE " "
 #define LAST_CHUNK "0" TRAILER
+#define CONTINUE "HTTP/1.1 100 Continue" TRAILER // written by the proxy for Expect: 100-continue
+#define CONTINUE_VALUE "100-continue"
 #define TRAILER_STR STR(TRAILER)
 #define LINEBREAK_STR STR(LINEBREAK)
 #define SPACE_STR STR(SPACE)
 #define LAST_CHUNK_STR STR(LAST_CHUNK)
+#define CONTINUE_STR STR(CONTINUE)
+#define CONTINUE_VALUE_STR STR(CONTINUE_VALUE)
 // only to assign the string literal to str.data if str.data is null
 #define ASSIGN_IF_NULL(str, literal) !str.data ? STR(literal) : str
 
 // timeout.h specific
 #define EXPIRES(timeout_p)                                                                         \
-  (timeout_p->ttl > (now - timeout_p->start)                                                       \
-       ? timeout_p->ttl - (now - timeout_p->start)                                                 \
-       : 0) // 'now' should be already defined as time(NULL) in the same scope
+  (timeout_p->expires > now ? timeout_p->expires - now                                             \
+                            : 0) // 'now' should be already defined as loop_time in the same scope
+#define WHEEL_TICK 10     // ms per tick of the timing wheel
+#define WHEEL_SLOTS 8192  // power of 2, ticks per revolution, covers every default timeout
+#define EXPIRED_SLOT WHEEL_SLOTS
 
-extern bool RUNNING;
+extern volatile bool RUNNING; // read by every worker thread
 extern Config config;
 extern regex_t origin_regex;
-extern SSL_CTX *ssl_context;
+extern SSL_CTX *ssl_context;          // server side, for clients
+extern SSL_CTX *upstream_ssl_context; // client side, for https upstreams
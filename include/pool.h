@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "connection.h"
+
+// slab pool of Connection objects, one per worker
+// slabs are POOL_SLAB_SIZE bytes of prefaulted memory, backed by huge pages if asked & available
+// every conn starts on a cache line, free conns are linked through their own memory,
+// so getting & putting a conn is O(1) and never touches malloc
+
+typedef struct pool_stats
+{
+  size_t gets;       // conns handed out
+  size_t hits;       // gets served from the free list, without growing
+  size_t growths;    // slabs allocated, including the first
+  size_t huge_slabs; // slabs backed by explicit huge pages
+  size_t in_use;     // conns currently handed out
+  size_t capacity;   // conns that fit in all the slabs
+} PoolStats;
+
+// free conns overlay this on their own memory
+typedef struct free_node
+{
+  struct free_node *next;
+} FreeNode;
+
+typedef struct conn_pool
+{
+  FreeNode *free_list;
+  FreeNode *retired;      // put back during the current batch of events, not handed out yet
+  FreeNode *retired_tail; // so the retired conns join the free list in O(1)
+  FreeNode *draining;     // put back with zerocopy sends in flight, till drain_zerocopy()
+  void **slabs;
+  size_t slabs_num;
+  size_t slabs_cap;
+  size_t stride;   // sizeof(Connection) rounded up to a cache line
+  size_t per_slab; // conns per slab
+  bool huge_pages; // try MAP_HUGETLB for new slabs
+  PoolStats stats;
+} ConnPool;
+
+extern _Thread_local ConnPool conn_pool;
+
+// sets up the pool of the calling thread & preallocates the first slab
+bool setup_conn_pool(bool huge_pages);
+
+// maps a new slab & links all of its conns to the free list
+bool grow_conn_pool(void);
+
+// returns an uninitialized conn, growing the pool by a slab if no conn is free
+Connection *get_pooled_conn(void);
+
+// retires conn, it only goes back to the free list with recycle_pooled_conns()
+// events of the same batch may still point to its endpoints, & would reach whichever conn
+// got the memory next. a conn kept by abort_zerocopy() is not recycled before its ring is free
+void put_pooled_conn(Connection *conn);
+
+// moves the retired conns to the free list, once no fetched event is left to handle, and the
+// draining ones whose zerocopy sends were all acked
+void recycle_pooled_conns(void);
+
+// unmaps every slab, every conn handed out is invalid after this
+void free_conn_pool(void);
+
+void print_pool_stats(void);
@@ -1,19 +1,25 @@
 #pragma once
 
 #include <openssl/crypto.h>
+#include <signal.h>
 
 #include "connection.h"
 
-extern int EPOLL_FD;
-
 SSL_CTX *setup_tls(void);
 
+// client context for https upstreams: verifies them against the -C bundle or the system store,
+// and hands new sessions to the session cache of the worker
+SSL_CTX *setup_upstream_tls(void);
+
 bool setup_proxy(const Config *config, int *proxy_fd);
 
-// sets up epoll() and sets the global var EPOLL_FD for new epoll instance
+// sets up the event instance of the calling thread and adds proxy_fd to it
 bool setup_epoll(int proxy_fd);
 
-bool start_proxy(void);
+// runs the event loop till shutdown
+// wait_mask is used as the signal mask while waiting for events, the signals that should stop the
+// loop should only be unblocked in it
+bool start_proxy(const sigset_t *wait_mask);
 
 // mods state of the connection
 void handle_state(Connection *conn);
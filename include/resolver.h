@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdbool.h>
+
+// background re-resolution of the upstream hostnames, so rotated backend ips are picked up
+// without a restart
+// a helper thread calls the blocking getaddrinfo() for every member that is not an ip address,
+// every config.dns_ttl secs, and swaps in the new addresses if they changed. event loops only
+// take addrs_lock to count a reference, so they never wait on a lookup
+// a failed lookup keeps the last addresses
+
+// starts the resolver thread of the calling process, if any member needs it & dns_ttl is set
+bool start_resolver(void);
+
+// wakes the resolver thread up & joins it, waiting for a lookup in progress
+void stop_resolver(void);
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "connection.h"
+
+// zero copy relay of response bodies
+// once the headers & the start of a plaintext content-length response were written from the
+// upstream buffer, a body with SPLICE_MIN bytes or more left is moved upstream -> pipe -> client
+// with splice(), so it never reaches user space. the content length is counted down as bytes
+// enter the pipe, so nothing past the response is read & the upstream can still be pooled
+// pipes are taken from a per-worker pool of empty ones, and given back once drained
+// io_uring builds never splice, as the recv in flight on the upstream would race it for the bytes
+
+typedef struct pipe_pool
+{
+  int (*pipes)[2]; // empty pipes, read & write ends
+  size_t pipes_num;
+  size_t pipes_cap;
+  size_t created;  // pipes opened, the rest of the relays reused a pooled one
+  size_t relays;   // responses spliced
+  size_t spliced;  // body bytes moved through pipes
+  size_t fallback; // responses copied through the buffer, as no pipe could be opened
+} PipePool;
+
+extern _Thread_local PipePool pipe_pool;
+
+// allocates the pipe pool of the calling thread
+bool setup_pipe_pool(void);
+
+// closes every pooled pipe
+void free_pipe_pool(void);
+
+// true if the rest of the response of conn can be spliced: both ends plaintext, a content-length
+// body with at least SPLICE_MIN bytes left to read, the ring written in full & no failed pipe
+bool can_splice(const Connection *conn);
+
+// moves body bytes from the upstream into the pipe of conn & from the pipe to the client, while
+// either end is ready. sets conn state to CHECK_CONN once the body is relayed in full, or to
+// CLOSE_CONN on an error, as the client already has part of the response
+// falls back to READ_RESPONSE if no pipe could be taken
+void splice_response(Connection *conn);
+
+// gives the pipe of conn back to the pool if it is empty, closes it otherwise
+void release_pipe(Connection *conn);
+
+// logging & debugging
+void print_pipe_pool_stats(void);
@@ -1,8 +1,12 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
+#include "main.h"
+
 typedef struct connection Connection;
 
 typedef enum
@@ -12,6 +16,15 @@ typedef enum
   RESPONSE_READ,
   RESPONSE_WRITE,
   CONNECTION,
+  UPSTREAM_CONNECT, // overall deadline for connecting to any upstream address
+  CONNECT_ATTEMPT,  // delay before racing the next address, does not close the conn
+  CLIENT_HANDSHAKE,
+  UPSTREAM_HANDSHAKE,
+  HEALTH_INTERVAL, // starts the next health probe, does not close the probe conn
+  HEALTH_PROBE,    // deadline of a health probe, counts as a failed probe
+  QUEUE_WAIT,      // deadline of a request in the wait queue, answered with a 503
+  HEDGE_DELAY,     // sends a copy of a slow request, does not close the conn
+  SESSION_IDLE,    // closes an http/2 upstream session without streams
   TIMEOUTTYPES // len of enum
 } TimeoutType;
 
@@ -19,44 +32,84 @@ typedef struct timeout
 {
   Connection *conn; // what conn to close in case timeout expires
   TimeoutType type; // conn or state
-  time_t start;     // time when timeout starts
-  time_t ttl;       // when does the timeout expire
-  bool active;      // is the timeout currently in the list
-  struct timeout *next;
+  int64_t start;    // ms, monotonic time when timeout starts
+  int64_t ttl;      // ms, when does the timeout expire
+  int64_t expires;  // ms, start + ttl, absolute time the timeout is due at
+  size_t slot;      // wheel slot (or EXPIRED_SLOT) whose list the timeout is in
+  bool active;      // is the timeout currently in the wheel
+  struct timeout *next, *prev;
 } Timeout;
 
-// will contain int timeouts at correspoding state indices
+// will contain int timeouts (ms) at correspoding state indices
 extern const int TimeoutVals[TIMEOUTTYPES];
 
-// global list, to be implemented in ascending order of ttl
-extern Timeout *timeouts_head, *timeouts_tail;
+// ms, monotonic time read once per loop iteration by update_loop_time()
+// every timeout started during an iteration uses this, instead of reading the clock again
+extern _Thread_local int64_t loop_time;
+
+// hashed timing wheel, thread local as every worker expires its own conns
+// a tick is WHEEL_TICK ms, timeouts are rounded up to the next tick so they never fire early
+// every slot is a doubly linked list of timeouts due at a tick that hashes to the slot,
+// so arming & cancelling is O(1), and expiring only visits the slots of elapsed ticks
+// timeouts more than one revolution away stay in their slot till their turn comes
+// the extra slot at EXPIRED_SLOT holds timeouts collected for expiry by clear_expired()
+extern _Thread_local Timeout *timeout_wheel[WHEEL_SLOTS + 1];
+
+// bit per slot, set if the slot is not empty, to find the next due slot without visiting
+// every slot
+extern _Thread_local uint64_t wheel_occupied[WHEEL_SLOTS / 64];
+
+// last tick whose slot has been expired
+extern _Thread_local int64_t wheel_time;
+
+// num of active timeouts
+extern _Thread_local size_t timeouts_num;
+
+// reads CLOCK_MONOTONIC into loop_time, immune to wall clock jumps
+void update_loop_time(void);
 
-// adds timeout to global list and marks it active, preserving expires order
+// resets the wheel of the calling thread, starting at the current time
+void setup_timeouts(void);
+
+// links timeout at the head of a slot list
+void push_timeout(Timeout *timeout, size_t slot);
+
+// unlinks timeout from the slot list it is in
+void unlink_timeout(Timeout *timeout);
+
+// adds timeout to the slot of its expiry tick and marks it active
 void enqueue_timeout(Timeout *timeout);
 
-// removes the first timeout, if it has expired, and marks it inactive
+// removes the first timeout collected for expiry, and marks it inactive
 // intended to be used in a loop to dequeue all expired timeouts
 Timeout *dequeue_timeout(void);
 
-// loops and dequeues all dead conns
+// collects timeouts due in the slots of elapsed ticks & dequeues all dead conns
 void clear_expired(void);
 
-// enqueues the timeout after setting its ttl
+// ms till the nearest occupied slot is due, to be used as the wait timeout
+// -1 if no timeout is active
+int next_expiry(void);
+
+// enqueues the timeout after setting its ttl (ms)
 // pass ttl as -1 to use default value
 // use for keep-alive timeout as well
 // also removes previous timeout, if active
-void start_conn_timeout(Connection *conn, time_t ttl);
+void start_conn_timeout(Connection *conn, int64_t ttl);
 
 // uses default timeouts depending on the state
 void start_state_timeout(Connection *conn, TimeoutType type);
 
-// removes timeout entry from the list, and marks it as inactive
+// starts the next address if the current connect attempt is still pending by then
+void start_attempt_timeout(Connection *conn);
+
+// removes timeout entry from its slot, and marks it as inactive
 // used for early removal (before timeout expiring)
 // freeing a conn also removes all its timeouts
 void remove_timeout(Timeout *timeout);
 
 // automatically determines created and ttl (if -1) based on type
-void fill_timeout(Connection *conn, TimeoutType type, time_t ttl);
+void fill_timeout(Connection *conn, TimeoutType type, int64_t ttl);
 
 const char *get_type_string(TimeoutType type);
 
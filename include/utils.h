@@ -51,9 +51,16 @@ void handle_shutdown(int sig);
 
 void handle_sigpipe(int sig);
 
+// does nothing, only used to interrupt worker threads
+void handle_wakeup(int sig);
+
 // prints number of active connections
 void print_active_num(void);
 
+// raises the soft limit of open fds to at least needed, capped at the hard limit
+// warns if needed fds cannot be opened
+bool raise_fd_limit(size_t needed);
+
 void print_banner(void);
 
 // out should point to a memory that can hold the final string
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
+
+typedef struct worker
+{
+  pthread_t thread; // thread mode
+  pid_t pid;        // process mode, 0 if not running
+  time_t spawned;   // process mode, for throttling crash loops
+  time_t respawn;   // process mode, when a dead worker is spawned again, 0 if not pending
+  unsigned int id;
+  bool started; // only started workers are woken up & joined
+} Worker;
+
+// blocks the signals in handled for the calling thread & fills wait_mask with the mask to use
+// while waiting for events, i.e., the previous mask without the handled signals
+// keeping them blocked otherwise means they are never missed between checking RUNNING and
+// going to sleep
+bool block_signals(const sigset_t *handled, sigset_t *wait_mask);
+
+// runs the event loop on an already listening socket till shutdown
+// everything set up is freed before returning, except proxy_fd
+bool serve(int proxy_fd, const sigset_t *wait_mask);
+
+// sets up a listening socket & an epoll instance for the calling thread and runs the event loop
+// on them till shutdown, everything set up is freed before returning
+bool run_worker(unsigned int id);
+
+// thread entry point, arg should point to the Worker of the thread
+void *worker_thread(void *arg);
+
+// spawns num worker threads & blocks till a shutdown signal is received,
+// after which every worker is woken up and joined
+// every worker owns its own listener (SO_REUSEPORT), epoll instance, conns & timeouts,
+// so no locking is required on the hot path
+bool start_workers(unsigned int num);
+
+// forks a worker process that serves on the inherited proxy_fd till shutdown & then exits
+// fills worker->pid in the master
+bool spawn_process(Worker *worker, int proxy_fd);
+
+// master process: sets up the listening socket once & forks num workers on it
+// crashed workers are respawned & shutdown signals are forwarded to every worker
+// a worker that crashes (e.g. a failed assert) only takes down its own conns
+bool start_processes(unsigned int num);
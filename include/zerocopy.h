@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "connection.h"
+
+// MSG_ZEROCOPY sends of response bodies to plaintext clients, in builds with USE_ZEROCOPY
+// and without USE_IO_URING, whose sends are of a copy already
+// a send of ZEROCOPY_MIN ring bytes or more pins them for the kernel instead of copying them,
+// so they stay held in the ring till its completion is read from the error queue of the client,
+// which epoll reports as EPOLLERR. a client the kernel copied for anyway, like a local one, goes
+// back to plain writes
+
+typedef struct zerocopy_stats
+{
+  size_t sends;    // zerocopy sends
+  size_t bytes;    // bytes sent zerocopy
+  size_t copied;   // completions of sends the kernel copied after all
+  size_t fallback; // clients moved to plain writes
+  size_t drained;  // freed conns kept out of the pool till their sends were acked
+} ZerocopyStats;
+
+extern _Thread_local ZerocopyStats zerocopy_stats;
+
+// writes len ring bytes at data to the plaintext client of conn, returns like write()
+// a zerocopy send adds its bytes to the held ones of the upstream ring before they are popped,
+// & fails with EAGAIN while ZEROCOPY_SENDS_MAX sends are in flight, till a completion
+// plain writes wait the same way for the held bytes, so the ring is freed in order
+ssize_t send_ring(Connection *conn, const char *data, size_t len);
+
+// reads every completion queued on the client of conn & releases the ring bytes of the sends
+// acked in order. false if the queue held an actual error of the socket
+bool reap_zerocopy(Connection *conn);
+
+// resets the client of conn, freed with zerocopy sends in flight, but keeps its fd open, as the
+// kernel may still read the ring of conn, from the socket or a packet the qdisc or driver holds
+// false if no send is in flight, the client is closed as usual then
+bool abort_zerocopy(Connection *conn);
+
+// reaps the completions of a conn abort_zerocopy() kept, and closes its client once every send
+// is acked. false till then, the conn stays out of the pool
+bool drain_zerocopy(Connection *conn);
+
+// logging & debugging
+void print_zerocopy_stats(void);
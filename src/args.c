@@ -6,9 +6,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "args.h"
+#include "balancer.h"
+#include "event.h"
 #include "main.h"
+#include "upstream.h"
 #include "utils.h"
 
 Config parse_args(int argc, char *argv[])
@@ -16,7 +21,21 @@ Config parse_args(int argc, char *argv[])
   Config config = {.port = NULL,
                    .canonical_host = NULL,
                    .upstream = NULL,
+                   .threads = 1,
+                   .processes = 1,
+                   .max_conns = MAX_CONNECTIONS,
+                   .max_idle = MAX_IDLE_UPSTREAMS,
+                   .lb_policy = ROUND_ROBIN,
+                   .adaptive_limit = false,
+                   .health_path = NULL,
+                   .health_interval = DEFAULT_HEALTH_INTERVAL,
+                   .health_checks = false,
+                   .dns_ttl = DNS_TTL,
+                   .upstream_ca = NULL,
+                   .hedge_percentile = 0,
+                   .upstream_h2 = false,
                    .accept_all = false,
+                   .huge_pages = false,
                    .log_warnings = false,
                    .client_https = false,
                    .upstream_https = false};
@@ -24,9 +43,19 @@ Config parse_args(int argc, char *argv[])
   int arg;
   unsigned int args_parsed = 0;
 
-  while ((arg = getopt(argc, argv, "ac:hp:sSu:vw")) != -1)
+  while ((arg = getopt(argc, argv, "2ac:C:d:f:g:hHi:k:l:Lm:p:r:sSt:u:vw")) != -1)
     switch (arg)
     {
+    case '2':
+#ifdef USE_NGHTTP2
+      config.upstream_h2 = true;
+      args_parsed++;
+      break;
+#else
+      err("parse_args", "Option '-2' requires a build with NGHTTP2=1");
+      free_config(&config);
+      exit(EXIT_FAILURE);
+#endif
     case 'a':
       config.accept_all = true;
       args_parsed++;
@@ -41,10 +70,96 @@ Config parse_args(int argc, char *argv[])
       config.canonical_host = strdup(optarg);
       args_parsed++;
       break;
+    case 'C':
+      if (!validate_ca_file(optarg))
+      {
+        err("validate_ca_file", strerror(errno));
+        free_config(&config);
+        exit(EXIT_FAILURE);
+      }
+      free(config.upstream_ca); // in case the flag is passed twice
+      config.upstream_ca = strdup(optarg);
+      args_parsed++;
+      break;
+    case 'd':
+      if (!validate_hedge_percentile(optarg, &config.hedge_percentile))
+      {
+        err("validate_hedge_percentile", strerror(errno));
+        free_config(&config);
+        exit(EXIT_FAILURE);
+      }
+      args_parsed++;
+      break;
+    case 'f':
+      if (!validate_workers(optarg, &config.processes))
+      {
+        err("validate_workers", strerror(errno));
+        free_config(&config);
+        exit(EXIT_FAILURE);
+      }
+      args_parsed++;
+      break;
+    case 'g':
+      if (!validate_health_path(optarg))
+      {
+        err("validate_health_path", strerror(errno));
+        free_config(&config);
+        exit(EXIT_FAILURE);
+      }
+      free(config.health_path); // in case the flag is passed twice
+      config.health_path = strdup(optarg);
+      config.health_checks = true;
+      args_parsed++;
+      break;
     case 'h':
       print_usage(argv[0]);
       free_config(&config);
       exit(EXIT_SUCCESS);
+    case 'H':
+      config.huge_pages = true;
+      args_parsed++;
+      break;
+    case 'i':
+      if (!validate_health_interval(optarg, &config.health_interval))
+      {
+        err("validate_health_interval", strerror(errno));
+        free_config(&config);
+        exit(EXIT_FAILURE);
+      }
+      config.health_checks = true;
+      args_parsed++;
+      break;
+    case 'k':
+      if (!validate_max_idle(optarg, &config.max_idle))
+      {
+        err("validate_max_idle", strerror(errno));
+        free_config(&config);
+        exit(EXIT_FAILURE);
+      }
+      args_parsed++;
+      break;
+    case 'l':
+      if (!validate_lb_policy(optarg, &config.lb_policy))
+      {
+        err("validate_lb_policy", strerror(errno));
+        free_config(&config);
+        exit(EXIT_FAILURE);
+      }
+      args_parsed++;
+      break;
+    case 'L':
+      config.adaptive_limit = true;
+      args_parsed++;
+      break;
+    case 'm':
+      if (!validate_max_conns(optarg, &config.max_conns))
+      {
+        err("validate_max_conns", strerror(errno));
+        free_config(&config);
+        exit(EXIT_FAILURE);
+      }
+      args_parsed++;
+      break;
     case 'p':
       if (!validate_port(optarg))
       {
@@ -55,6 +170,15 @@ Config parse_args(int argc, char *argv[])
       config.port = strdup(optarg);
       args_parsed++;
       break;
+    case 'r':
+      if (!validate_dns_ttl(optarg, &config.dns_ttl))
+      {
+        err("validate_dns_ttl", strerror(errno));
+        free_config(&config);
+        exit(EXIT_FAILURE);
+      }
+      args_parsed++;
+      break;
     case 's':
       config.client_https = true;
       args_parsed++;
@@ -63,10 +187,19 @@ Config parse_args(int argc, char *argv[])
       config.upstream_https = true;
       args_parsed++;
       break;
+    case 't':
+      if (!validate_workers(optarg, &config.threads))
+      {
+        err("validate_workers", strerror(errno));
+        free_config(&config);
+        exit(EXIT_FAILURE);
+      }
+      args_parsed++;
+      break;
     case 'u':
-      if (!exec_regex(&origin_regex, optarg))
+      if (!validate_upstreams(optarg))
       {
-        err("exec_regex", "Invalid upstream url passed");
+        err("validate_upstreams", "Invalid upstream url or weight passed");
         if (config.port)
           free(config.port);
         exit(EXIT_FAILURE);
@@ -84,10 +217,30 @@ Config parse_args(int argc, char *argv[])
               // 'optopt' is set to the flag
       if (optopt == 'c')
         err("parse_args", "Option '-c' requires a valid canonical host");
+      else if (optopt == 'C')
+        err("parse_args", "Option '-C' requires a readable CA bundle file");
+      else if (optopt == 'd')
+        err("parse_args", "Option '-d' requires a valid latency percentile");
+      else if (optopt == 'f')
+        err("parse_args", "Option '-f' requires a valid number of worker processes");
+      else if (optopt == 'g')
+        err("parse_args", "Option '-g' requires a valid health check path");
+      else if (optopt == 'i')
+        err("parse_args", "Option '-i' requires a valid health check interval in ms");
+      else if (optopt == 'k')
+        err("parse_args", "Option '-k' requires a valid number of idle upstream connections");
+      else if (optopt == 'l')
+        err("parse_args", "Option '-l' requires a policy: rr, least, p2c or hash");
+      else if (optopt == 'm')
+        err("parse_args", "Option '-m' requires a valid number of connections");
       else if (optopt == 'p')
         err("parse_args", "Option '-p' requires a valid port number");
+      else if (optopt == 'r')
+        err("parse_args", "Option '-r' requires a valid number of secs");
+      else if (optopt == 't')
+        err("parse_args", "Option '-t' requires a valid number of worker threads");
       else if (optopt == 'u')
-        err("parse_args", "Option '-u' requires a valid upstream url");
+        err("parse_args", "Option '-u' requires a valid list of upstream urls");
       else if (isprint(optopt))
         err("parse_args", "Unknown option");
       else
@@ -98,6 +251,14 @@ Config parse_args(int argc, char *argv[])
       exit(EXIT_FAILURE);
     }
 
+  // listeners differ between the two modes
+  if (config.threads > 1 && config.processes > 1)
+  {
+    err("parse_args", "Options '-f' and '-t' cannot be used together");
+    free_config(&config);
+    exit(EXIT_FAILURE);
+  }
+
   // if not set with flag, verifying default values, using strdup() because
   // config is freed in case of error
   if (!config.canonical_host)
@@ -122,6 +283,9 @@ Config parse_args(int argc, char *argv[])
     config.upstream = strdup(DEFAULT_UPSTREAM);
   }
 
+  if (!config.health_path)
+    config.health_path = strdup(HEALTH_CHECK_PATH);
+
   if (!config.port)
   {
     if (!(validate_port(DEFAULT_PORT)))
@@ -144,13 +308,26 @@ void print_usage(const char *prg)
 
   printf("\nUsage: %s [OPTIONS] [ARGS...]\n"
          "Options:\n"
+         "-2             Multiplex requests over HTTP/2 to the upstreams that speak it.\n"
          "-a             Accept Incoming Connections from all IPs, defaults to Localhost only.\n"
-         "-c             Canonical Host to redirect requests to."
+         "-c             Canonical Host to redirect requests to.\n"
+         "-C <file>      CA bundle to verify HTTPS upstreams with, defaults to the system store.\n"
+         "-d <pct>       Hedge GETs whose response is slower than this latency percentile.\n"
+         "-f <num>       Number of worker processes, forked by a supervising master.\n"
+         "-g <path>      Path the health checks GET from every upstream, enables them.\n"
          "-h             Print this help message.\n"
+         "-H             Back the connection pool with huge pages, if available.\n"
+         "-i <ms>        Interval between the health checks of an upstream, enables them.\n"
+         "-k <num>       Max number of idle upstream connections kept per worker, 0 disables.\n"
+         "-l <policy>    Load balancing across upstreams: rr, least, p2c or hash.\n"
+         "-L             Limit the requests in flight of an upstream by its latency.\n"
+         "-m <num>       Max number of concurrent connections per worker.\n"
          "-p <port>      Port to listen on.\n"
+         "-r <secs>      Re-resolve upstream hostnames in the background every secs, 0 disables.\n"
          "-s             Use HTTPS Protocol for client side.\n"
          "-S             Use HTTPS Protocol for server side.\n"
-         "-u <upstream>  Server URL to contact for response.\n"
+         "-t <num>       Number of worker threads, each with its own listener & event loop.\n"
+         "-u <upstreams> Comma separated server URLs to contact for response, url@weight.\n"
          "-v             Print the version number.\n"
          "-w             Print all warnings with errors.\n",
          prg);
@@ -164,14 +341,37 @@ void print_args(unsigned int args_parsed, const Config *config)
   if (args_parsed)
     printf("\nParsed %u Argument(s).", args_parsed);
 
+  char hedging[24] = "disabled";
+  if (config->hedge_percentile)
+    snprintf(hedging, sizeof hedging, "after p%u", config->hedge_percentile);
+
   printf("\nCanonical Host set to: %s\n"
          "Upstream URL set to: %s\n"
          "Listening Port set to: %s\n"
          "Client side protocol set to: %s\n"
-         "Upstream side protocol set to: %s\n"
+         "Upstream side protocol set to: %s%s\n"
+         "Upstream CA bundle set to: %s\n"
+         "Worker threads set to: %u\n"
+         "Worker processes set to: %u\n"
+         "Max connections per worker set to: %zu\n"
+         "Max idle upstream connections per worker set to: %zu\n"
+         "Load balancing set to: %s\n"
+         "Adaptive concurrency limit set to: %s\n"
+         "Health checks set to: GET %s every %ldms%s\n"
+         "Upstream re-resolution set to: every %us\n"
+         "Hedged requests set to: %s\n"
+         "Huge pages set to: %s\n"
+         "Event backend set to: %s\n"
          "Log Warnings set to: %s\n",
          config->canonical_host, config->upstream, config->port,
          config->client_https ? "HTTPS" : "HTTP", config->upstream_https ? "HTTPS" : "HTTP",
+         config->upstream_h2 ? ", HTTP/2" : "",
+         config->upstream_ca ? config->upstream_ca : "system store",
+         config->threads, config->processes, config->max_conns, config->max_idle,
+         get_policy_string(config->lb_policy), config->adaptive_limit ? "true" : "false",
+         config->health_path, config->health_interval,
+         config->health_checks ? "" : ", with more than one upstream", config->dns_ttl,
+         hedging, config->huge_pages ? "true" : "false", get_backend_string(),
          config->log_warnings ? "true" : "false");
 
   config->accept_all ? puts("Proxy Accepting Incoming Connections from all IPs.\n")
@@ -199,6 +399,229 @@ bool validate_port(char *port)
   return true;
 }
 
+bool validate_workers(const char *workers, unsigned int *out)
+{
+  if (!workers || !out)
+    return set_efault();
+
+  char *end;
+  const long num = strtol(workers, &end, 10);
+  if (*end != '\0')
+  {
+    errno = EINVAL;
+    return false;
+  }
+  if (num < 1 || num > MAX_WORKERS)
+  {
+    errno = ERANGE;
+    return false;
+  }
+
+  *out = (unsigned int)num;
+  return true;
+}
+
+bool validate_max_conns(const char *max_conns, size_t *out)
+{
+  if (!max_conns || !out)
+    return set_efault();
+
+  char *end;
+  const long num = strtol(max_conns, &end, 10);
+  if (*end != '\0')
+  {
+    errno = EINVAL;
+    return false;
+  }
+  if (num < 1 || num > MAX_CONNECTIONS_LIMIT)
+  {
+    errno = ERANGE;
+    return false;
+  }
+
+  *out = (size_t)num;
+  return true;
+}
+
+bool validate_max_idle(const char *max_idle, size_t *out)
+{
+  if (!max_idle || !out)
+    return set_efault();
+
+  char *end;
+  const long num = strtol(max_idle, &end, 10);
+  if (*end != '\0')
+  {
+    errno = EINVAL;
+    return false;
+  }
+  if (num < 0 || num > MAX_IDLE_UPSTREAMS_LIMIT)
+  {
+    errno = ERANGE;
+    return false;
+  }
+
+  *out = (size_t)num;
+  return true;
+}
+
+bool validate_lb_policy(const char *name, LbPolicy *out)
+{
+  if (!name || !out)
+    return set_efault();
+
+  if (!strcmp(name, "rr"))
+    *out = ROUND_ROBIN;
+  else if (!strcmp(name, "least"))
+    *out = LEAST_OUTSTANDING;
+  else if (!strcmp(name, "p2c"))
+    *out = TWO_CHOICES;
+  else if (!strcmp(name, "hash"))
+    *out = PATH_HASH;
+  else
+  {
+    errno = EINVAL;
+    return false;
+  }
+
+  return true;
+}
+
+bool validate_upstreams(const char *list)
+{
+  if (!list)
+    return set_efault();
+
+  char *copy = NULL, *save = NULL, *member = NULL;
+  if (!(copy = strdup(list)))
+    return false;
+
+  size_t members = 0;
+  bool valid = true;
+  unsigned int weight = 0;
+
+  for (member = strtok_r(copy, ",", &save); member && valid;
+       member = strtok_r(NULL, ",", &save))
+    valid = ++members <= MAX_UPSTREAMS && split_weight(member, &weight) &&
+            (strncmp(member, UNIX_SCHEME, sizeof UNIX_SCHEME - 1)
+                 ? exec_regex(&origin_regex, member)
+                 : validate_unix_path(member + sizeof UNIX_SCHEME - 1));
+
+  free(copy);
+  return valid && members;
+}
+
+bool validate_unix_path(const char *path)
+{
+  if (!path)
+    return set_efault();
+
+  if (*path != '/' || strlen(path) >= sizeof(((struct sockaddr_un *)NULL)->sun_path))
+  {
+    errno = EINVAL;
+    return false;
+  }
+
+  return true;
+}
+
+bool validate_health_path(const char *path)
+{
+  if (!path)
+    return set_efault();
+
+  size_t len = strlen(path);
+  if (*path != '/' || len > HEALTH_PATH_MAX)
+  {
+    errno = EINVAL;
+    return false;
+  }
+
+  // would split the request line
+  for (const char *c = path; *c; ++c)
+    if (isspace((unsigned char)*c) || iscntrl((unsigned char)*c))
+    {
+      errno = EINVAL;
+      return false;
+    }
+
+  return true;
+}
+
+bool validate_health_interval(const char *interval, int64_t *out)
+{
+  if (!interval || !out)
+    return set_efault();
+
+  char *end;
+  const long num = strtol(interval, &end, 10);
+  if (*end != '\0')
+  {
+    errno = EINVAL;
+    return false;
+  }
+  if (num < HEALTH_INTERVAL_MIN || num > HEALTH_INTERVAL_MAX)
+  {
+    errno = ERANGE;
+    return false;
+  }
+
+  *out = (int64_t)num;
+  return true;
+}
+
+bool validate_ca_file(const char *path)
+{
+  if (!path)
+    return set_efault();
+
+  return access(path, R_OK) == 0; // errno is set by access()
+}
+
+bool validate_hedge_percentile(const char *percentile, unsigned int *out)
+{
+  if (!percentile || !out)
+    return set_efault();
+
+  char *end;
+  const long num = strtol(percentile, &end, 10);
+  if (*end != '\0')
+  {
+    errno = EINVAL;
+    return false;
+  }
+  if (num && (num < HEDGE_PERCENTILE_MIN || num > HEDGE_PERCENTILE_MAX))
+  {
+    errno = ERANGE;
+    return false;
+  }
+
+  *out = (unsigned int)num;
+  return true;
+}
+
+bool validate_dns_ttl(const char *ttl, unsigned int *out)
+{
+  if (!ttl || !out)
+    return set_efault();
+
+  char *end;
+  const long num = strtol(ttl, &end, 10);
+  if (*end != '\0')
+  {
+    errno = EINVAL;
+    return false;
+  }
+  if (num < 0 || num > DNS_TTL_MAX)
+  {
+    errno = ERANGE;
+    return false;
+  }
+
+  *out = (unsigned int)num;
+  return true;
+}
+
 void free_config(Config *config)
 {
   if (!config)
@@ -212,4 +635,10 @@ void free_config(Config *config)
 
   if (config->port)
     free(config->port);
+
+  if (config->health_path)
+    free(config->health_path);
+
+  if (config->upstream_ca)
+    free(config->upstream_ca);
 }
@@ -0,0 +1,530 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "balancer.h"
+#include "connection.h"
+#include "main.h"
+#include "proxy.h"
+#include "timeout.h"
+#include "upstream.h"
+#include "utils.h"
+
+HashPoint *hash_ring = NULL;
+size_t hash_ring_len = 0;
+
+_Thread_local MemberStats *member_stats = NULL;
+_Thread_local WaitQueue wait_queue = {0};
+
+static _Thread_local uint64_t random_state = 0; // xorshift64*, seeded per worker
+static _Thread_local size_t least_offset = 0;   // rotates the start of least outstanding ties
+static _Thread_local size_t avoided = NO_MEMBER; // member a hedge or retry moves away from
+
+// spreads the bits of FNV, so close inputs land far apart on the ring
+static uint64_t mix_hash(uint64_t hash)
+{
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+uint64_t hash_str(const char *data, size_t len)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (size_t i = 0; i < len; ++i)
+  {
+    hash ^= (unsigned char)data[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+static int compare_points(const void *a, const void *b)
+{
+  uint64_t first = ((const HashPoint *)a)->hash, second = ((const HashPoint *)b)->hash;
+  return (first > second) - (first < second);
+}
+
+bool setup_hash_ring(void)
+{
+  for (size_t i = 0; i < upstreams_num; ++i)
+    hash_ring_len += (size_t)upstreams[i].weight * HASH_POINTS_PER_WEIGHT;
+
+  if (!(hash_ring = malloc(hash_ring_len * sizeof(HashPoint))))
+  {
+    hash_ring_len = 0;
+    return err("malloc", strerror(errno));
+  }
+
+  // points only depend on host & port, so the same member keeps its keys across restarts
+  // & reorderings of the list
+  size_t filled = 0;
+  for (size_t i = 0; i < upstreams_num; ++i)
+  {
+    uint64_t hash = hash_str(upstreams[i].host, strlen(upstreams[i].host));
+    hash = hash_str(upstreams[i].port, strlen(upstreams[i].port)) ^ mix_hash(hash);
+
+    for (size_t point = 0; point < (size_t)upstreams[i].weight * HASH_POINTS_PER_WEIGHT; ++point)
+      hash_ring[filled++] =
+          (HashPoint){.hash = mix_hash(hash + point * 0x9e3779b97f4a7c15ULL), .member = i};
+  }
+
+  qsort(hash_ring, hash_ring_len, sizeof(HashPoint), compare_points);
+
+  return true;
+}
+
+void free_hash_ring(void)
+{
+  free(hash_ring);
+  hash_ring = NULL;
+  hash_ring_len = 0;
+}
+
+bool setup_member_stats(void)
+{
+  if (!(member_stats = calloc(upstreams_num, sizeof(MemberStats))))
+    return err("calloc", strerror(errno));
+
+  for (size_t i = 0; i < upstreams_num; ++i)
+  {
+    member_stats[i].healthy = true; // till a health check says otherwise
+    member_stats[i].limit = CONCURRENCY_INITIAL;
+  }
+
+  memset(&wait_queue, 0, sizeof wait_queue);
+
+  // different for every worker, as the address of a thread local differs
+  update_loop_time();
+  random_state = (uint64_t)loop_time ^ mix_hash((uint64_t)(uintptr_t)&random_state);
+  if (!random_state)
+    random_state = 1;
+
+  least_offset = 0;
+
+  return true;
+}
+
+void free_member_stats(void)
+{
+  free(member_stats);
+  member_stats = NULL;
+}
+
+// in rotation, neither down nor ejected
+static bool is_eligible(size_t member)
+{
+  return member_stats[member].healthy && member_stats[member].ejected_till <= loop_time;
+}
+
+static bool is_full(size_t member)
+{
+  return config.adaptive_limit &&
+         (double)member_stats[member].outstanding >= member_stats[member].limit;
+}
+
+// can take one more request
+static bool has_room(size_t member)
+{
+  return member != avoided && is_eligible(member) && !is_full(member);
+}
+
+static uint64_t next_random(void)
+{
+  random_state ^= random_state >> 12;
+  random_state ^= random_state << 25;
+  random_state ^= random_state >> 27;
+  return random_state * 0x2545f4914f6cdd1dULL;
+}
+
+// nginx's smooth weighted round robin, spreads the picks of a heavy member instead of bursting
+static size_t select_round_robin(void)
+{
+  int64_t total = 0;
+  size_t best = NO_MEMBER;
+
+  for (size_t i = 0; i < upstreams_num; ++i)
+  {
+    if (!has_room(i))
+      continue;
+
+    member_stats[i].current_weight += upstreams[i].weight;
+    total += upstreams[i].weight;
+
+    if (best == NO_MEMBER || member_stats[i].current_weight > member_stats[best].current_weight)
+      best = i;
+  }
+
+  if (best != NO_MEMBER)
+    member_stats[best].current_weight -= total;
+
+  return best;
+}
+
+static size_t select_least_outstanding(void)
+{
+  size_t start = least_offset++ % upstreams_num, best = NO_MEMBER;
+
+  // outstanding / weight compared without dividing
+  for (size_t n = 0; n < upstreams_num; ++n)
+  {
+    size_t i = (start + n) % upstreams_num;
+
+    if (has_room(i) && (best == NO_MEMBER || member_stats[i].outstanding * upstreams[best].weight <
+                                  member_stats[best].outstanding * upstreams[i].weight))
+      best = i;
+  }
+
+  return best;
+}
+
+// expected wait on a member, a member without samples looks fast so it gets probed
+static double member_cost(size_t member)
+{
+  return (member_stats[member].ewma + 1) * (double)(member_stats[member].outstanding + 1) /
+         upstreams[member].weight;
+}
+
+// index of the nth member with room
+static size_t nth_with_room(size_t nth)
+{
+  for (size_t i = 0; i < upstreams_num; ++i)
+    if (has_room(i) && !nth--)
+      return i;
+
+  return NO_MEMBER;
+}
+
+static size_t select_two_choices(void)
+{
+  size_t room_num = 0;
+  for (size_t i = 0; i < upstreams_num; ++i)
+    room_num += has_room(i);
+
+  if (room_num < 2)
+    return nth_with_room(0);
+
+  size_t first = next_random() % room_num, second = next_random() % (room_num - 1);
+  if (second >= first) // distinct from first
+    ++second;
+
+  first = nth_with_room(first);
+  second = nth_with_room(second);
+
+  return member_cost(second) < member_cost(first) ? second : first;
+}
+
+static size_t select_path_hash(const Connection *conn)
+{
+  uint64_t hash = mix_hash(hash_str(conn->path.data, (size_t)conn->path.len));
+
+  // first point at or after the hash, wrapping around the ring
+  size_t low = 0, high = hash_ring_len;
+  while (low < high)
+  {
+    size_t mid = low + (high - low) / 2;
+
+    if (hash_ring[mid].hash < hash)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  // keys of a member out of rotation or at its limit move to the members after its points,
+  // and come back with it
+  for (size_t checked = 0; checked < hash_ring_len; ++checked)
+  {
+    const HashPoint *point = hash_ring + (low + checked) % hash_ring_len;
+
+    if (has_room(point->member))
+      return point->member;
+  }
+
+  return NO_MEMBER;
+}
+
+bool select_member(Connection *conn)
+{
+  if (!conn)
+    return set_efault();
+
+  switch (config.lb_policy)
+  {
+  case LEAST_OUTSTANDING:
+    conn->member = select_least_outstanding();
+    break;
+  case TWO_CHOICES:
+    conn->member = select_two_choices();
+    break;
+  case PATH_HASH:
+    conn->member = hash_ring_len && conn->path.data ? select_path_hash(conn) : nth_with_room(0);
+    break;
+  case ROUND_ROBIN:
+  default:
+    conn->member = select_round_robin();
+    break;
+  }
+
+  if (conn->member == NO_MEMBER)
+  {
+    // waiting only helps if a member in rotation frees up a slot, else the request fails fast
+    errno = EHOSTUNREACH;
+    for (size_t i = 0; i < upstreams_num; ++i)
+      if (is_eligible(i) && is_full(i))
+        errno = EAGAIN;
+
+    return false;
+  }
+
+  ++member_stats[conn->member].outstanding;
+  conn->member_since = loop_time;
+  conn->latency = -1;
+  return true;
+}
+
+bool admit_request(Connection *conn)
+{
+  if (!conn)
+    return set_efault();
+
+  if (wait_queue.head)
+  {
+    errno = EAGAIN;
+    return false;
+  }
+
+  return select_member(conn);
+}
+
+// ejections double in length while the member keeps failing, up to OUTLIER_EJECTION_MAX
+static void eject_member(size_t member)
+{
+  MemberStats *stats = member_stats + member;
+  size_t ejected_num = 0;
+
+  for (size_t i = 0; i < upstreams_num; ++i)
+    ejected_num += member_stats[i].ejected_till > loop_time;
+
+  // the rest of the group has to be able to take the load
+  if ((ejected_num + 1) * 100 > upstreams_num * OUTLIER_MAX_EJECTED)
+    return;
+
+  int64_t duration = (int64_t)OUTLIER_EJECTION << (stats->ejected < 5 ? stats->ejected : 5);
+  if (duration > OUTLIER_EJECTION_MAX)
+    duration = OUTLIER_EJECTION_MAX;
+
+  stats->ejected_till = loop_time + duration;
+  stats->failures = 0;
+  ++stats->ejected;
+  ++stats->ejections;
+
+  printf("Upstream %s:%s is ejected for %ldms, after %u failures in a row\n",
+         upstreams[member].host, upstreams[member].port, duration, OUTLIER_FAILURES);
+}
+
+void record_outcome(size_t member, bool failed)
+{
+  if (member >= upstreams_num)
+    return;
+
+  MemberStats *stats = member_stats + member;
+
+  if (!failed)
+  {
+    stats->failures = stats->ejected = 0;
+    return;
+  }
+
+  if (++stats->failures >= OUTLIER_FAILURES)
+    eject_member(member);
+}
+
+bool select_other_member(Connection *conn, size_t avoid)
+{
+  avoided = avoid;
+  bool selected = select_member(conn);
+  avoided = NO_MEMBER;
+
+  // another conn to the same member still dodges a slow or broken conn, or address
+  return selected || select_member(conn);
+}
+
+// cuts the limit at most once per round trip, as every request in flight sees the same overload
+static void decrease_limit(MemberStats *stats)
+{
+  if (stats->backed_off && loop_time - stats->backed_off < (int64_t)stats->ewma + LIMIT_SLACK)
+    return;
+
+  stats->limit *= LIMIT_BACKOFF;
+  if (stats->limit < CONCURRENCY_MIN)
+    stats->limit = CONCURRENCY_MIN;
+
+  stats->backed_off = loop_time;
+  ++stats->backoffs;
+}
+
+// additive increase of about one per round trip, only while the limit is what holds requests
+// back, so an idle member does not grow a limit it never proved it can take
+static void adapt_limit(MemberStats *stats, double sample, size_t in_flight)
+{
+  if (sample > stats->min_latency * LIMIT_TOLERANCE + LIMIT_SLACK) // queueing on the member
+  {
+    decrease_limit(stats);
+    return;
+  }
+
+  if ((double)in_flight * 2 < stats->limit)
+    return;
+
+  stats->limit += 1 / stats->limit;
+  if (stats->limit > CONCURRENCY_MAX)
+    stats->limit = CONCURRENCY_MAX;
+}
+
+void sample_member(Connection *conn)
+{
+  if (!conn || conn->member == NO_MEMBER || !conn->member_since)
+    return;
+
+  MemberStats *stats = member_stats + conn->member;
+  conn->latency = loop_time - conn->member_since;
+  conn->member_since = 0;
+
+  double sample = (double)conn->latency;
+
+  // the baseline drifts towards higher samples, so a member that got slower for good is not
+  // backed off forever
+  if (!stats->samples || sample < stats->min_latency)
+    stats->min_latency = sample;
+  else
+    stats->min_latency += MIN_LATENCY_DRIFT * (sample - stats->min_latency);
+
+  stats->ewma = stats->samples++ ? stats->ewma + EWMA_ALPHA * (sample - stats->ewma) : sample;
+
+  if (config.adaptive_limit)
+    adapt_limit(stats, sample, stats->outstanding);
+}
+
+void finish_member(Connection *conn, bool completed)
+{
+  if (!conn || conn->member == NO_MEMBER)
+    return;
+
+  MemberStats *stats = member_stats + conn->member;
+  --stats->outstanding;
+
+  if (completed)
+    ++stats->completed;
+  else if (config.adaptive_limit && (conn->status == 502 || conn->status == 504))
+    decrease_limit(stats); // member failed or timed out
+
+  conn->member = NO_MEMBER;
+}
+
+bool queue_request(Connection *conn)
+{
+  if (!conn)
+    return set_efault();
+
+  if (wait_queue.len >= WAIT_QUEUE_MAX)
+  {
+    ++wait_queue.rejected;
+    return false;
+  }
+
+  conn->wait_next = NULL;
+  conn->wait_prev = wait_queue.tail;
+
+  if (wait_queue.tail)
+    wait_queue.tail->wait_next = conn;
+  else
+    wait_queue.head = conn;
+
+  wait_queue.tail = conn;
+  conn->waiting = true;
+  ++wait_queue.len;
+  ++wait_queue.queued;
+
+  return true;
+}
+
+void leave_wait_queue(Connection *conn)
+{
+  if (!conn || !conn->waiting)
+    return;
+
+  if (conn->wait_prev)
+    conn->wait_prev->wait_next = conn->wait_next;
+  else
+    wait_queue.head = conn->wait_next;
+
+  if (conn->wait_next)
+    conn->wait_next->wait_prev = conn->wait_prev;
+  else
+    wait_queue.tail = conn->wait_prev;
+
+  conn->wait_next = conn->wait_prev = NULL;
+  conn->waiting = false;
+  --wait_queue.len;
+}
+
+void drain_wait_queue(void)
+{
+  Connection *conn = NULL;
+
+  while ((conn = wait_queue.head))
+  {
+    if (!select_member(conn) && errno == EAGAIN) // still full, the head keeps its place
+      return;
+
+    leave_wait_queue(conn);
+    remove_timeout(&conn->state_timeout);
+
+    if (conn->member == NO_MEMBER) // every member went down meanwhile
+    {
+      conn->status = 503;
+      conn->state = WRITE_ERROR;
+    }
+    else
+      conn->state = CONNECT_UPSTREAM;
+
+    handle_state(conn);
+  }
+}
+
+const char *get_policy_string(LbPolicy policy)
+{
+  switch (policy)
+  {
+  case ROUND_ROBIN:
+    return "weighted round robin";
+  case LEAST_OUTSTANDING:
+    return "least outstanding requests";
+  case TWO_CHOICES:
+    return "power of two choices";
+  case PATH_HASH:
+    return "consistent path hashing";
+  default:
+    return "";
+  }
+}
+
+void print_member_stats(void)
+{
+  for (size_t i = 0; i < upstreams_num; ++i)
+    printf("Upstream %s:%s: %zu completed, %zu outstanding, %.1fms ewma, limit %.1f, %zu "
+           "backoffs, %zu ejections, %zu retries\n",
+           upstreams[i].host, upstreams[i].port, member_stats[i].completed,
+           member_stats[i].outstanding, member_stats[i].ewma, member_stats[i].limit,
+           member_stats[i].backoffs, member_stats[i].ejections, member_stats[i].retries);
+
+  printf("Wait queue: %zu queued, %zu rejected, %zu expired\n", wait_queue.queued,
+         wait_queue.rejected, wait_queue.expired);
+}
@@ -17,9 +17,12 @@
 
 #include "client.h"
 #include "connection.h"
+#include "event.h"
+#include "h2.h"
 #include "http.h"
 #include "main.h"
 #include "proxy.h"
+#include "upstream.h"
 #include "utils.h"
 
 void accept_client(int proxy_fd)
@@ -37,8 +40,8 @@ void accept_client(int proxy_fd)
 
     socklen_t addr_len = sizeof conn->client_addr;
 
-    if ((conn->client.fd = accept(proxy_fd, (struct sockaddr *)&conn->client_addr, &addr_len)) ==
-        -1)
+    if ((conn->client.fd =
+             accept_socket(proxy_fd, (struct sockaddr *)&conn->client_addr, &addr_len)) == -1)
     {
       free_conn(&conn);
 
@@ -53,12 +56,17 @@ void accept_client(int proxy_fd)
         warn("accept", strerror(errno));
         continue;
       }
+
+      // like EMFILE, retried on the next event
+      err("accept", strerror(errno));
+      break;
     }
 
-    if (!set_non_block(conn->client.fd))
+    // registered once for the life of the conn, states react to the cached readiness
+    if (!add_to_epoll(&conn->client, conn->client.fd, EVENT_FLAGS))
     {
       free_conn(&conn);
-      err("set_non_block", NULL);
+      err("add_to_epoll", NULL);
       continue;
     }
 
@@ -87,52 +95,23 @@ void read_request(Connection *conn)
   }
 
   ssize_t read_status = 0;
-
-  // new request should always start from the beginning of the buffer
-  while (client->to_read &&
-         (read_status =
-              client->ssl
-                  ? SSL_read(client->ssl, client->buffer + client->read_index, (int)client->to_read)
-                  : read(client->fd, client->buffer + client->read_index, client->to_read)) > 0)
+  size_t max_read = 0;
+
+  // only the headers are read here, the body is relayed as it arrives by write_request()
+  while ((max_read = BUFFER_SIZE - (size_t)client->read_index - 1) &&
+         (read_status = client->ssl ? SSL_read(client->ssl, client->buffer + client->read_index,
+                                               (int)max_read)
+                                    : read_socket(client->fd, client->buffer + client->read_index,
+                                                  max_read)) > 0)
   {
-    client->buffer[client->read_index + read_status] = '\0';
-    client->read_index += client->headers_found ? 0 : read_status;
-
-    if (!client->headers_found)
-    {
-      if (!parse_headers(conn, client))
-        goto error;
-
-      // no content len or encoding was specified or full request read
-      if (client->headers_found && !client->to_read)
-        goto verify;
-    }
-    else if (client->content_len)
-    { // bytes left from content len
-      size_t extra =
-          (size_t)read_status > client->to_read ? (size_t)read_status - client->to_read : 0;
+    client->read_index += read_status;
+    client->buffer[client->read_index] = '\0';
 
-      if (extra)
-      {
-        client->next_index = client->read_index + (ptrdiff_t)client->to_read;
-        client->to_read = 0;
-      }
-      else
-        client->to_read -= (size_t)read_status;
-
-      if (!client->to_read)
-        goto verify;
-    }
-    else if (client->chunked)
-    { // checking for last chunk, was not received during parse_headers()
-      if (find_last_chunk(client))
-        goto verify;
-    }
-    else
-    {
-      err("verify_client_read", "No read condition met. Logic error!");
+    if (!parse_headers(conn, client))
       goto error;
-    }
+
+    if (client->headers_found)
+      goto verify;
   }
 
   if (read_status == 0)
@@ -145,9 +124,9 @@ void read_request(Connection *conn)
   if (read_status == -1)
   {
     if (errno == EINTR && !RUNNING) // shutdown
-      NULL;
-    else if (errno == EAGAIN || errno == EWOULDBLOCK) // no more data right now
-      NULL;
+      client->readable = false;
+    else if (errno == EAGAIN || errno == EWOULDBLOCK) // no more data till the next edge
+      client->readable = false;
     else
     {
       err("read", strerror(errno));
@@ -158,6 +137,14 @@ void read_request(Connection *conn)
   return;
 
 verify:
+  // the ring of the body would have no room
+  if ((client->content_len || client->chunked) && (size_t)client->headers.len >= RING_SIZE)
+  {
+    conn->status = 431;
+    err("verify_headers_len", "Headers too large for a body");
+    goto error;
+  }
+
   conn->state = VERIFY_REQUEST;
   return;
 
@@ -214,8 +201,22 @@ bool verify_request(Connection *conn)
   }
   conn->http_ver = c.head;
 
+  // no interim responses for http/1.0
+  if (equals(conn->http_ver, STR("HTTP/1.0")))
+    conn->continue_left = 0;
+
+  // tmp null termination, so the headers are not looked for in the body read along
+  char org_char = client->buffer[client->headers.len];
+  client->buffer[client->headers.len] = '\0';
+
   // finding the host header
-  if (!get_header_value(c.tail.data, "Host", &conn->host))
+  bool host_found = get_header_value(c.tail.data, "Host", &conn->host);
+
+  // respecting client connection, in case of no error
+  set_connection(conn->client.buffer, conn);
+  client->buffer[client->headers.len] = org_char;
+
+  if (!host_found)
   {
     conn->status = 400;
     return err("get_header_value", "Host header not found");
@@ -227,58 +228,262 @@ bool verify_request(Connection *conn)
     return err("validate_host", "Different host in the request header");
   }
 
-  // respecting client connection, in case of no error
-  set_connection(conn->client.buffer, conn);
   conn->status = 200;
 
   return true;
 }
 
-void write_request(Connection *conn)
+bool start_body(Connection *conn, bool decode)
 {
   if (!conn)
-    goto error;
+    return set_efault();
 
-  assert(conn->state == WRITE_REQUEST);
+  Endpoint *client = &conn->client;
 
-  Endpoint *client = &conn->client, *upstream = &conn->upstream;
+  // the body read along with the headers
+  char *start = client->buffer + client->headers.len;
+  size_t len = (size_t)(client->read_index - client->headers.len), body = len, kept = 0;
 
-  // writing request headers from client buffer to upstream
-  client->to_write = (size_t)(client->headers.len - client->write_index);
-  ssize_t write_status = 0;
+  if (client->chunked)
+  { // parsed once by parse_headers() already, again to know what is kept of it
+    client->chunk_state = CHUNK_START;
+    client->chunk_left = 0;
 
-  while ((client->to_write -= (size_t)write_status) &&
-         (write_status = upstream->ssl
-                             ? SSL_write(upstream->ssl, client->buffer + client->write_index,
-                                         (int)client->to_write)
-                             : write(upstream->fd, client->buffer + client->write_index,
-                                     client->to_write)) > 0)
-    client->write_index += write_status;
+    if (!parse_chunks(client, start, len, &body, decode ? &kept : NULL))
+    {
+      conn->status = 400;
+      return false;
+    }
+
+    kept = decode ? kept : body;
+  }
+  else
+    kept = body = len < client->content_len ? len : client->content_len;
+
+  // a request pipelined after a body is not read, the member may still be reading the body
+  if (body < len)
+    conn->keep_alive = false;
+
+  client->ring_start = client->write_index = client->headers.len;
+  client->read_index = client->ring_start + (ptrdiff_t)kept;
+  client->to_write = kept;
+  client->next_index = 0;
+  client->paused = false;
+
+  if ((size_t)client->read_index == RING_SIZE)
+    client->read_index = client->ring_start;
+
+  // sent along without being asked for
+  if (body_received(client) && conn->continue_left == (size_t)CONTINUE_STR.len)
+    conn->continue_left = 0;
+
+  return true;
+}
+
+ssize_t read_body(Connection *conn, bool decode)
+{
+  if (!conn)
+  {
+    set_efault();
+    return -1;
+  }
+
+  Endpoint *client = &conn->client;
+  ssize_t status = 0, total = 0;
+
+  // the client is told to send its body, now that it has somewhere to go
+  while (conn->continue_left && client->writable)
+  {
+    const char *start = CONTINUE + CONTINUE_STR.len - conn->continue_left;
+
+    if ((status = client->ssl ? SSL_write(client->ssl, start, (int)conn->continue_left)
+                              : write_socket(client->fd, start, conn->continue_left)) > 0)
+    {
+      conn->continue_left -= (size_t)status;
+      continue;
+    }
+
+    if (status == -1 && ((errno == EINTR && !RUNNING) || errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      client->writable = false;
+      break;
+    }
 
-  if (!write_status)
+    err("write", status ? strerror(errno) : "No write status");
+    conn->state = CLOSE_CONN;
+    return -1;
+  }
+
+  size_t len = 0;
+
+  while (!body_received(client) && client->readable && (len = ring_space(client)))
   {
-    err("write", "No write status");
+    if (!client->chunked && len > client->to_read)
+      len = client->to_read;
+
+    char *start = client->buffer + client->read_index;
+
+    if ((status = client->ssl ? SSL_read(client->ssl, start, (int)len)
+                              : read_socket(client->fd, start, len)) > 0)
+    {
+      size_t kept = (size_t)status;
+
+      if (client->chunked)
+      {
+        size_t parsed = 0;
+
+        if (!parse_chunks(client, start, (size_t)status, &parsed, decode ? &kept : NULL))
+        {
+          conn->status = 400;
+          conn->state = WRITE_ERROR;
+          return -1;
+        }
+
+        if (parsed < (size_t)status) // a request pipelined after a body is not read
+          conn->keep_alive = false;
+
+        kept = decode ? kept : parsed;
+      }
+      else
+        client->to_read -= (size_t)status;
+
+      ring_push(client, kept);
+      total += status;
+      continue;
+    }
+
+    if (!status)
+    {
+      warn("read", "Client EOF received");
+      conn->state = CLOSE_CONN;
+      return -1;
+    }
+
+    if ((errno == EINTR && !RUNNING) || errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+      client->readable = false;
+      break;
+    }
+
+    err("read", strerror(errno));
+    conn->state = CLOSE_CONN;
+    return -1;
+  }
+
+  // sent along without being asked for
+  if (body_received(client) && conn->continue_left == (size_t)CONTINUE_STR.len)
+    conn->continue_left = 0;
+
+  return total;
+}
+
+void write_request(Connection *conn)
+{
+  if (!conn)
     goto error;
+
+  assert(conn->state == WRITE_REQUEST);
+
+  // the body of a stream is handed to its session
+  if (conn->stream_id)
+  {
+    write_stream(conn);
+    return;
   }
 
-  if (write_status == -1)
+  Endpoint *client = &conn->client, *upstream = &conn->upstream;
+  size_t headers_len = (size_t)client->headers.len;
+  bool progress = true;
+
+  while (progress)
   {
-    if (errno == EINTR && !RUNNING) // shutdown
-      NULL;
-    else if (errno == EAGAIN || errno == EWOULDBLOCK) // cannot write now
-      NULL;
-    else
+    progress = false;
+
+    // the headers stay at the start of the buffer for retries, the body follows from the ring
+    size_t len = 0;
+    ssize_t write_status = 0;
+
+    while (upstream->writable &&
+           (len = conn->sent < headers_len ? headers_len - conn->sent : ring_data(client)))
     {
-      err("write", strerror(errno));
+      char *start = conn->sent < headers_len ? client->buffer + conn->sent
+                                             : client->buffer + client->write_index;
+
+      if ((write_status = upstream->ssl ? SSL_write(upstream->ssl, start, (int)len)
+                                        : write_socket(upstream->fd, start, len)) <= 0)
+        break;
+
+      if (conn->sent >= headers_len)
+        ring_pop(client, (size_t)write_status);
+
+      conn->sent += (size_t)write_status;
+      progress = true;
+    }
+
+    if (!write_status && len && upstream->writable)
+    {
+      err("write", "No write status");
       goto error;
     }
+
+    if (write_status == -1)
+    {
+      if (errno == EINTR && !RUNNING) // shutdown
+        upstream->writable = false;
+      else if (errno == EAGAIN || errno == EWOULDBLOCK) // cannot write till the next edge
+        upstream->writable = false;
+      else
+      {
+        err("write", strerror(errno));
+        goto error;
+      }
+    }
+
+    if (conn->sent < headers_len)
+      return;
+
+    if (!client->content_len && !client->chunked)
+      break;
+
+    if (!client->ring_start && !start_body(conn, false))
+    {
+      conn->state = WRITE_ERROR;
+      return;
+    }
+
+    ssize_t read_status = read_body(conn, false);
+
+    if (read_status < 0)
+      return;
+
+    if (read_status)
+      progress = true;
+
+    if (body_received(client) && !client->to_write && !conn->continue_left)
+      break;
   }
 
-  if (!upstream->to_write) // wait for upstream response, if request is sent
-    conn->state = READ_RESPONSE;
+  if (conn->sent < headers_len || client->to_write || conn->continue_left ||
+      ((client->content_len || client->chunked) && !body_received(client)))
+    return;
+
+  // wait for upstream response, if request is sent
+  conn->state = READ_RESPONSE;
   return;
 
 error:
+  if (retry_request(conn))
+    return;
+
+  // the member may have answered without taking the whole body, like with a 413
+  if (conn && conn->client.ring_start)
+  {
+    conn->keep_alive = false; // the rest of the body is not read
+    conn->upstream.readable = true;
+    conn->state = READ_RESPONSE;
+    return;
+  }
+
   conn->status = 500;
   conn->state = WRITE_ERROR;
   return;
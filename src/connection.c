@@ -6,6 +6,7 @@
 #include <openssl/ssl.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,38 +14,106 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "balancer.h"
 #include "connection.h"
+#include "event.h"
+#include "h2.h"
+#include "hedge.h"
 #include "http.h"
 #include "main.h"
+#include "pool.h"
 #include "proxy.h"
+#include "splice.h"
 #include "timeout.h"
+#include "upstream.h"
 #include "utils.h"
+#include "zerocopy.h"
 
-Connection *active_conns[MAX_CONNECTIONS] = {0};
-int active_conns_num = 0;
+_Thread_local Connection **active_conns = NULL;
+_Thread_local size_t active_conns_cap = 0;
+_Thread_local int active_conns_num = 0;
+_Thread_local size_t *free_slots = NULL;
+_Thread_local size_t free_slots_top = 0;
+
+bool setup_active_conns(size_t capacity)
+{
+  if (!capacity)
+  {
+    errno = EINVAL;
+    return err("verify_capacity", strerror(errno));
+  }
+
+  if (!(active_conns = calloc(capacity, sizeof(Connection *))) ||
+      !(free_slots = malloc(capacity * sizeof(size_t))))
+  {
+    err("malloc", strerror(errno));
+    free(active_conns);
+    active_conns = NULL;
+    return false;
+  }
+
+  // lowest index on top, to keep the used part of the array dense
+  for (size_t i = 0; i < capacity; ++i)
+    free_slots[i] = capacity - 1 - i;
+
+  active_conns_cap = free_slots_top = capacity;
+  active_conns_num = 0;
+
+  return true;
+}
 
 Connection *init_conn(void)
 {
   Connection *conn;
-  if (!(conn = malloc(sizeof(Connection))))
+  if (!(conn = get_pooled_conn()))
   {
-    err("malloc", strerror(errno));
+    err("get_pooled_conn", NULL);
     return NULL;
   }
 
   if (!activate_conn(conn))
   {
     err("activate_conn", errno ? strerror(errno) : "Max limit of active connections reached");
-    free(conn);
+    put_pooled_conn(conn);
     return NULL;
   }
 
+  // pooled memory holds whatever the previous conn left
+  conn->conn_timeout.active = conn->state_timeout.active = conn->attempt_timeout.active = false;
+  conn->hedge_timeout.active = false;
+
+  for (size_t i = 0; i < MAX_CONNECT_ATTEMPTS; ++i)
+    conn->attempt_fds[i] = -1;
+  conn->attempts_num = conn->next_addr = 0;
+  conn->addrs = NULL;
+  conn->member = NO_MEMBER;
+  conn->latency = -1;
+  conn->wait_next = conn->wait_prev = NULL;
+  conn->waiting = false;
+  conn->hedge = NULL;
+  conn->shadow = false;
+  conn->session = NULL;
+  conn->stream_id = 0;
+  conn->stream_next = conn->stream_prev = NULL;
+  conn->unconsumed = conn->chunk_len = 0;
+  conn->chunk_start = -1;
+  conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+  conn->piped = 0;
+  conn->pipe_failed = false;
+  conn->zerocopy = conn->zerocopy_off = false;
+  conn->zc_next = 0;
+  conn->zc_num = 0;
+  memset(conn->zc_done, 0, sizeof conn->zc_done);
+
   memset(&conn->client_addr, 0, sizeof(struct sockaddr_storage));
 
   Endpoint *client = &conn->client, *upstream = &conn->upstream;
 
   // same vars across client and upstream
   client->fd = upstream->fd = -1;
+  client->conn = upstream->conn = conn;
+  client->readable = client->writable = upstream->readable = upstream->writable = false;
+  client->ssl = upstream->ssl = NULL;
   client->next_index = upstream->next_index = 0;
 
   client->headers.data = client->buffer; // initally request points to beginning of the buffer
@@ -63,9 +132,16 @@ void free_conn(Connection **conn)
 
   Connection *to_free = *conn;
   deactivate_conn(*conn);
+  free_session(to_free);
+  close_stream(to_free);
+  release_pipe(to_free);
 
   remove_timeout(&to_free->conn_timeout);
   remove_timeout(&to_free->state_timeout);
+  close_connect_attempts(to_free);
+  leave_wait_queue(to_free);
+  stop_hedge(to_free);
+  finish_member(to_free, false);
 
   if (to_free->client.ssl)
   {
@@ -79,8 +155,43 @@ void free_conn(Connection **conn)
     SSL_free(to_free->upstream.ssl);
   }
 
-  free(to_free);
-  to_free = NULL;
+  // listening conn does not own proxy_fd
+  // a client with zerocopy sends in flight is closed by the pool, once they are acked
+  if (to_free->client.fd >= 0 && !abort_zerocopy(to_free))
+    close_socket(to_free->client.fd);
+
+  if (to_free->upstream.fd >= 0)
+    close_socket(to_free->upstream.fd);
+
+  put_pooled_conn(to_free);
+  *conn = NULL;
+}
+
+void close_upstream(Connection *conn)
+{
+  if (!conn)
+    return;
+
+  Endpoint *upstream = &conn->upstream;
+
+  // a stream has no fd of its own, its session is left open for the other streams
+  close_stream(conn);
+
+  if (upstream->ssl)
+  {
+    SSL_shutdown(upstream->ssl);
+    SSL_free(upstream->ssl);
+    upstream->ssl = NULL;
+  }
+
+  if (upstream->fd >= 0)
+  {
+    del_from_epoll(upstream->fd);
+    close_socket(upstream->fd);
+    upstream->fd = -1;
+  }
+
+  upstream->readable = upstream->writable = false;
 }
 
 bool activate_conn(Connection *conn)
@@ -88,18 +199,20 @@ bool activate_conn(Connection *conn)
   if (!conn)
     return set_efault();
 
-  for (int i = 0; i < MAX_CONNECTIONS; ++i)
-    if (!active_conns[i])
-    {
-      active_conns[i] = conn;
-      conn->self_ptr = active_conns + i;
+  if (!free_slots_top) // full
+  {
+    errno = 0;
+    return false;
+  }
 
-      ++active_conns_num;
+  size_t i = free_slots[--free_slots_top];
 
-      return true;
-    }
+  active_conns[i] = conn;
+  conn->self_ptr = active_conns + i;
+
+  ++active_conns_num;
 
-  return false;
+  return true;
 }
 
 void deactivate_conn(Connection *conn)
@@ -107,7 +220,11 @@ void deactivate_conn(Connection *conn)
   if (!conn)
     return;
 
+  if (!conn->self_ptr)
+    return;
+
   *(conn->self_ptr) = NULL;
+  free_slots[free_slots_top++] = (size_t)(conn->self_ptr - active_conns);
   conn->self_ptr = NULL;
 
   --active_conns_num;
@@ -119,34 +236,56 @@ void reset_conn(Connection *conn)
     return;
 
   conn->state = READ_REQUEST;
+  leave_wait_queue(conn);
+  stop_hedge(conn);
+  finish_member(conn, false); // request ended without a full response, like an error response
 
   Endpoint *client = &conn->client, *upstream = &conn->upstream;
 
   pull_buf(client);
   pull_buf(upstream);
 
-  client->headers.len = upstream->headers.len = 0;
-  client->read_index = upstream->read_index = 0;
-  client->write_index = upstream->write_index = 0;
-  client->to_read = upstream->to_read = BUFFER_SIZE - 1;
-  client->to_write = upstream->to_write = 0;
-  client->content_len = upstream->content_len = 0;
-  client->chunked = upstream->chunked = false;
-  client->headers_found = upstream->headers_found = false;
-  *client->last_chunk_found = *upstream->last_chunk_found = '\0';
+  reset_endpoint(client);
+  reset_endpoint(upstream);
 
+  conn->retries = 0;
+  conn->reused = false;
   conn->status = 0;
   conn->proxy_fd = -1;
   conn->http_ver = STR(FALLBACK_HTTP_VER);
   conn->host = ERR_STR;
   conn->path = ERR_STR;
   conn->keep_alive = false;
+  conn->upstream_keep_alive = false;
+  conn->sent = conn->continue_left = 0;
   conn->complete = false;
+  conn->pipe_failed = false;
 
   // only conn_timeout is started, state timeout is not touched
   start_conn_timeout(conn, -1);
 }
 
+void reset_endpoint(Endpoint *endpoint)
+{
+  if (!endpoint)
+    return;
+
+  endpoint->headers.len = 0;
+  endpoint->read_index = 0;
+  endpoint->write_index = 0;
+  endpoint->to_read = BUFFER_SIZE - 1;
+  endpoint->to_write = 0;
+  endpoint->content_len = 0;
+  endpoint->chunked = false;
+  endpoint->until_eof = false;
+  endpoint->held = 0;
+  endpoint->headers_found = false;
+  endpoint->chunk_state = CHUNK_START;
+  endpoint->chunk_left = 0;
+  endpoint->paused = false;
+  endpoint->ring_start = 0;
+}
+
 // after non_block all the system calls on this fd return instantly,
 // like read() or write(). so we can deal with other fds and their
 // events without waiting for this fd to finish
@@ -158,49 +297,6 @@ bool set_non_block(int fd)
   return true;
 }
 
-// adds the entry in the interest list of epoll instance
-// essentially adds fd to epoll_fd list and the event specifies what to
-// wait for & what fd to do that for
-bool add_to_epoll(Connection *conn, int fd, int flags)
-{
-  // this struct does not need to be on the heap
-  // kernel copies all the data into the epoll table
-  struct epoll_event epoll_event = {.events = (uint)flags, .data.ptr = (void *)conn};
-
-  if (fd == -1)
-    return err("get_target_fd",
-               "Socket is probably being added to epoll before accepting/connecting");
-
-  if (epoll_ctl(EPOLL_FD, EPOLL_CTL_ADD, fd, &epoll_event) == -1)
-    return err("epoll_ctl_add", strerror(errno));
-
-  return true;
-}
-
-bool mod_in_epoll(Connection *conn, int fd, int flags)
-{
-  struct epoll_event epoll_event = {.events = (uint)flags, .data.ptr = (void *)conn};
-
-  if (fd == -1)
-    return err("get_target_fd", "Socket fd is not initialized. Logic error!");
-
-  if (epoll_ctl(EPOLL_FD, EPOLL_CTL_MOD, fd, &epoll_event) == -1)
-    return err("epoll_ctl_mod", strerror(errno));
-
-  return true;
-}
-
-bool del_from_epoll(int fd)
-{
-  if (fd == -1)
-    return err("get_target_fd", "Socket fd is not initialized");
-
-  if (epoll_ctl(EPOLL_FD, EPOLL_CTL_DEL, fd, NULL) == -1)
-    return err("epoll_ctl_del", strerror(errno));
-
-  return true;
-}
-
 void pull_buf(Endpoint *endpoint)
 {
   if (!endpoint || !endpoint->next_index)
@@ -217,92 +313,203 @@ void pull_buf(Endpoint *endpoint)
   endpoint->headers_found = false;
 }
 
-bool find_last_chunk(Endpoint *endpoint)
+bool parse_chunks(Endpoint *endpoint, char *data, size_t len, size_t *parsed, size_t *decoded)
 {
-  if (!endpoint)
+  if (!endpoint || !data || !parsed)
     return set_efault();
 
-  assert(endpoint->headers_found);
+  size_t i = 0;
 
-  // pointer at chars after headers
-  char *start = endpoint->buffer + endpoint->headers.len;
+  if (decoded)
+    *decoded = 0;
 
-  if (!*start) // no body
-    return false;
+  while (i < len && endpoint->chunk_state != CHUNK_DONE)
+  {
+    char c = data[i];
+
+    switch (endpoint->chunk_state)
+    {
+    case CHUNK_START:
+    case CHUNK_SIZE:
+      if (isxdigit((unsigned char)c))
+      {
+        if (endpoint->chunk_left > SIZE_MAX >> 4)
+          return err("parse_chunks", "Chunk size too large");
+
+        endpoint->chunk_left = endpoint->chunk_left << 4 |
+                               (size_t)(isdigit((unsigned char)c) ? c - '0' : (c | 0x20) - 'a' + 10);
+        endpoint->chunk_state = CHUNK_SIZE;
+      }
+      else if (endpoint->chunk_state == CHUNK_START) // a size needs one digit at least
+        return err("parse_chunks", "Invalid chunk size");
+      else if (c == ';' || c == ' ' || c == '\t')
+        endpoint->chunk_state = CHUNK_EXT;
+      else if (c == '\r')
+        endpoint->chunk_state = CHUNK_SIZE_LF;
+      else
+        return err("parse_chunks", "Invalid chunk size");
+      ++i;
+      break;
 
-  // first checking if already reading last chunk from previous call
-  size_t matched = strlen(endpoint->last_chunk_found);
+    case CHUNK_EXT:
+      if (c == '\r')
+        endpoint->chunk_state = CHUNK_SIZE_LF;
+      ++i;
+      break;
 
-  while (matched && matched < (size_t)LAST_CHUNK_STR.len && *start)
-  { // continue to check for last_chunk
-    if (*start != LAST_CHUNK[matched])
-    { // mismatch
-      *endpoint->last_chunk_found = '\0';
-      matched = 0;
+    case CHUNK_SIZE_LF:
+      if (c != '\n')
+        return err("parse_chunks", "Invalid chunk size line");
+      endpoint->chunk_state = endpoint->chunk_left ? CHUNK_DATA : CHUNK_TRAILER;
+      ++i;
+      break;
+
+    case CHUNK_DATA:
+    { // the data is skipped in one go, never looked at
+      size_t data_len = len - i < endpoint->chunk_left ? len - i : endpoint->chunk_left;
+
+      if (decoded) // never ahead of i, as the framing is dropped
+      {
+        memmove(data + *decoded, data + i, data_len);
+        *decoded += data_len;
+      }
+
+      endpoint->chunk_left -= data_len;
+      i += data_len;
+
+      if (!endpoint->chunk_left)
+        endpoint->chunk_state = CHUNK_DATA_CR;
       break;
     }
 
-    endpoint->last_chunk_found[matched] = LAST_CHUNK[matched];
-    endpoint->last_chunk_found[++matched] = '\0';
+    case CHUNK_DATA_CR:
+      if (c != '\r')
+        return err("parse_chunks", "Chunk data longer than its size");
+      endpoint->chunk_state = CHUNK_DATA_LF;
+      ++i;
+      break;
 
-    start++;
-  }
+    case CHUNK_DATA_LF:
+      if (c != '\n')
+        return err("parse_chunks", "Chunk data longer than its size");
+      endpoint->chunk_state = CHUNK_START;
+      ++i;
+      break;
 
-  if (matched == (size_t)LAST_CHUNK_STR.len)
-  {             // full chunk matched
-    if (*start) // next request
-      endpoint->next_index = start - endpoint->buffer;
-    return true;
+    case CHUNK_TRAILER:
+      endpoint->chunk_state = c == '\r' ? CHUNK_END_LF : CHUNK_FIELD;
+      ++i;
+      break;
+
+    case CHUNK_FIELD:
+      if (c == '\n')
+        endpoint->chunk_state = CHUNK_TRAILER;
+      ++i;
+      break;
+
+    case CHUNK_END_LF:
+      if (c != '\n')
+        return err("parse_chunks", "Invalid end of chunked body");
+      endpoint->chunk_state = CHUNK_DONE;
+      ++i;
+      break;
+
+    case CHUNK_DONE:
+      break;
+    }
   }
-  else if (matched) // full chunk not matched but ran out of chars
-    return false;   // read more
 
-  // nothing more to compare
-  if (!*start)
+  *parsed = i;
+  return true;
+}
+
+bool body_received(const Endpoint *endpoint)
+{
+  if (!endpoint)
     return false;
 
-  // last chunk not found in the beginning
-  // now searching beyond
-  char *last_chunk = LAST_CHUNK;
-  if ((last_chunk = strstr(start, last_chunk)))
-  { // last chunk was read
-    ptrdiff_t chunk_end =
-        (last_chunk + LAST_CHUNK_STR.len) - endpoint->buffer; // this is past the \n
+  return endpoint->chunked ? endpoint->chunk_state == CHUNK_DONE : !endpoint->to_read;
+}
+
+size_t ring_space(Endpoint *endpoint)
+{
+  if (!endpoint)
+    return 0;
+
+  // held bytes take up the ring as much as the ones still to write
+  size_t used = endpoint->to_write + endpoint->held,
+         size = RING_SIZE - (size_t)endpoint->ring_start;
 
-    if (endpoint->buffer[chunk_end]) // read the body and another request
-      endpoint->next_index = chunk_end;
+  // reads wait for the writes to catch up, so they are not made a few bytes at a time
+  if (endpoint->paused && used > RING_LOW_WATERMARK)
+    return 0;
 
-    // read the body and nothing more
-    return true;
-  }
+  // a ring after request headers may be smaller than the high watermark
+  endpoint->paused = used >= RING_HIGH_WATERMARK || used >= size;
+  if (endpoint->paused)
+    return 0;
 
-  // full last chunk not found, check last bytes in the buffer for worst case:
-  // '0\r\n\r'
-  start = endpoint->buffer + endpoint->headers.len;
-  size_t read_size = strlen(start), // num of chars available to check at most
-      to_match =
-          read_size < (size_t)LAST_CHUNK_STR.len - 1 ? read_size : (size_t)LAST_CHUNK_STR.len - 1;
-  ptrdiff_t match_index = (ptrdiff_t)(read_size - to_match);
-  matched = 0;
-
-  // checking if 0 is received, only using last to_match bytes
-  while (start[match_index])
-  {
-    if (start[match_index] != LAST_CHUNK[matched])
-    {
-      matched = 0;
-      *endpoint->last_chunk_found = '\0'; // restart
-    }
-    else
-    {
-      endpoint->last_chunk_found[matched] = LAST_CHUNK[matched];
-      endpoint->last_chunk_found[++matched] = '\0';
-    }
+  ptrdiff_t oldest = endpoint->write_index - (ptrdiff_t)endpoint->held;
+  if (oldest < endpoint->ring_start)
+    oldest += (ptrdiff_t)size;
 
-    match_index++;
-  }
+  size_t space = used && endpoint->read_index <= oldest
+                     ? (size_t)(oldest - endpoint->read_index)
+                     : RING_SIZE - (size_t)endpoint->read_index,
+         below_mark = RING_HIGH_WATERMARK - used;
+
+  return space < below_mark ? space : below_mark;
+}
+
+size_t ring_data(const Endpoint *endpoint)
+{
+  if (!endpoint || !endpoint->to_write)
+    return 0;
 
-  return false;
+  return endpoint->write_index < endpoint->read_index
+             ? (size_t)(endpoint->read_index - endpoint->write_index)
+             : RING_SIZE - (size_t)endpoint->write_index;
+}
+
+void ring_push(Endpoint *endpoint, size_t len)
+{
+  if (!endpoint)
+    return;
+
+  size_t size = RING_SIZE - (size_t)endpoint->ring_start;
+
+  endpoint->read_index =
+      endpoint->ring_start +
+      (ptrdiff_t)(((size_t)(endpoint->read_index - endpoint->ring_start) + len) % size);
+  endpoint->to_write += len;
+}
+
+void ring_pop(Endpoint *endpoint, size_t len)
+{
+  if (!endpoint)
+    return;
+
+  size_t size = RING_SIZE - (size_t)endpoint->ring_start;
+
+  endpoint->write_index =
+      endpoint->ring_start +
+      (ptrdiff_t)(((size_t)(endpoint->write_index - endpoint->ring_start) + len) % size);
+  endpoint->to_write -= len;
+
+  // the next read gets the whole ring in one piece
+  if (!endpoint->to_write && !endpoint->held)
+    endpoint->read_index = endpoint->write_index = endpoint->ring_start;
+}
+
+void ring_release(Endpoint *endpoint, size_t len)
+{
+  if (!endpoint)
+    return;
+
+  endpoint->held -= len;
+
+  if (!endpoint->to_write && !endpoint->held)
+    endpoint->read_index = endpoint->write_index = endpoint->ring_start;
 }
 
 bool parse_headers(Connection *conn, Endpoint *endpoint)
@@ -314,9 +521,7 @@ bool parse_headers(Connection *conn, Endpoint *endpoint)
   assert(!endpoint->headers_found);
   assert(endpoint->buffer[endpoint->read_index] == '\0');
 
-  // catering to both client and upstream
-  // rejecting body for client
-  // accepting body from upstream
+  // catering to both client and upstream, the body of either is kept after the headers
   bool client = endpoint == &conn->client, upstream = endpoint == &conn->upstream;
 
   if (!client && !upstream)
@@ -347,19 +552,57 @@ bool parse_headers(Connection *conn, Endpoint *endpoint)
 
   Str misc = ERR_STR; // misc str to contain the header value
 
+  // the proxy asks for the body itself once it has somewhere to go, see read_body(), so the
+  // header is taken out of what is forwarded
+  char *line = NULL, *line_end = NULL;
+  if (client && get_header_value(endpoint->buffer, "Expect", &misc))
+  {
+    line = misc.data;
+    line_end = misc.data + misc.len + LINEBREAK_STR.len;
+    while (line > endpoint->buffer && line[-1] != '\n')
+      --line;
+
+    while (misc.len && isspace((unsigned char)misc.data[misc.len - 1]))
+      --misc.len;
+  }
+
+  // a name that only ends in Expect is some other header
+  if (line && !strncasecmp(line, "Expect:", 7))
+  {
+    if (misc.len != CONTINUE_VALUE_STR.len ||
+        strncasecmp(misc.data, CONTINUE_VALUE, (size_t)misc.len))
+    {
+      *headers_end = org_char;
+      conn->status = 417;
+      return err("verify_expect_header", "Unknown expectation");
+    }
+
+    // the rest of the headers & anything read after them, null terminator included
+    *headers_end = org_char;
+    memmove(line, line_end, (size_t)(endpoint->buffer + endpoint->read_index - line_end) + 1);
+
+    endpoint->read_index -= line_end - line;
+    endpoint->headers.len -= line_end - line;
+    headers_end -= line_end - line;
+    org_char = *headers_end;
+    *headers_end = '\0';
+
+    conn->continue_left = (size_t)CONTINUE_STR.len;
+    misc = ERR_STR;
+  }
+
+  // upstream side is independent of the client, http/1.1 is persistent unless closed
+  if (upstream)
+    conn->upstream_keep_alive = !strncmp(endpoint->buffer, "HTTP/1.1", 8);
+
   if (get_header_value(endpoint->buffer, "Connection", &misc))
   {
     Str *conn_header = &misc;
 
-    if (equals(*conn_header, STR("close"))) // close if either side wants to close
-      conn->keep_alive = false;
+    if (equals(*conn_header, STR("close")))
+      *(client ? &conn->keep_alive : &conn->upstream_keep_alive) = false;
     else if (equals(*conn_header, STR("keep-alive")))
-    {
-      if (client)
-        conn->keep_alive = true;
-      else // only keep alive if client also want to
-        conn->keep_alive = conn->keep_alive ? true : false;
-    }
+      *(client ? &conn->keep_alive : &conn->upstream_keep_alive) = true;
     else
     {
       *headers_end = org_char;
@@ -371,47 +614,62 @@ bool parse_headers(Connection *conn, Endpoint *endpoint)
   misc = ERR_STR;
   if (get_header_value(endpoint->buffer, "Content-Length", &misc))
   {
+    // read one way by the proxy & the other by the member, a request could be smuggled
+    Str encoding = ERR_STR;
+    if (client && get_header_value(endpoint->buffer, "Transfer-Encoding", &encoding))
+    {
+      *headers_end = org_char;
+      conn->status = 400;
+      return err("verify_content_len", "Both content-length & transfer-encoding headers");
+    }
+
     *headers_end = org_char;
     Str *content_len_str = &misc;
 
-    for (int i = 0; i < content_len_str->len; i++)
-      if (!isdigit(content_len_str->data[i]))
+    if (!content_len_str->len)
+    {
+      conn->status = client ? 400 : 500;
+      return err("verify_content_len", "Empty content-length header value");
+    }
+
+    endpoint->content_len = 0;
+
+    for (ptrdiff_t i = 0; i < content_len_str->len; i++)
+    {
+      if (!isdigit((unsigned char)content_len_str->data[i]))
       {
         conn->status = client ? 400 : 500;
         return err("isdigit", "Invalid content-length header value");
       }
 
-    // a null terminated str for atoi()
-    char *tmp = strndup(content_len_str->data, (size_t)content_len_str->len);
-    endpoint->content_len = (size_t)atoi(tmp);
-    free(tmp);
+      size_t digit = (size_t)(content_len_str->data[i] - '0');
 
-    if (!endpoint->content_len) // empty body
-      goto read_complete;
+      // the full size below has to fit too, the body itself is streamed whatever its size
+      if (endpoint->content_len > (SIZE_MAX - BUFFER_SIZE - digit) / 10)
+      {
+        conn->status = client ? 413 : 500;
+        return err("verify_content_len", "Content too large");
+      }
 
-    if (endpoint->content_len > 10 * MB)
-    {
-      conn->status = client ? 413 : 500;
-      return err("verify_content_len", "Content too large");
+      endpoint->content_len = endpoint->content_len * 10 + digit;
     }
 
+    if (!endpoint->content_len) // empty body
+      goto read_complete;
+
     size_t full_size = (size_t)endpoint->headers.len + endpoint->content_len;
 
     if (full_size == (size_t)endpoint->read_index) // body read already, but nothing else
       goto read_complete;
 
     if (full_size < (size_t)endpoint->read_index)
-    {                                                  // body read and another request
-      endpoint->next_index = (ptrdiff_t)full_size + 1; // will be copied to the start for next read
+    {                                              // body read and another request
+      endpoint->next_index = (ptrdiff_t)full_size; // will be copied to the start for next read
       goto read_complete;
     }
 
     endpoint->to_read = full_size - (size_t)endpoint->read_index;
-
-    if (client) // no need to store body for client
-      goto disregard_body;
-
-    return true; // store body for upstream
+    return true; // the body is relayed as it is read
   }
   else if (get_header_value(endpoint->buffer, "Transfer-Encoding", &misc))
   {
@@ -424,28 +682,41 @@ bool parse_headers(Connection *conn, Endpoint *endpoint)
       return err("verify_encoding", "Encoding method not supported");
     }
 
-    // finding full last chunk or partial from last few bytes
-    // worst case, got: '0\r\n\r'
-    if (find_last_chunk(endpoint))
-      goto read_complete;
-
     endpoint->chunked = true;
 
-    if (client)
-      goto disregard_body;
+    // the part of the body read along with the headers
+    size_t body_len = (size_t)(endpoint->read_index - endpoint->headers.len), parsed = 0;
+
+    if (!parse_chunks(endpoint, endpoint->buffer + endpoint->headers.len, body_len, &parsed,
+                      NULL))
+    {
+      conn->status = client ? 400 : 500;
+      return false;
+    }
+
+    if (endpoint->chunk_state == CHUNK_DONE)
+    {
+      if (parsed < body_len) // body read and another request
+        endpoint->next_index = endpoint->headers.len + (ptrdiff_t)parsed;
+      goto read_complete;
+    }
 
     return true;
   }
   else
     *headers_end = org_char;
 
+  // a response without either is read till the upstream closes, a request has no body
+  if (upstream)
+  {
+    endpoint->until_eof = true;
+    endpoint->to_read = SIZE_MAX;
+    return true;
+  }
+
 read_complete:
   endpoint->to_read = 0;
   return true;
-
-disregard_body:
-  endpoint->read_index = endpoint->headers.len;
-  return true;
 }
 
 void check_conn(Connection *conn)
@@ -456,7 +727,15 @@ void check_conn(Connection *conn)
   assert(conn->state == CHECK_CONN);
   assert(conn->complete);
 
-  if (conn->keep_alive)
+  // upstream is handed to the idle pool, or closed, so the next request of this client
+  // checks out any upstream just like a new client would
+  if (!release_upstream(conn))
+    close_upstream(conn);
+
+  finish_member(conn, true);
+
+  // a body the upstream ended by closing can only be ended the same way for the client
+  if (conn->keep_alive && !conn->upstream.until_eof)
     reset_conn(conn); // start to read again from client
   else
     conn->state = CLOSE_CONN;
@@ -479,18 +758,25 @@ void print_endpoint(const Endpoint *endpoint)
   printf("\033[1;33mContent len:\033[0;32m %zu\n", endpoint->content_len);
   printf("\033[1;33mChunked:\033[0;32m %s\n", endpoint->chunked ? "true" : "false");
   printf("\033[1;33mHeaders found:\033[0;32m %s\n", endpoint->headers_found ? "true" : "false");
-  printf("\033[1;33mLast chunk found:\033[0;32m %s\n", endpoint->last_chunk_found);
+  printf("\033[1;33mChunk state:\033[0;32m %d\n", endpoint->chunk_state);
+  printf("\033[1;33mChunk left:\033[0;32m %zu\n", endpoint->chunk_left);
+  printf("\033[1;33mPaused:\033[0;32m %s\n", endpoint->paused ? "true" : "false");
+  printf("\033[1;33mUntil EOF:\033[0;32m %s\n", endpoint->until_eof ? "true" : "false");
+  printf("\033[1;33mRing start:\033[0;32m %ld\n", endpoint->ring_start);
+  printf("\033[1;33mHeld:\033[0;32m %zu\n", endpoint->held);
   puts("\033[1;34mEnd\n\033[0m");
 }
 
-bool setup_endpoint_tls(Endpoint *endpoint)
+bool setup_endpoint_tls(Endpoint *endpoint, bool upstream)
 {
   if (!endpoint)
     return err("verify_endpoint", "NULL endpoint pointer passed.");
 
-  if (ssl_context)
+  SSL_CTX *context = upstream ? upstream_ssl_context : ssl_context;
+
+  if (context)
   {
-    if (!(endpoint->ssl = SSL_new(ssl_context)))
+    if (!(endpoint->ssl = SSL_new(context)))
     { // endpoint.ssl will be free during close_conn, no need to handle here in case of error
       ERR_print_errors_fp(stderr);
       return err("SSL_new", NULL);
@@ -500,12 +786,98 @@ bool setup_endpoint_tls(Endpoint *endpoint)
       ERR_print_errors_fp(stderr);
       return err("SSL_set_fd", NULL);
     }
-    else if (!SSL_accept(endpoint->ssl))
+
+    upstream ? SSL_set_connect_state(endpoint->ssl) : SSL_set_accept_state(endpoint->ssl);
+  }
+
+  if (!upstream || !endpoint->ssl)
+    return true;
+
+  size_t index = endpoint->conn->member;
+  const Upstream *member = upstreams + index;
+
+  // the member is stored with the ssl, as tickets may arrive after the conn has been pooled
+  SSL_set_app_data(endpoint->ssl, (void *)(uintptr_t)(index + 1));
+
+  // sni is only sent for hostnames (RFC 6066), the certificate is checked against the host
+  if (!member->numeric && SSL_set_tlsext_host_name(endpoint->ssl, member->host) != 1)
+  {
+    ERR_print_errors_fp(stderr);
+    return err("SSL_set_tlsext_host_name", NULL);
+  }
+
+  if ((member->numeric
+           ? X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(endpoint->ssl), member->host)
+           : SSL_set1_host(endpoint->ssl, member->host)) != 1)
+  {
+    ERR_print_errors_fp(stderr);
+    return err("SSL_set1_host", NULL);
+  }
+
+  // the server picks h2 or http/1.1, a server without ALPN gets http/1.1
+  if (config.upstream_h2 &&
+      SSL_set_alpn_protos(endpoint->ssl, (const unsigned char *)H2_ALPN, sizeof H2_ALPN - 1))
+  {
+    ERR_print_errors_fp(stderr);
+    return err("SSL_set_alpn_protos", NULL);
+  }
+
+  resume_session(endpoint->ssl, index);
+
+  return true;
+}
+
+void continue_handshake(Connection *conn, Endpoint *endpoint)
+{
+  if (!conn || !endpoint || !endpoint->ssl)
+    return;
+
+  bool upstream = endpoint == &conn->upstream;
+
+  ERR_clear_error(); // SSL_get_error() looks at the error queue of the thread
+  int status = SSL_do_handshake(endpoint->ssl);
+
+  if (status == 1)
+  {
+    if (upstream)
     {
-      ERR_print_errors_fp(stderr);
-      return err("SSL_accept", NULL);
+      ++session_cache.handshakes;
+      session_cache.resumed += SSL_session_reused(endpoint->ssl) == 1;
     }
+
+    conn->state = upstream ? WRITE_REQUEST : READ_REQUEST;
+    return;
   }
 
-  return true;
+  switch (SSL_get_error(endpoint->ssl, status))
+  {
+  case SSL_ERROR_WANT_READ:
+    endpoint->handshake_flags = EPOLLIN;
+    endpoint->readable = false;
+    return;
+
+  case SSL_ERROR_WANT_WRITE:
+    endpoint->handshake_flags = EPOLLOUT;
+    endpoint->writable = false;
+    return;
+
+  default:
+    ERR_print_errors_fp(stderr);
+    err("SSL_do_handshake", NULL);
+
+    if (upstream)
+    {
+      long verified = SSL_get_verify_result(endpoint->ssl);
+      if (verified != X509_V_OK)
+        err("SSL_get_verify_result", X509_verify_cert_error_string(verified));
+
+      if (retry_request(conn))
+        return;
+
+      conn->status = 502;
+      conn->state = WRITE_ERROR;
+    }
+    else // no response can be sent to the client without tls
+      conn->state = CLOSE_CONN;
+  }
 }
@@ -0,0 +1,1152 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+
+#include "args.h"
+#include "connection.h"
+#include "event.h"
+#include "main.h"
+#include "utils.h"
+
+_Thread_local int EPOLL_FD = -1;
+
+#ifndef USE_IO_URING
+
+bool setup_events(void)
+{
+  EPOLL_FD = epoll_create(1);
+  if (EPOLL_FD == -1)
+    return err("epoll_create", strerror(errno));
+
+  return true;
+}
+
+int wait_events(struct epoll_event *events, int max_events, int timeout,
+                const sigset_t *wait_mask)
+{
+  return epoll_pwait(EPOLL_FD, events, max_events, timeout, wait_mask);
+}
+
+void free_events(void)
+{
+  if (EPOLL_FD >= 0)
+    close(EPOLL_FD);
+  EPOLL_FD = -1;
+}
+
+const char *get_backend_string(void) { return "epoll"; }
+
+// adds the entry in the interest list of epoll instance
+// essentially adds fd to epoll_fd list and the event specifies what to
+// wait for & what fd to do that for
+bool add_to_epoll(Endpoint *endpoint, int fd, int flags)
+{
+  // this struct does not need to be on the heap
+  // kernel copies all the data into the epoll table
+  struct epoll_event epoll_event = {.events = (uint)flags, .data.ptr = (void *)endpoint};
+
+  if (fd == -1)
+    return err("get_target_fd",
+               "Socket is probably being added to epoll before accepting/connecting");
+
+  if (epoll_ctl(EPOLL_FD, EPOLL_CTL_ADD, fd, &epoll_event) == -1)
+    return err("epoll_ctl_add", strerror(errno));
+
+  return true;
+}
+
+bool mod_in_epoll(Endpoint *endpoint, int fd, int flags)
+{
+  struct epoll_event epoll_event = {.events = (uint)flags, .data.ptr = (void *)endpoint};
+
+  if (fd == -1)
+    return err("get_target_fd", "Socket fd is not initialized. Logic error!");
+
+  if (epoll_ctl(EPOLL_FD, EPOLL_CTL_MOD, fd, &epoll_event) == -1)
+    return err("epoll_ctl_mod", strerror(errno));
+
+  return true;
+}
+
+bool del_from_epoll(int fd)
+{
+  if (fd == -1)
+    return err("get_target_fd", "Socket fd is not initialized");
+
+  if (epoll_ctl(EPOLL_FD, EPOLL_CTL_DEL, fd, NULL) == -1)
+    return err("epoll_ctl_del", strerror(errno));
+
+  return true;
+}
+
+ssize_t read_socket(int fd, void *buffer, size_t len) { return read(fd, buffer, len); }
+
+ssize_t write_socket(int fd, const void *buffer, size_t len)
+{
+  return send(fd, buffer, len, MSG_NOSIGNAL);
+}
+
+int accept_socket(int fd, struct sockaddr *addr, socklen_t *addr_len)
+{
+  return accept4(fd, addr, addr_len, SOCK_NONBLOCK);
+}
+
+bool peek_socket(int fd)
+{
+  char byte;
+  return recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) != -1 ||
+         (errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+int close_socket(int fd) { return close(fd); }
+
+#else
+
+// io_uring backend
+// plaintext sockets are served by completions: the listening fd by a multishot accept, and a
+// conn fd by a recv into a provided buffer & a send of a copy of the bytes, one of each in flight
+// read_socket() & write_socket() are served from the completions, and every completion is turned
+// into the event epoll would have reported, so the state machine keeps its readiness model
+// an fd switches to completions on its first socket call, till then it is polled, like tls fds,
+// whose bytes are read & written by openssl itself, or connect attempts
+// every request of a loop iteration is queued in the submission ring, and all of them are
+// submitted with the same io_uring_enter() that waits for completions
+
+// shared rings mapped from the kernel
+typedef struct ring
+{
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size, sqes_size;
+  unsigned sq_entries;
+} Ring;
+
+// requests & completions of an fd, indexed by fd
+// gen is bumped every time an fd is (re)armed, switched or closed, so completions of older requests
+// can be told apart from the current ones, as cancellation is asynchronous
+typedef struct io_slot
+{
+  Endpoint *endpoint; // NULL while not watched, completions are recorded without events
+  uint32_t events;    // flags requested by the state machine
+  uint32_t gen;
+  bool armed;          // a poll or the multishot accept is in flight
+  bool io;             // served by recv & send requests instead of a poll
+  bool receiving;      // recv in flight
+  bool sending;        // send in flight
+  bool starved;        // last recv found no provided buffer, rearmed once one is recycled
+  bool buffered;       // provided buffer with received bytes not read yet
+  bool eof;            // received by the last recv
+  bool blocked;        // last plain write would block, a poll reports when it can go on
+  int recv_error;      // errno of the failed recv, 0 if none
+  int send_error;      // errno of the failed send, 0 if none
+  uint16_t buffer_id;  // of the provided buffer
+  uint32_t buffer_off; // bytes of it read already
+  uint32_t buffer_len; // bytes received in it
+} IoSlot;
+
+// copy of the bytes of a send in flight, the request owns it till it completes, even if its fd is
+// closed meanwhile
+typedef struct send_buffer
+{
+  int fd;
+  uint32_t gen; // of the fd when sent
+  uint32_t off, len;
+  char data[BUFFER_SIZE];
+} SendBuffer;
+
+// fds accepted by the multishot accept of the listening fd, handed out by accept_socket()
+typedef struct accept_queue
+{
+  int fd; // listening fd, one per worker
+  int *fds;
+  size_t head, num, cap;
+  int error; // errno of a failed accept, 0 if none
+} AcceptQueue;
+
+enum
+{
+  OP_POLL,
+  OP_ACCEPT,
+  OP_RECV,
+  OP_SEND, // id is the index of the send buffer
+  OP_IGNORE,
+};
+
+#define USER_DATA(op, id, gen) (((uint64_t)(gen) << 32) | ((uint64_t)(id) << 3) | (op))
+#define USER_DATA_OP(data) (int)((data) & 7)
+#define USER_DATA_ID(data) (int)(((data) & UINT32_MAX) >> 3)
+#define USER_DATA_GEN(data) (uint32_t)((data) >> 32)
+#define IGNORE_DATA OP_IGNORE // for requests whose completions are not needed, like cancellations
+#define BUFFER_GROUP 0
+
+static _Thread_local Ring ring = {.fd = -1};
+static _Thread_local IoSlot *io_slots = NULL;
+static _Thread_local size_t io_slots_len = 0;
+static _Thread_local AcceptQueue accepts = {.fd = -1};
+
+// provided buffers, a recv picks one when its bytes arrive
+// handed back to the kernel once read_socket() has copied all of it out
+static _Thread_local struct io_uring_buf_ring *buf_ring = NULL;
+static _Thread_local char *recv_buffers = NULL;
+static _Thread_local unsigned recv_buffers_num = 0;
+static _Thread_local int *starved_fds = NULL;
+static _Thread_local size_t starved_num = 0, starved_cap = 0;
+
+static _Thread_local SendBuffer **send_buffers = NULL; // every one allocated, by index
+static _Thread_local size_t *spare_sends = NULL;       // indexes of the ones not in flight
+static _Thread_local size_t send_buffers_num = 0, spare_sends_num = 0, send_buffers_cap = 0;
+
+static bool setup_buffers(void);
+
+bool setup_events(void)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof params);
+
+  if ((ring.fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params)) == -1)
+    return err("io_uring_setup", strerror(errno));
+
+  // timeout & signal mask while waiting need the extended args of io_uring_enter()
+  if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+  {
+    close(ring.fd);
+    ring.fd = -1;
+    errno = ENOSYS;
+    return err("verify_io_uring_features", "Kernel is too old for the io_uring backend");
+  }
+
+  ring.sq_entries = params.sq_entries;
+  ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  // both rings can be mapped at once on newer kernels
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring.sq_size = ring.cq_size = ring.sq_size > ring.cq_size ? ring.sq_size : ring.cq_size;
+
+  ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQ_RING);
+  if (ring.sq_ptr == MAP_FAILED)
+    goto error;
+
+  ring.cq_ptr = params.features & IORING_FEAT_SINGLE_MMAP
+                    ? ring.sq_ptr
+                    : mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring.fd, IORING_OFF_CQ_RING);
+  if (ring.cq_ptr == MAP_FAILED)
+    goto error;
+
+  ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring.fd, IORING_OFF_SQES);
+  if (ring.sqes == MAP_FAILED)
+    goto error;
+
+  char *sq = ring.sq_ptr, *cq = ring.cq_ptr;
+  ring.sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  if (!setup_buffers())
+  {
+    err("setup_buffers", NULL);
+    free_events();
+    return false;
+  }
+
+  return true;
+
+error:
+  err("mmap", strerror(errno));
+  free_events();
+  return false;
+}
+
+void free_events(void)
+{
+  // in flight requests are cancelled by the kernel, along with the ring
+  if (ring.fd >= 0)
+    close(ring.fd);
+  if (ring.sqes && ring.sqes != MAP_FAILED)
+    munmap(ring.sqes, ring.sqes_size);
+  if (ring.cq_ptr && ring.cq_ptr != MAP_FAILED && ring.cq_ptr != ring.sq_ptr)
+    munmap(ring.cq_ptr, ring.cq_size);
+  if (ring.sq_ptr && ring.sq_ptr != MAP_FAILED)
+    munmap(ring.sq_ptr, ring.sq_size);
+
+  memset(&ring, 0, sizeof ring);
+  ring.fd = -1;
+
+  for (size_t i = accepts.head; i < accepts.num; ++i)
+    close(accepts.fds[i]);
+  free(accepts.fds);
+  accepts = (AcceptQueue){.fd = -1};
+
+  if (buf_ring)
+    munmap(buf_ring, recv_buffers_num * sizeof(struct io_uring_buf));
+  buf_ring = NULL;
+  free(recv_buffers);
+  recv_buffers = NULL;
+  recv_buffers_num = 0;
+  free(starved_fds);
+  starved_fds = NULL;
+  starved_num = starved_cap = 0;
+
+  for (size_t i = 0; i < send_buffers_num; ++i)
+    free(send_buffers[i]);
+  free(send_buffers);
+  free(spare_sends);
+  send_buffers = NULL;
+  spare_sends = NULL;
+  send_buffers_num = spare_sends_num = send_buffers_cap = 0;
+
+  free(io_slots);
+  io_slots = NULL;
+  io_slots_len = 0;
+}
+
+const char *get_backend_string(void) { return "io_uring"; }
+
+// submits every queued request without waiting
+static bool submit_requests(void)
+{
+  unsigned pending =
+      *ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE); // only this thread writes tail
+
+  if (pending && syscall(__NR_io_uring_enter, ring.fd, pending, 0, 0, NULL, 0) == -1)
+    return err("io_uring_enter", strerror(errno));
+
+  return true;
+}
+
+// returns a zeroed submission entry at the tail, push_sqe() queues it after it is filled
+static struct io_uring_sqe *get_sqe(void)
+{
+  // ring full, making space by submitting what is queued
+  if (*ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries)
+    if (!submit_requests() ||
+        *ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries)
+      return NULL;
+
+  unsigned index = *ring.sq_tail & *ring.sq_mask;
+  struct io_uring_sqe *sqe = ring.sqes + index;
+  memset(sqe, 0, sizeof *sqe);
+  ring.sq_array[index] = index;
+
+  return sqe;
+}
+
+// kernel only reads entries behind the tail
+static void push_sqe(void) { __atomic_store_n(ring.sq_tail, *ring.sq_tail + 1, __ATOMIC_RELEASE); }
+
+static bool queue_poll(int fd, IoSlot *slot)
+{
+  struct io_uring_sqe *sqe = NULL;
+
+  if (!(sqe = get_sqe()))
+    return err("get_sqe", "Submission ring is full");
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = slot->events & ~(uint32_t)(EPOLLET | EPOLLONESHOT);
+  // flags without EPOLLONESHOT stay armed, just like epoll
+  sqe->len = slot->events & EPOLLONESHOT ? 0 : IORING_POLL_ADD_MULTI;
+  sqe->user_data = USER_DATA(OP_POLL, fd, slot->gen);
+  push_sqe();
+
+  slot->armed = true;
+  return true;
+}
+
+static bool queue_accept(int fd, IoSlot *slot)
+{
+  struct io_uring_sqe *sqe = NULL;
+
+  if (!(sqe = get_sqe()))
+    return err("get_sqe", "Submission ring is full");
+
+  // peer addresses would all be written to the same place, getpeername() is used instead
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK;
+  sqe->user_data = USER_DATA(OP_ACCEPT, fd, slot->gen);
+  push_sqe();
+
+  slot->armed = true;
+  return true;
+}
+
+static bool queue_recv(int fd, IoSlot *slot)
+{
+  struct io_uring_sqe *sqe = NULL;
+
+  if (!(sqe = get_sqe()))
+    return err("get_sqe", "Submission ring is full");
+
+  // the buffer is picked once bytes arrive, an idle fd holds none
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUFFER_GROUP;
+  sqe->ioprio = IORING_RECVSEND_POLL_FIRST;
+  sqe->user_data = USER_DATA(OP_RECV, fd, slot->gen);
+  push_sqe();
+
+  slot->receiving = true;
+  return true;
+}
+
+static bool queue_send(size_t index)
+{
+  struct io_uring_sqe *sqe = NULL;
+  SendBuffer *buffer = send_buffers[index];
+
+  if (!(sqe = get_sqe()))
+    return err("get_sqe", "Submission ring is full");
+
+  // completes once every byte is sent or the conn fails, no partial sends to follow up on
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = buffer->fd;
+  sqe->addr = (uint64_t)(uintptr_t)(buffer->data + buffer->off);
+  sqe->len = buffer->len - buffer->off;
+  sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+  sqe->user_data = USER_DATA(OP_SEND, index, 0);
+  push_sqe();
+
+  return true;
+}
+
+static bool queue_cancel(uint64_t user_data)
+{
+  struct io_uring_sqe *sqe = NULL;
+
+  if (!(sqe = get_sqe()))
+    return err("get_sqe", "Submission ring is full");
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = user_data;
+  sqe->user_data = IGNORE_DATA;
+  push_sqe();
+
+  return true;
+}
+
+// grows io_slots to be able to index fd
+static IoSlot *get_io_slot(int fd)
+{
+  if (fd < 0)
+    return NULL;
+
+  if ((size_t)fd >= io_slots_len)
+  {
+    size_t len = io_slots_len ? io_slots_len : MAX_EVENTS;
+    while (len <= (size_t)fd)
+      len *= 2;
+
+    IoSlot *tmp = realloc(io_slots, len * sizeof(IoSlot));
+    if (!tmp)
+    {
+      err("realloc", strerror(errno));
+      return NULL;
+    }
+
+    memset(tmp + io_slots_len, 0, (len - io_slots_len) * sizeof(IoSlot));
+    io_slots = tmp;
+    io_slots_len = len;
+  }
+
+  return io_slots + fd;
+}
+
+// slot of an fd the backend has seen, NULL otherwise
+static IoSlot *find_io_slot(int fd)
+{
+  return fd >= 0 && (size_t)fd < io_slots_len ? io_slots + fd : NULL;
+}
+
+static void provide_buffer(uint16_t id)
+{
+  uint16_t tail = buf_ring->tail; // only this thread writes it
+  struct io_uring_buf *buf = buf_ring->bufs + (tail & (recv_buffers_num - 1));
+
+  buf->addr = (uint64_t)(uintptr_t)(recv_buffers + (size_t)id * BUFFER_SIZE);
+  buf->len = BUFFER_SIZE;
+  buf->bid = id;
+
+  __atomic_store_n(&buf_ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
+
+// hands a buffer back to the kernel, a starved fd gets to receive into it
+static void recycle_buffer(uint16_t id)
+{
+  provide_buffer(id);
+
+  while (starved_num)
+  {
+    int fd = starved_fds[--starved_num];
+    IoSlot *slot = find_io_slot(fd);
+
+    // closed or rearmed since
+    if (!slot || !slot->io || !slot->starved)
+      continue;
+
+    slot->starved = false;
+    if (!queue_recv(fd, slot))
+      err("queue_recv", NULL);
+    break;
+  }
+}
+
+static void starve(int fd, IoSlot *slot)
+{
+  if (starved_num == starved_cap)
+  {
+    size_t cap = starved_cap ? starved_cap * 2 : MAX_EVENTS;
+    int *tmp = realloc(starved_fds, cap * sizeof(int));
+    if (!tmp)
+    {
+      err("realloc", strerror(errno));
+      return;
+    }
+
+    starved_fds = tmp;
+    starved_cap = cap;
+  }
+
+  starved_fds[starved_num++] = fd;
+  slot->starved = true;
+}
+
+static bool setup_buffers(void)
+{
+  // a conn fd holds one buffer at most, 2 of them per conn, the rest wait for one to be recycled
+  recv_buffers_num = MAX_EVENTS;
+  while (recv_buffers_num < 2 * config.max_conns && recv_buffers_num < RECV_BUFFERS_MAX)
+    recv_buffers_num *= 2;
+
+  buf_ring = mmap(NULL, recv_buffers_num * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf_ring == MAP_FAILED)
+  {
+    buf_ring = NULL;
+    return err("mmap", strerror(errno));
+  }
+
+  if (!(recv_buffers = malloc(recv_buffers_num * BUFFER_SIZE)))
+    return err("malloc", strerror(errno));
+
+  struct io_uring_buf_reg reg = {.ring_addr = (uint64_t)(uintptr_t)buf_ring,
+                                 .ring_entries = recv_buffers_num,
+                                 .bgid = BUFFER_GROUP};
+
+  if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    return err("io_uring_register", strerror(errno));
+
+  for (unsigned id = 0; id < recv_buffers_num; ++id)
+    provide_buffer((uint16_t)id);
+
+  return true;
+}
+
+// returns the index of a send buffer not in flight, allocating one if needed
+static bool get_send_buffer(size_t *index)
+{
+  if (spare_sends_num)
+  {
+    *index = spare_sends[--spare_sends_num];
+    return true;
+  }
+
+  if (send_buffers_num == send_buffers_cap)
+  {
+    size_t cap = send_buffers_cap ? send_buffers_cap * 2 : MAX_EVENTS;
+    SendBuffer **buffers = realloc(send_buffers, cap * sizeof(SendBuffer *));
+    if (!buffers)
+      return err("realloc", strerror(errno));
+    send_buffers = buffers;
+
+    // spare ones never outnumber the allocated ones
+    size_t *spares = realloc(spare_sends, cap * sizeof(size_t));
+    if (!spares)
+      return err("realloc", strerror(errno));
+    spare_sends = spares;
+
+    send_buffers_cap = cap;
+  }
+
+  if (!(send_buffers[send_buffers_num] = malloc(sizeof(SendBuffer))))
+    return err("malloc", strerror(errno));
+
+  *index = send_buffers_num++;
+  return true;
+}
+
+// from a poll to recv & send requests, the poll completing meanwhile is stale
+static bool switch_to_io(int fd, IoSlot *slot)
+{
+  if (slot->armed && !queue_cancel(USER_DATA(OP_POLL, fd, slot->gen)))
+    return err("queue_cancel", NULL);
+
+  slot->armed = false;
+  slot->io = true;
+  ++slot->gen;
+
+  // bytes arriving from now on are received right away, their completion is the readable event
+  if (slot->events & EPOLLIN && !queue_recv(fd, slot))
+    return err("queue_recv", NULL);
+
+  return true;
+}
+
+// requests hold the file, the socket would stay open till they complete
+static void reset_io_slot(int fd, IoSlot *slot)
+{
+  if (slot->armed)
+    queue_cancel(USER_DATA(fd == accepts.fd ? OP_ACCEPT : OP_POLL, fd, slot->gen));
+
+  if (slot->receiving)
+    queue_cancel(USER_DATA(OP_RECV, fd, slot->gen));
+
+  if (slot->buffered)
+    recycle_buffer(slot->buffer_id);
+
+  if (fd == accepts.fd)
+  {
+    for (size_t i = accepts.head; i < accepts.num; ++i)
+      close(accepts.fds[i]);
+    accepts.fd = -1;
+    accepts.head = accepts.num = 0;
+    accepts.error = 0;
+  }
+
+  // a send in flight is left to complete, its buffer tells it is stale
+  uint32_t gen = slot->gen + 1;
+  memset(slot, 0, sizeof *slot);
+  slot->gen = gen;
+}
+
+static uint32_t complete_poll(const struct io_uring_cqe *cqe, IoSlot **reported)
+{
+  int fd = USER_DATA_ID(cqe->user_data);
+  IoSlot *slot = find_io_slot(fd);
+
+  // completion of a request that has been cancelled or replaced since
+  if (!slot || !slot->armed || slot->io || slot->gen != USER_DATA_GEN(cqe->user_data))
+    return 0;
+
+  bool more = cqe->flags & IORING_CQE_F_MORE;
+  if (!more)
+    slot->armed = false;
+
+  if (cqe->res == -ECANCELED)
+    return 0;
+
+  // kernel may terminate a multishot poll, rearming it like epoll would keep it
+  if (!more && !(slot->events & EPOLLONESHOT) && cqe->res >= 0)
+    queue_poll(fd, slot);
+
+  *reported = slot;
+  return cqe->res < 0 ? EPOLLERR : (uint32_t)cqe->res;
+}
+
+static uint32_t complete_accept(const struct io_uring_cqe *cqe, IoSlot **reported)
+{
+  int fd = USER_DATA_ID(cqe->user_data);
+  IoSlot *slot = find_io_slot(fd);
+
+  if (!slot || fd != accepts.fd || slot->gen != USER_DATA_GEN(cqe->user_data))
+  {
+    if (cqe->res >= 0)
+      close(cqe->res);
+    return 0;
+  }
+
+  if (cqe->res == -ECANCELED)
+  {
+    slot->armed = false;
+    return 0;
+  }
+
+  if (cqe->res >= 0)
+  {
+    if (accepts.num == accepts.cap)
+    {
+      size_t cap = accepts.cap ? accepts.cap * 2 : MAX_EVENTS;
+      int *tmp = realloc(accepts.fds, cap * sizeof(int));
+      if (!tmp)
+      {
+        err("realloc", strerror(errno));
+        close(cqe->res);
+        return 0;
+      }
+
+      accepts.fds = tmp;
+      accepts.cap = cap;
+    }
+
+    accepts.fds[accepts.num++] = cqe->res;
+  }
+  else
+    accepts.error = -cqe->res;
+
+  // terminated by an error like EMFILE, retried right away like the level triggered poll would
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+  {
+    ++slot->gen;
+    if (!queue_accept(fd, slot))
+      slot->armed = false;
+  }
+
+  *reported = slot;
+  return EPOLLIN;
+}
+
+static uint32_t complete_recv(const struct io_uring_cqe *cqe, IoSlot **reported)
+{
+  int fd = USER_DATA_ID(cqe->user_data);
+  IoSlot *slot = find_io_slot(fd);
+
+  if (!slot || !slot->receiving || slot->gen != USER_DATA_GEN(cqe->user_data))
+  {
+    // bytes received for an fd closed since
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+      recycle_buffer((uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+    return 0;
+  }
+
+  slot->receiving = false;
+
+  if (cqe->res > 0)
+  {
+    slot->buffered = true;
+    slot->buffer_id = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    slot->buffer_off = 0;
+    slot->buffer_len = (uint32_t)cqe->res;
+    *reported = slot;
+    return EPOLLIN;
+  }
+
+  switch (-cqe->res)
+  {
+  case 0:
+    slot->eof = true;
+    *reported = slot;
+    return EPOLLIN | EPOLLRDHUP;
+
+  case ENOBUFS: // every buffer holds bytes not read yet
+    starve(fd, slot);
+    return 0;
+
+  case EAGAIN:
+  case EINTR:
+    queue_recv(fd, slot);
+    return 0;
+
+  case ECANCELED:
+    return 0;
+
+  default:
+    slot->recv_error = -cqe->res;
+    *reported = slot;
+    return EPOLLIN | EPOLLERR;
+  }
+}
+
+static uint32_t complete_send(const struct io_uring_cqe *cqe, IoSlot **reported)
+{
+  size_t index = (size_t)USER_DATA_ID(cqe->user_data);
+  if (index >= send_buffers_num)
+    return 0;
+
+  SendBuffer *buffer = send_buffers[index];
+  IoSlot *slot = find_io_slot(buffer->fd);
+  bool current = slot && slot->sending && slot->gen == buffer->gen;
+
+  // cut short by a signal, the rest follows on the same fd
+  if (current && (cqe->res == -EAGAIN || cqe->res == -EINTR ||
+                  (cqe->res > 0 && buffer->off + (uint32_t)cqe->res < buffer->len)))
+  {
+    buffer->off += cqe->res > 0 ? (uint32_t)cqe->res : 0;
+    if (queue_send(index))
+      return 0;
+  }
+
+  spare_sends[spare_sends_num++] = index;
+
+  if (!current)
+    return 0;
+
+  slot->sending = false;
+  *reported = slot;
+
+  if (cqe->res < 0)
+  {
+    slot->send_error = -cqe->res;
+    return EPOLLOUT | EPOLLERR;
+  }
+
+  return EPOLLOUT;
+}
+
+int wait_events(struct epoll_event *events, int max_events, int timeout,
+                const sigset_t *wait_mask)
+{
+  if (!events || max_events <= 0)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // accepted fds not handed out keep the listening fd readable, like a level triggered poll
+  IoSlot *listener = find_io_slot(accepts.fd);
+  bool backlog = listener && listener->endpoint && accepts.head < accepts.num;
+
+  unsigned head = *ring.cq_head;
+  struct timespec ts = {.tv_sec = timeout / 1000, .tv_nsec = (long)(timeout % 1000) * 1000000};
+  struct io_uring_getevents_arg arg = {.sigmask = (uint64_t)(uintptr_t)wait_mask,
+                                       .sigmask_sz = _NSIG / 8,
+                                       .ts = timeout >= 0 ? (uint64_t)(uintptr_t)&ts : 0};
+
+  // submitting all queued requests & waiting with the same syscall
+  // no need to wait if completions are left over from the last call
+  unsigned pending = *ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE),
+           min_complete =
+               backlog || head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) ? 0 : 1;
+
+  // ETIME is a timeout, EBUSY means overflown completions are yet to be flushed to the ring
+  if (syscall(__NR_io_uring_enter, ring.fd, pending, min_complete,
+              IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg) == -1 &&
+      errno != ETIME && errno != EBUSY)
+    return -1;
+
+  int filled = 0;
+  unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail && filled < max_events; ++head)
+  {
+    struct io_uring_cqe *cqe = ring.cqes + (head & *ring.cq_mask);
+    IoSlot *slot = NULL;
+    uint32_t flags = 0;
+
+    switch (USER_DATA_OP(cqe->user_data))
+    {
+    case OP_POLL:
+      flags = complete_poll(cqe, &slot);
+      break;
+    case OP_ACCEPT:
+      flags = complete_accept(cqe, &slot);
+      break;
+    case OP_RECV:
+      flags = complete_recv(cqe, &slot);
+      break;
+    case OP_SEND:
+      flags = complete_send(cqe, &slot);
+      break;
+    default:
+      continue;
+    }
+
+    // unwatched fds only record what completed, found by peek_socket()
+    if (!slot || !slot->endpoint || !flags)
+      continue;
+
+    if (slot == listener)
+      backlog = false;
+
+    events[filled].events = flags;
+    events[filled].data.ptr = slot->endpoint;
+    ++filled;
+  }
+
+  __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+  if (backlog && filled < max_events)
+  {
+    events[filled].events = EPOLLIN;
+    events[filled].data.ptr = listener->endpoint;
+    ++filled;
+  }
+
+  return filled;
+}
+
+bool add_to_epoll(Endpoint *endpoint, int fd, int flags)
+{
+  if (fd == -1)
+    return err("get_target_fd",
+               "Socket is probably being added to epoll before accepting/connecting");
+
+  IoSlot *slot = NULL;
+  if (!(slot = get_io_slot(fd)))
+    return err("get_io_slot", NULL);
+
+  slot->endpoint = endpoint;
+  slot->events = (uint32_t)flags;
+
+  // the requests in flight serve the new flags too, sockets are closed through close_socket()
+  if (slot->io || fd == accepts.fd)
+    return true;
+
+  if (slot->armed && !queue_cancel(USER_DATA(OP_POLL, fd, slot->gen)))
+    return err("queue_cancel", NULL);
+
+  ++slot->gen;
+
+  if (!queue_poll(fd, slot))
+    return err("queue_poll", NULL);
+
+  return true;
+}
+
+bool mod_in_epoll(Endpoint *endpoint, int fd, int flags)
+{
+  if (fd == -1)
+    return err("get_target_fd", "Socket fd is not initialized. Logic error!");
+
+  if ((size_t)fd >= io_slots_len)
+  {
+    errno = ENOENT;
+    return err("epoll_ctl_mod", strerror(errno));
+  }
+
+  return add_to_epoll(endpoint, fd, flags);
+}
+
+bool del_from_epoll(int fd)
+{
+  if (fd == -1)
+    return err("get_target_fd", "Socket fd is not initialized");
+
+  IoSlot *slot = NULL;
+  if (!(slot = find_io_slot(fd)))
+  {
+    errno = ENOENT;
+    return err("epoll_ctl_del", strerror(errno));
+  }
+
+  slot->endpoint = NULL;
+
+  // a recv stays in flight, what arrives on an idle fd is found by peek_socket()
+  if (slot->io || fd == accepts.fd)
+    return true;
+
+  if (slot->armed && !queue_cancel(USER_DATA(OP_POLL, fd, slot->gen)))
+    return err("queue_cancel", NULL);
+
+  slot->armed = false;
+  slot->events = 0;
+  ++slot->gen;
+
+  return true;
+}
+
+ssize_t read_socket(int fd, void *buffer, size_t len)
+{
+  IoSlot *slot = find_io_slot(fd);
+
+  // the poll that reported it readable has the bytes waiting already
+  if (!slot || !slot->io)
+  {
+    ssize_t done = read(fd, buffer, len);
+    int saved = errno;
+
+    // a poll waiting for the fd to be writable again has no completion to replace it
+    if (slot && !slot->blocked && (done != -1 || errno == EAGAIN || errno == EWOULDBLOCK))
+      switch_to_io(fd, slot);
+
+    errno = saved;
+    return done;
+  }
+
+  if (slot->buffered)
+  {
+    size_t left = slot->buffer_len - slot->buffer_off, copied = len < left ? len : left;
+    memcpy(buffer, recv_buffers + (size_t)slot->buffer_id * BUFFER_SIZE + slot->buffer_off,
+           copied);
+    slot->buffer_off += (uint32_t)copied;
+
+    if (slot->buffer_off == slot->buffer_len)
+    {
+      slot->buffered = false;
+      recycle_buffer(slot->buffer_id);
+
+      if (!slot->receiving && !slot->starved && !queue_recv(fd, slot))
+        err("queue_recv", NULL);
+    }
+
+    return (ssize_t)copied;
+  }
+
+  if (slot->recv_error)
+  {
+    errno = slot->recv_error;
+    return -1;
+  }
+
+  if (slot->eof)
+    return 0;
+
+  if (!slot->receiving && !slot->starved && !queue_recv(fd, slot))
+    return -1;
+
+  errno = EAGAIN;
+  return -1;
+}
+
+ssize_t write_socket(int fd, const void *buffer, size_t len)
+{
+  IoSlot *slot = find_io_slot(fd);
+
+  if (!slot || !slot->io)
+  {
+    ssize_t done = send(fd, buffer, len, MSG_NOSIGNAL);
+    int saved = errno;
+
+    // once switched, the fd is writable whenever no send is in flight, so a poll waiting for it
+    // to drain is kept till a write goes through
+    if (slot)
+    {
+      slot->blocked = done == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+      if (done != -1)
+        switch_to_io(fd, slot);
+    }
+
+    errno = saved;
+    return done;
+  }
+
+  if (slot->send_error)
+  {
+    errno = slot->send_error;
+    return -1;
+  }
+
+  if (slot->sending)
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  size_t index = 0;
+  if (!get_send_buffer(&index))
+    return -1;
+
+  SendBuffer *copy = send_buffers[index];
+  size_t copied = len < BUFFER_SIZE ? len : BUFFER_SIZE;
+
+  memcpy(copy->data, buffer, copied);
+  copy->fd = fd;
+  copy->gen = slot->gen;
+  copy->off = 0;
+  copy->len = (uint32_t)copied;
+
+  if (!queue_send(index))
+  {
+    spare_sends[spare_sends_num++] = index;
+    errno = EAGAIN;
+    return -1;
+  }
+
+  slot->sending = true;
+  return (ssize_t)copied;
+}
+
+int accept_socket(int fd, struct sockaddr *addr, socklen_t *addr_len)
+{
+  IoSlot *slot = find_io_slot(fd);
+
+  // the first listening fd of the worker switches to a multishot accept once it would block
+  if (fd != accepts.fd)
+  {
+    int accepted = accept4(fd, addr, addr_len, SOCK_NONBLOCK);
+    if (accepted != -1 || (errno != EAGAIN && errno != EWOULDBLOCK) || accepts.fd >= 0 || !slot)
+      return accepted;
+
+    if (slot->armed && !queue_cancel(USER_DATA(OP_POLL, fd, slot->gen)))
+      err("queue_cancel", NULL);
+    else
+    {
+      ++slot->gen;
+      if (queue_accept(fd, slot))
+        accepts.fd = fd;
+      else // keeps polling
+        queue_poll(fd, slot);
+    }
+
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (accepts.head < accepts.num)
+  {
+    int accepted = accepts.fds[accepts.head++];
+    if (accepts.head == accepts.num)
+      accepts.head = accepts.num = 0;
+
+    // left zeroed if the client is gone already, the next read tells
+    if (addr && getpeername(accepted, addr, addr_len) == -1)
+      *addr_len = 0;
+
+    return accepted;
+  }
+
+  if (accepts.error)
+  {
+    errno = accepts.error;
+    accepts.error = 0;
+    return -1;
+  }
+
+  errno = EAGAIN;
+  return -1;
+}
+
+bool peek_socket(int fd)
+{
+  IoSlot *slot = find_io_slot(fd);
+
+  if (slot && slot->io)
+    return slot->buffered || slot->eof || slot->recv_error;
+
+  char byte;
+  return recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) != -1 ||
+         (errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+int close_socket(int fd)
+{
+  IoSlot *slot = find_io_slot(fd);
+
+  // a queued send only has the fd number, it has to take the file before the fd is gone
+  if (slot && slot->sending && !submit_requests())
+    err("submit_requests", NULL);
+
+  if (slot)
+    reset_io_slot(fd, slot);
+
+  return close(fd);
+}
+
+#endif
@@ -0,0 +1,1279 @@
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef USE_NGHTTP2
+#include <nghttp2/nghttp2.h>
+#endif
+
+#include "client.h"
+#include "connection.h"
+#include "event.h"
+#include "h2.h"
+#include "http.h"
+#include "main.h"
+#include "proxy.h"
+#include "timeout.h"
+#include "upstream.h"
+#include "utils.h"
+
+_Thread_local H2Stats h2_stats = {0};
+
+size_t max_sessions(void) { return config.upstream_h2 ? upstreams_num * H2_SESSIONS_MAX : 0; }
+
+void print_h2_stats(void)
+{
+  if (!config.upstream_h2)
+    return;
+
+  printf("HTTP/2 upstreams: %zu sessions, %zu streams, %zu reset\n", h2_stats.sessions,
+         h2_stats.streams, h2_stats.reset);
+}
+
+#ifdef USE_NGHTTP2
+
+#define CHUNK_LINE "%08zx\r\n" // fixed width, so the size of an open chunk can grow in place
+#define CHUNK_LINE_LEN 10
+#define FRAME_HEADER_LEN 9 // length, type, flags & stream id, before the payload of every frame
+
+// sessions of every member, indexed by member
+static _Thread_local H2Session **sessions = NULL;
+
+// a session was marked dirty since the last flush_sessions()
+static _Thread_local bool dirty = false;
+
+bool setup_h2(void)
+{
+  memset(&h2_stats, 0, sizeof h2_stats);
+
+  if (!config.upstream_h2)
+    return true;
+
+  if (!(sessions = calloc(upstreams_num, sizeof(H2Session *))))
+    return err("calloc", strerror(errno));
+
+  return true;
+}
+
+void free_h2(void)
+{
+  // sessions are freed along with their conns
+  free(sessions);
+  sessions = NULL;
+}
+
+bool speaks_h2(const Endpoint *upstream)
+{
+  if (!config.upstream_h2 || !upstream || upstream->fd < 0)
+    return false;
+
+  if (!upstream->ssl) // h2c, by prior knowledge
+    return true;
+
+  const unsigned char *protocol = NULL;
+  unsigned int len = 0;
+  SSL_get0_alpn_selected(upstream->ssl, &protocol, &len);
+
+  return len == 2 && !memcmp(protocol, "h2", 2);
+}
+
+static void mark_dirty(H2Session *session) { session->dirty = dirty = true; }
+
+// queues conn to be handled once the frames that gave it data are processed, only once as
+// read_stream() clears the readiness
+static void wake_stream(H2Session *session, Connection *conn)
+{
+  if (conn->upstream.readable || session->woken_num == H2_MAX_STREAMS)
+    return;
+
+  conn->upstream.readable = true;
+  session->woken[session->woken_num++] = conn;
+}
+
+// for streams closed before being handled, the conn may be freed
+static void unwake_stream(H2Session *session, Connection *conn)
+{
+  for (size_t i = 0; i < session->woken_num; ++i)
+    if (session->woken[i] == conn)
+    {
+      session->woken[i] = session->woken[--session->woken_num];
+      return;
+    }
+}
+
+static void wake_streams(H2Session *session)
+{
+  // handling a stream only queues frames, so the session is not freed meanwhile
+  while (session->woken_num)
+    handle_state(session->woken[--session->woken_num]);
+}
+
+static void detach_stream(Connection *conn)
+{
+  H2Session *session = conn->session;
+
+  if (conn->stream_prev)
+    conn->stream_prev->stream_next = conn->stream_next;
+  else
+    session->streams = conn->stream_next;
+
+  if (conn->stream_next)
+    conn->stream_next->stream_prev = conn->stream_prev;
+
+  conn->stream_next = conn->stream_prev = NULL;
+  conn->session = NULL;
+  conn->stream_id = -1;
+
+  // started only for sessions that stay open
+  if (!--session->streams_num && session->conn->self_ptr)
+  {
+    remove_timeout(&session->conn->conn_timeout);
+    fill_timeout(session->conn, SESSION_IDLE, -1);
+    enqueue_timeout(&session->conn->conn_timeout);
+  }
+}
+
+// frees the session & its conn, its streams have to be detached already
+static void drop_session(H2Session *session)
+{
+  for (H2Session **current = sessions + session->member; *current; current = &(*current)->next)
+    if (*current == session)
+    {
+      *current = session->next;
+      break;
+    }
+
+  Connection *conn = session->conn;
+  conn->session = NULL;
+
+  nghttp2_session_del(session->session);
+  free(session);
+
+  close_upstream(conn);
+  free_conn(&conn);
+}
+
+static void fail_session(H2Session *session)
+{
+  while (session->streams)
+  {
+    Connection *conn = session->streams;
+    detach_stream(conn);
+    wake_stream(session, conn);
+  }
+
+  // handled once the session is gone, so retries cannot pick it again
+  Connection *woken[H2_MAX_STREAMS];
+  size_t woken_num = session->woken_num;
+  memcpy(woken, session->woken, woken_num * sizeof(Connection *));
+
+  drop_session(session);
+
+  while (woken_num)
+  {
+    Connection *conn = woken[--woken_num];
+    if (conn->self_ptr)
+      handle_state(conn);
+  }
+}
+
+// sends what the session has queued while the fd is writable
+static bool flush_session(H2Session *session)
+{
+  session->dirty = false;
+
+  if (nghttp2_session_send(session->session) != 0)
+    return false;
+
+  // a stream may have been closed by a frame sent
+  wake_streams(session);
+  return true;
+}
+
+void flush_sessions(void)
+{
+  // failing a session handles its streams, which may queue frames on other sessions
+  while (dirty)
+  {
+    dirty = false;
+
+    for (size_t i = 0; i < upstreams_num; ++i)
+      for (H2Session *session = sessions[i], *next = NULL; session; session = next)
+      {
+        next = session->next;
+
+        if (session->dirty && !flush_session(session))
+        {
+          warn("nghttp2_session_send", "HTTP/2 upstream session failed");
+          fail_session(session);
+        }
+      }
+  }
+}
+
+static ssize_t send_frames(nghttp2_session *session, const uint8_t *data, size_t len, int flags,
+                           void *user_data)
+{
+  (void)session;
+  (void)flags;
+
+  Endpoint *upstream = &((H2Session *)user_data)->conn->upstream;
+
+  if (!upstream->writable)
+    return NGHTTP2_ERR_WOULDBLOCK;
+
+  if (!upstream->ssl)
+  {
+    ssize_t sent = write_socket(upstream->fd, data, len);
+
+    if (sent >= 0)
+      return sent;
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+
+    upstream->writable = false;
+    return NGHTTP2_ERR_WOULDBLOCK;
+  }
+
+  ERR_clear_error();
+  int sent = SSL_write(upstream->ssl, data, (int)len);
+
+  if (sent > 0)
+    return sent;
+
+  switch (SSL_get_error(upstream->ssl, sent))
+  {
+  case SSL_ERROR_WANT_WRITE:
+    upstream->writable = false;
+    return NGHTTP2_ERR_WOULDBLOCK;
+
+  case SSL_ERROR_WANT_READ:
+    upstream->readable = false;
+    return NGHTTP2_ERR_WOULDBLOCK;
+
+  default:
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  }
+}
+
+static ssize_t recv_frames(nghttp2_session *session, uint8_t *buffer, size_t len, int flags,
+                           void *user_data)
+{
+  (void)session;
+  (void)flags;
+
+  Endpoint *upstream = &((H2Session *)user_data)->conn->upstream;
+
+  if (!upstream->readable)
+    return NGHTTP2_ERR_WOULDBLOCK;
+
+  if (!upstream->ssl)
+  {
+    ssize_t received = read_socket(upstream->fd, buffer, len);
+
+    if (received > 0)
+      return received;
+
+    if (!received)
+      return NGHTTP2_ERR_EOF;
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+
+    upstream->readable = false;
+    return NGHTTP2_ERR_WOULDBLOCK;
+  }
+
+  ERR_clear_error();
+  int received = SSL_read(upstream->ssl, buffer, (int)len);
+
+  if (received > 0)
+    return received;
+
+  switch (SSL_get_error(upstream->ssl, received))
+  {
+  case SSL_ERROR_WANT_READ:
+    upstream->readable = false;
+    return NGHTTP2_ERR_WOULDBLOCK;
+
+  case SSL_ERROR_WANT_WRITE:
+    upstream->writable = false;
+    return NGHTTP2_ERR_WOULDBLOCK;
+
+  case SSL_ERROR_ZERO_RETURN: // close_notify
+    return NGHTTP2_ERR_EOF;
+
+  default:
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  }
+}
+
+// moves the part of the upstream buffer not written to the client yet to its start, if needed
+// for len more bytes. returns false if they do not fit
+static bool make_room(Connection *conn, size_t len)
+{
+  Endpoint *upstream = &conn->upstream;
+
+  if (upstream->write_index == upstream->read_index) // everything was written
+  {
+    upstream->read_index = upstream->write_index = 0;
+    conn->chunk_start = -1;
+  }
+
+  if ((size_t)upstream->read_index + len < BUFFER_SIZE)
+    return true;
+
+  if (upstream->write_index)
+  {
+    size_t pending = (size_t)(upstream->read_index - upstream->write_index);
+    memmove(upstream->buffer, upstream->buffer + upstream->write_index, pending);
+
+    conn->chunk_start =
+        conn->chunk_start >= upstream->write_index ? conn->chunk_start - upstream->write_index : -1;
+    upstream->read_index = (ptrdiff_t)pending;
+    upstream->write_index = 0;
+  }
+
+  return (size_t)upstream->read_index + len < BUFFER_SIZE;
+}
+
+static void append(Endpoint *upstream, const void *data, size_t len)
+{
+  memcpy(upstream->buffer + upstream->read_index, data, len);
+  upstream->read_index += (ptrdiff_t)len;
+  upstream->buffer[upstream->read_index] = '\0';
+}
+
+// appends response data as is, or as chunks if the response had no content-length
+// data is added to the open chunk while its size line has not been written to the client
+static bool append_data(Connection *conn, const uint8_t *data, size_t len)
+{
+  Endpoint *upstream = &conn->upstream;
+  char size_line[CHUNK_LINE_LEN + 1];
+
+  if (!upstream->chunked)
+  {
+    if (!make_room(conn, len))
+      return false;
+
+    append(upstream, data, len);
+    return true;
+  }
+
+  bool grow = conn->chunk_len && conn->chunk_start >= upstream->write_index;
+
+  if (!make_room(conn, len + (grow ? 0 : LINEBREAK_STR.len + CHUNK_LINE_LEN)))
+    return false;
+
+  // compacting may have written the size line off
+  if (grow && conn->chunk_start >= 0)
+  {
+    append(upstream, data, len);
+    conn->chunk_len += len;
+
+    snprintf(size_line, sizeof size_line, CHUNK_LINE, conn->chunk_len);
+    memcpy(upstream->buffer + conn->chunk_start, size_line, CHUNK_LINE_LEN);
+    return true;
+  }
+
+  if (conn->chunk_len) // closing the open chunk
+    append(upstream, LINEBREAK, (size_t)LINEBREAK_STR.len);
+
+  conn->chunk_start = upstream->read_index;
+  conn->chunk_len = len;
+
+  snprintf(size_line, sizeof size_line, CHUNK_LINE, len);
+  append(upstream, size_line, CHUNK_LINE_LEN);
+  append(upstream, data, len);
+  return true;
+}
+
+static bool append_last_chunk(Connection *conn)
+{
+  Endpoint *upstream = &conn->upstream;
+
+  if (!make_room(conn, (size_t)(LINEBREAK_STR.len + LAST_CHUNK_STR.len)))
+    return false;
+
+  if (conn->chunk_len)
+    append(upstream, LINEBREAK, (size_t)LINEBREAK_STR.len);
+
+  append(upstream, LAST_CHUNK, (size_t)LAST_CHUNK_STR.len);
+  conn->chunk_len = 0;
+  return true;
+}
+
+// http/1.1 status line & header fields, from the response HEADERS of a stream
+static int on_header(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name,
+                     size_t name_len, const uint8_t *value, size_t value_len, uint8_t flags,
+                     void *user_data)
+{
+  (void)flags;
+  (void)user_data;
+
+  Connection *conn = NULL;
+  if (frame->hd.type != NGHTTP2_HEADERS ||
+      !(conn = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id)))
+    return 0;
+
+  Endpoint *upstream = &conn->upstream;
+
+  if (upstream->headers.len) // trailers, dropped
+    return 0;
+
+  char *end = upstream->buffer + upstream->read_index;
+  size_t left = H2_HEADERS_MAX - (size_t)upstream->read_index;
+  int len = 0;
+
+  if (name_len == 7 && !memcmp(name, ":status", 7))
+  {
+    unsigned int status = (unsigned int)atoi((const char *)value);
+    const char *status_str = get_status_string(status);
+
+    // known status codes get their reason phrase, it can be left empty
+    len = snprintf(end, left, "HTTP/1.1 %u %s\r\n", status,
+                   (unsigned int)atoi(status_str) == status ? status_str + 4 : "");
+  }
+  else if (*name == ':')
+    return 0;
+  else
+    len = snprintf(end, left, "%.*s: %.*s\r\n", (int)name_len, (const char *)name, (int)value_len,
+                   (const char *)value);
+
+  if (len < 0 || (size_t)len >= left)
+  {
+    warn("on_header", "Response headers too large");
+    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE; // resets the stream
+  }
+
+  upstream->read_index += len;
+  return 0;
+}
+
+// ends the http/1.1 headers of conn, adding the framing of the body if the response had no
+// content-length. interim responses are dropped
+static bool finish_headers(H2Session *session, Connection *conn, bool end_stream)
+{
+  Endpoint *upstream = &conn->upstream;
+  unsigned int status = get_response_status(upstream->buffer);
+
+  if (status < 200)
+  {
+    upstream->read_index = 0;
+    *upstream->buffer = '\0';
+    return true;
+  }
+
+  // field names are lowercase in http/2
+  const char *framing = "";
+  if (!strstr(upstream->buffer, "\r\ncontent-length:") && status != 204 && status != 304 &&
+      strncmp(conn->client.buffer, "HEAD ", 5))
+    framing = end_stream ? "content-length: 0\r\n" : "transfer-encoding: chunked\r\n";
+
+  size_t len = strlen(framing);
+  if ((size_t)upstream->read_index + len + (size_t)LINEBREAK_STR.len >= H2_HEADERS_MAX)
+    return warn("finish_headers", "Response headers too large");
+
+  append(upstream, framing, len);
+  append(upstream, LINEBREAK, (size_t)LINEBREAK_STR.len);
+
+  upstream->chunked = *framing == 't';
+  upstream->headers.data = upstream->buffer;
+  upstream->headers.len = upstream->read_index; // found by read_stream()
+
+  wake_stream(session, conn);
+  return true;
+}
+
+static int on_frame_recv(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+{
+  Connection *conn = NULL;
+  if (frame->hd.type != NGHTTP2_HEADERS ||
+      !(conn = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id)) ||
+      conn->upstream.headers.len)
+    return 0;
+
+  return finish_headers(user_data, conn, frame->hd.flags & NGHTTP2_FLAG_END_STREAM)
+             ? 0
+             : NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+}
+
+static int on_data_chunk_recv(nghttp2_session *session, uint8_t flags, int32_t stream_id,
+                              const uint8_t *data, size_t len, void *user_data)
+{
+  (void)flags;
+
+  // the session window is not held up by any stream
+  nghttp2_session_consume_connection(session, len);
+
+  Connection *conn = NULL;
+  if (!(conn = nghttp2_session_get_stream_user_data(session, stream_id)))
+    return 0;
+
+  // the stream window keeps the data within the buffer, unless the upstream ignores it
+  if (!append_data(conn, data, len))
+  {
+    warn("append_data", "Stream data does not fit the buffer");
+    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+  }
+
+  conn->unconsumed += len;
+  wake_stream(user_data, conn);
+  return 0;
+}
+
+static int on_stream_close(nghttp2_session *session, int32_t stream_id, uint32_t error_code,
+                           void *user_data)
+{
+  Connection *conn = NULL;
+  if (!(conn = nghttp2_session_get_stream_user_data(session, stream_id)))
+    return 0;
+
+  if (error_code == NGHTTP2_NO_ERROR && conn->upstream.headers.len &&
+      (!conn->upstream.chunked || append_last_chunk(conn)))
+    conn->complete = true;
+  else
+  {
+    warn("on_stream_close", nghttp2_http2_strerror(error_code));
+    ++h2_stats.reset;
+  }
+
+  detach_stream(conn);
+  wake_stream(user_data, conn);
+  return 0;
+}
+
+static H2Session *new_session(Connection *conn)
+{
+  H2Session *session = NULL;
+  nghttp2_session_callbacks *callbacks = NULL;
+  nghttp2_option *option = NULL;
+
+  if (!(session = calloc(1, sizeof(H2Session))))
+  {
+    err("calloc", strerror(errno));
+    return NULL;
+  }
+
+  if (nghttp2_session_callbacks_new(&callbacks) || nghttp2_option_new(&option))
+  {
+    err("nghttp2_session_callbacks_new", NULL);
+    goto error;
+  }
+
+  nghttp2_session_callbacks_set_send_callback(callbacks, send_frames);
+  nghttp2_session_callbacks_set_recv_callback(callbacks, recv_frames);
+  nghttp2_session_callbacks_set_on_header_callback(callbacks, on_header);
+  nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, on_frame_recv);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, on_data_chunk_recv);
+  nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, on_stream_close);
+
+  // stream windows are given back by ack_stream(), once the client took the data
+  nghttp2_option_set_no_auto_window_update(option, 1);
+
+  if (nghttp2_session_client_new2(&session->session, callbacks, session, option))
+  {
+    err("nghttp2_session_client_new2", NULL);
+    goto error;
+  }
+
+  nghttp2_session_callbacks_del(callbacks);
+  nghttp2_option_del(option);
+
+  const nghttp2_settings_entry settings[] = {
+      {NGHTTP2_SETTINGS_ENABLE_PUSH, 0},
+      {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, H2_STREAM_WINDOW},
+      {NGHTTP2_SETTINGS_MAX_HEADER_LIST_SIZE, H2_HEADERS_MAX}};
+
+  if (nghttp2_submit_settings(session->session, NGHTTP2_FLAG_NONE, settings,
+                              sizeof settings / sizeof(nghttp2_settings_entry)) ||
+      nghttp2_session_set_local_window_size(session->session, NGHTTP2_FLAG_NONE, 0,
+                                            H2_SESSION_WINDOW))
+  {
+    err("nghttp2_submit_settings", NULL);
+    nghttp2_session_del(session->session);
+    free(session);
+    return NULL;
+  }
+
+  session->conn = conn;
+  return session;
+
+error:
+  nghttp2_session_callbacks_del(callbacks);
+  nghttp2_option_del(option);
+  free(session);
+  return NULL;
+}
+
+static bool has_room(H2Session *session)
+{
+  uint32_t max = nghttp2_session_get_remote_settings(session->session,
+                                                     NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS);
+
+  return session->streams_num < (max < H2_MAX_STREAMS ? max : H2_MAX_STREAMS) &&
+         nghttp2_session_check_request_allowed(session->session);
+}
+
+// hop by hop fields of http/1.1, not allowed in http/2
+static bool is_hop_by_hop(const char *name, size_t len)
+{
+  static const char *const fields[] = {"host",    "connection",        "keep-alive",
+                                       "upgrade", "transfer-encoding", "proxy-connection"};
+
+  for (size_t i = 0; i < sizeof fields / sizeof(char *); ++i)
+    if (strlen(fields[i]) == len && !memcmp(name, fields[i], len))
+      return true;
+
+  return false;
+}
+
+// DATA of a request body, taken out of the client ring. the stream is resumed by write_stream()
+// once the ring has more, & the stream is woken to read more once there is room in the ring
+static ssize_t provide_body(nghttp2_session *session, int32_t stream_id, uint8_t *buffer,
+                            size_t len, uint32_t *data_flags, nghttp2_data_source *source,
+                            void *user_data)
+{
+  (void)source;
+
+  Connection *conn = NULL;
+  if (!(conn = nghttp2_session_get_stream_user_data(session, stream_id))) // being reset
+    return NGHTTP2_ERR_DEFERRED;
+
+  Endpoint *client = &conn->client;
+  size_t copied = 0, data = 0;
+
+  while (copied < len && (data = ring_data(client)))
+  {
+    data = data < len - copied ? data : len - copied;
+    memcpy(buffer + copied, client->buffer + client->write_index, data);
+    ring_pop(client, data);
+    copied += data;
+  }
+
+  conn->sent += copied;
+
+  if (body_received(client) && !client->to_write)
+    *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+  else if (!copied)
+    return NGHTTP2_ERR_DEFERRED;
+
+  if (copied && conn->state == WRITE_REQUEST)
+    wake_stream(user_data, conn);
+
+  return (ssize_t)copied;
+}
+
+#define NV(name, name_len, value, value_len)                                                     \
+  (nghttp2_nv){(uint8_t *)(name), (uint8_t *)(value), (name_len), (value_len), NGHTTP2_NV_FLAG_NONE}
+
+// sends the request headers of conn as a new stream of session
+static bool submit_stream(H2Session *session, Connection *conn)
+{
+  Endpoint *client = &conn->client;
+  nghttp2_nv fields[H2_MAX_FIELDS];
+  char names[BUFFER_SIZE]; // lowercase copies, copied again by nghttp2
+  size_t fields_num = 0, names_len = 0;
+
+  const char *method = client->headers.data, *scheme = upstreams[conn->member].https ? "https" : "http";
+  fields[fields_num++] = NV(":method", 7, method, strcspn(method, " "));
+  fields[fields_num++] = NV(":scheme", 7, scheme, strlen(scheme));
+  fields[fields_num++] = NV(":authority", 10, conn->host.data, (size_t)conn->host.len);
+  fields[fields_num++] = NV(":path", 5, conn->path.data, (size_t)conn->path.len);
+
+  // lines after the request line, till the empty line ending the headers
+  const char *end = client->headers.data + client->headers.len - LINEBREAK_STR.len;
+  for (const char *line = strstr(method, LINEBREAK) + LINEBREAK_STR.len, *next = NULL; line < end;
+       line = next + LINEBREAK_STR.len)
+  {
+    next = strstr(line, LINEBREAK);
+
+    const char *colon = memchr(line, ':', (size_t)(next - line)), *value = colon + 1;
+    if (!colon)
+      continue;
+
+    size_t name_len = (size_t)(colon - line);
+    for (size_t i = 0; i < name_len; ++i)
+      names[names_len + i] = (char)tolower(line[i]);
+
+    if (is_hop_by_hop(names + names_len, name_len))
+      continue;
+
+    // only te: trailers is allowed
+    if (name_len == 2 && !memcmp(names + names_len, "te", 2))
+      continue;
+
+    if (fields_num == H2_MAX_FIELDS)
+      return err("submit_stream", "Too many request header fields");
+
+    while (*value == ' ' || *value == '\t')
+      ++value;
+
+    size_t value_len = (size_t)(next - value);
+    while (value_len && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t'))
+      --value_len;
+
+    fields[fields_num++] = NV(names + names_len, name_len, value, value_len);
+    names_len += name_len;
+  }
+
+  // the body is sent as it arrives, without the framing of a chunked one
+  bool body = client->content_len || client->chunked;
+  nghttp2_data_provider provider = {.source.ptr = conn, .read_callback = provide_body};
+
+  if (body && !start_body(conn, true))
+    return err("start_body", NULL);
+
+  int32_t stream_id = nghttp2_submit_request(session->session, NULL, fields, fields_num,
+                                             body ? &provider : NULL, conn);
+  if (stream_id < 0)
+    return err("nghttp2_submit_request", nghttp2_strerror(stream_id));
+
+  conn->session = session;
+  conn->stream_id = stream_id;
+  conn->stream_prev = NULL;
+  conn->stream_next = session->streams;
+  if (session->streams)
+    session->streams->stream_prev = conn;
+  session->streams = conn;
+  ++session->streams_num;
+
+  // the stream buffer is filled by the session from now on
+  conn->upstream.readable = conn->upstream.writable = false;
+  conn->unconsumed = conn->chunk_len = 0;
+  conn->chunk_start = -1;
+  conn->sent = (size_t)client->headers.len;
+  conn->state = body ? WRITE_REQUEST : READ_RESPONSE;
+
+  remove_timeout(&session->conn->conn_timeout); // not idle anymore
+  mark_dirty(session);
+  ++h2_stats.streams;
+
+  return true;
+}
+
+bool attach_stream(Connection *conn)
+{
+  if (!sessions || !conn || conn->member == NO_MEMBER)
+    return false;
+
+  // oldest first, so the newer sessions empty out & expire after a burst
+  for (H2Session *session = sessions[conn->member]; session; session = session->next)
+    if (has_room(session))
+      return submit_stream(session, conn);
+
+  return false;
+}
+
+void open_session(Connection *conn)
+{
+  if (!conn)
+    return;
+
+  Endpoint *upstream = &conn->upstream;
+  H2Session **last = sessions + conn->member;
+  size_t sessions_num = 0;
+
+  for (; *last; last = &(*last)->next)
+    ++sessions_num;
+
+  // the conn raced the sessions of the member, dropped instead of opening one more
+  if (sessions_num >= H2_SESSIONS_MAX)
+  {
+    close_upstream(conn);
+
+    if (attach_stream(conn))
+      return;
+
+    conn->status = 503;
+    conn->state = WRITE_ERROR;
+    return;
+  }
+
+  Connection *session_conn = NULL;
+  H2Session *session = NULL;
+
+  if (!(session_conn = init_conn()) || !(session = new_session(session_conn)))
+  {
+    err("open_session", NULL);
+    free_conn(&session_conn);
+    goto error;
+  }
+
+  // lives as long as it has streams, or till idle for IDLE_UPSTREAM_TIMEOUT
+  remove_timeout(&session_conn->conn_timeout);
+  session_conn->state = H2_SESSION;
+  session_conn->session = session;
+  session->member = conn->member;
+
+  // writes may be partial, or retried from a new position by nghttp2
+  if (upstream->ssl)
+    SSL_set_mode(upstream->ssl,
+                 SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+  // event data of the fd still points to the endpoint of conn, and so do events of the fd
+  // already fetched in this loop iteration. assumed ready, as their edges may be lost to conn
+  Endpoint *session_upstream = &session_conn->upstream;
+  session_upstream->fd = upstream->fd;
+  session_upstream->ssl = upstream->ssl;
+  session_upstream->readable = session_upstream->writable = true;
+  upstream->fd = -1;
+  upstream->ssl = NULL;
+
+  // small frames of many streams, like the last DATA a window allows, are not held back waiting
+  // for an ack the member delays
+  if (setsockopt(session_upstream->fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)) == -1)
+    warn("setsockopt", strerror(errno));
+
+  *last = session;
+  ++h2_stats.sessions;
+
+  if (!mod_in_epoll(session_upstream, session_upstream->fd, EVENT_FLAGS) ||
+      !submit_stream(session, conn))
+  {
+    err("open_session", NULL);
+    drop_session(session);
+    goto error;
+  }
+
+  return;
+
+error:
+  close_upstream(conn); // cannot be used for http/1.1 instead
+
+  if (retry_request(conn))
+    return;
+
+  conn->status = 502;
+  conn->state = WRITE_ERROR;
+}
+
+void write_stream(Connection *conn)
+{
+  if (!conn)
+    return;
+
+  Endpoint *client = &conn->client, *upstream = &conn->upstream;
+  upstream->readable = false; // woken again once the session took from the ring
+
+  if (conn->stream_id > 0)
+  {
+    ssize_t read_status = read_body(conn, true);
+
+    if (read_status < 0)
+      return;
+
+    if (read_status || body_received(client))
+    {
+      nghttp2_session_resume_data(conn->session->session, conn->stream_id);
+      mark_dirty(conn->session);
+    }
+
+    if (!body_received(client) || conn->continue_left)
+      return;
+  }
+  else if (!body_received(client)) // the rest of the body is not read
+    conn->keep_alive = false;
+
+  // the rest of the ring is sent by the session meanwhile, and a stream closed early, like by a
+  // response that did not wait for the body, is handled by read_stream()
+  upstream->readable = true;
+  conn->state = READ_RESPONSE;
+}
+
+void read_stream(Connection *conn)
+{
+  if (!conn)
+    return;
+
+  Endpoint *upstream = &conn->upstream;
+  upstream->readable = false;
+
+  if (!upstream->headers_found && upstream->headers.len) // ended by the session
+    upstream->headers_found = true;
+
+  if (upstream->headers_found && upstream->read_index > upstream->write_index)
+  {
+    conn->state = WRITE_RESPONSE;
+    return;
+  }
+
+  if (conn->complete)
+  {
+    conn->state = CHECK_CONN;
+    return;
+  }
+
+  if (conn->stream_id > 0) // more to come
+    return;
+
+  warn("read_stream", "Upstream stream closed");
+
+  if (retry_request(conn))
+    return;
+
+  // nothing was sent to the client yet, so it can still get an error
+  if (!upstream->headers_found)
+  {
+    conn->status = 502;
+    conn->state = WRITE_ERROR;
+    return;
+  }
+
+  conn->state = CLOSE_CONN;
+}
+
+void ack_stream(Connection *conn)
+{
+  if (!conn || conn->stream_id <= 0 || !conn->unconsumed)
+    return;
+
+  nghttp2_session_consume_stream(conn->session->session, conn->stream_id, conn->unconsumed);
+  conn->unconsumed = 0;
+  mark_dirty(conn->session);
+}
+
+void move_stream(Connection *from, Connection *to)
+{
+  if (!from || !to || !from->stream_id)
+    return;
+
+  to->stream_id = from->stream_id;
+  to->unconsumed = from->unconsumed;
+  to->chunk_start = from->chunk_start;
+  to->chunk_len = from->chunk_len;
+
+  if (from->stream_id > 0)
+  {
+    H2Session *session = to->session = from->session;
+
+    to->stream_prev = from->stream_prev;
+    to->stream_next = from->stream_next;
+
+    if (to->stream_prev)
+      to->stream_prev->stream_next = to;
+    else
+      session->streams = to;
+
+    if (to->stream_next)
+      to->stream_next->stream_prev = to;
+
+    for (size_t i = 0; i < session->woken_num; ++i)
+      if (session->woken[i] == from)
+        session->woken[i] = to;
+
+    nghttp2_session_set_stream_user_data(session->session, to->stream_id, to);
+  }
+
+  from->session = NULL;
+  from->stream_next = from->stream_prev = NULL;
+  from->stream_id = 0;
+  from->unconsumed = from->chunk_len = 0;
+  from->chunk_start = -1;
+}
+
+void close_stream(Connection *conn)
+{
+  if (!conn || !conn->stream_id)
+    return;
+
+  if (conn->stream_id > 0)
+  {
+    H2Session *session = conn->session;
+
+    // frames still arriving for the stream are dropped
+    nghttp2_session_set_stream_user_data(session->session, conn->stream_id, NULL);
+    nghttp2_submit_rst_stream(session->session, NGHTTP2_FLAG_NONE, conn->stream_id,
+                              NGHTTP2_CANCEL);
+    unwake_stream(session, conn);
+    detach_stream(conn);
+    mark_dirty(session);
+  }
+
+  conn->stream_id = 0;
+  conn->unconsumed = conn->chunk_len = 0;
+  conn->chunk_start = -1;
+}
+
+void continue_session(Connection *conn)
+{
+  H2Session *session = NULL;
+  if (!conn || conn->state != H2_SESSION || !(session = conn->session))
+    return;
+
+  int status = 0;
+  if (conn->upstream.readable && (status = nghttp2_session_recv(session->session)) != 0)
+  {
+    if (status != NGHTTP2_ERR_EOF || session->streams_num)
+      warn("nghttp2_session_recv", nghttp2_strerror(status));
+
+    fail_session(session);
+    return;
+  }
+
+  wake_streams(session);
+
+  if (!flush_session(session))
+  {
+    warn("nghttp2_session_send", "HTTP/2 upstream session failed");
+    fail_session(session);
+    return;
+  }
+
+  // a GOAWAY was exchanged, streams left are closed like on an upstream EOF
+  if (!nghttp2_session_want_read(session->session) &&
+      !nghttp2_session_want_write(session->session))
+    fail_session(session);
+}
+
+void close_session(Connection *conn)
+{
+  H2Session *session = NULL;
+  if (!conn || conn->state != H2_SESSION || !(session = conn->session) || session->streams_num)
+    return;
+
+  // best effort, the upstream treats a missing GOAWAY like a closed idle conn
+  nghttp2_session_terminate_session(session->session, NGHTTP2_NO_ERROR);
+  nghttp2_session_send(session->session);
+
+  drop_session(session);
+}
+
+void free_session(Connection *conn)
+{
+  H2Session *session = NULL;
+  if (!conn || conn->state != H2_SESSION || !(session = conn->session))
+    return;
+
+  // left closed, without handling them
+  while (session->streams)
+    detach_stream(session->streams);
+
+  for (H2Session **current = sessions + session->member; *current; current = &(*current)->next)
+    if (*current == session)
+    {
+      *current = session->next;
+      break;
+    }
+
+  nghttp2_session_del(session->session);
+  free(session);
+  conn->session = NULL;
+}
+
+static void fill_frame_header(uint8_t *header, size_t len, uint8_t type, uint8_t flags,
+                              uint32_t stream_id)
+{
+  header[0] = (uint8_t)(len >> 16);
+  header[1] = (uint8_t)(len >> 8);
+  header[2] = (uint8_t)len;
+  header[3] = type;
+  header[4] = flags;
+  header[5] = (uint8_t)(stream_id >> 24);
+  header[6] = (uint8_t)(stream_id >> 16);
+  header[7] = (uint8_t)(stream_id >> 8);
+  header[8] = (uint8_t)stream_id;
+}
+
+bool fill_h2_probe(Endpoint *upstream, size_t member)
+{
+  if (!upstream)
+    return set_efault();
+
+  const Upstream *probed = upstreams + member;
+  char authority[BUFFER_SIZE / 4];
+  snprintf(authority, sizeof authority, "%s%s%s", probed->unix_socket ? "localhost" : probed->host,
+           probed->unix_socket ? "" : ":", probed->unix_socket ? "" : probed->port);
+
+  const char *scheme = probed->https ? "https" : "http";
+  nghttp2_nv fields[] = {NV(":method", 7, "GET", 3),
+                         NV(":scheme", 7, scheme, strlen(scheme)),
+                         NV(":authority", 10, authority, strlen(authority)),
+                         NV(":path", 5, config.health_path, strlen(config.health_path)),
+                         NV("user-agent", 10, SERVER, sizeof SERVER - 1)};
+
+  uint8_t *buffer = (uint8_t *)upstream->buffer;
+  size_t len = NGHTTP2_CLIENT_MAGIC_LEN;
+  memcpy(buffer, NGHTTP2_CLIENT_MAGIC, len);
+
+  fill_frame_header(buffer + len, 0, NGHTTP2_SETTINGS, NGHTTP2_FLAG_NONE, 0);
+  len += FRAME_HEADER_LEN;
+
+  nghttp2_hd_deflater *deflater = NULL;
+  if (nghttp2_hd_deflate_new(&deflater, NGHTTP2_DEFAULT_HEADER_TABLE_SIZE))
+    return err("nghttp2_hd_deflate_new", NULL);
+
+  ssize_t block = nghttp2_hd_deflate_hd(deflater, buffer + len + FRAME_HEADER_LEN,
+                                        BUFFER_SIZE - len - FRAME_HEADER_LEN, fields,
+                                        sizeof fields / sizeof(nghttp2_nv));
+  nghttp2_hd_deflate_del(deflater);
+
+  if (block < 0)
+    return err("nghttp2_hd_deflate_hd", nghttp2_strerror((int)block));
+
+  // the whole request, stream 1 is the first of the client
+  fill_frame_header(buffer + len, (size_t)block, NGHTTP2_HEADERS,
+                    NGHTTP2_FLAG_END_STREAM | NGHTTP2_FLAG_END_HEADERS, 1);
+  len += FRAME_HEADER_LEN + (size_t)block;
+
+  upstream->write_index = 0;
+  upstream->to_write = len;
+  upstream->read_index = 0;
+
+  return true;
+}
+
+// decodes the :status of a header block, the first field of a response
+static unsigned int inflate_status(const uint8_t *block, size_t len)
+{
+  nghttp2_hd_inflater *inflater = NULL;
+  if (nghttp2_hd_inflate_new(&inflater))
+    return 0;
+
+  unsigned int status = 0;
+
+  while (!status)
+  {
+    nghttp2_nv field;
+    int flags = 0;
+    ssize_t used = nghttp2_hd_inflate_hd2(inflater, &field, &flags, block, len, 1);
+
+    if (used < 0)
+      break;
+
+    block += used;
+    len -= (size_t)used;
+
+    if (flags & NGHTTP2_HD_INFLATE_EMIT && field.namelen == 7 &&
+        !memcmp(field.name, ":status", 7) && field.valuelen == 3)
+      status = (unsigned int)((field.value[0] - '0') * 100 + (field.value[1] - '0') * 10 +
+                              (field.value[2] - '0'));
+
+    if (flags & NGHTTP2_HD_INFLATE_FINAL || (!used && !len))
+      break;
+  }
+
+  nghttp2_hd_inflate_del(inflater);
+  return status;
+}
+
+bool find_h2_status(const Endpoint *upstream, unsigned int *status)
+{
+  if (!upstream || !status)
+    return set_efault();
+
+  const uint8_t *data = (const uint8_t *)upstream->buffer;
+  size_t len = (size_t)upstream->read_index, offset = 0;
+  *status = 0;
+
+  while (offset + FRAME_HEADER_LEN <= len)
+  {
+    const uint8_t *header = data + offset, *payload = header + FRAME_HEADER_LEN;
+    size_t frame_len = (size_t)header[0] << 16 | (size_t)header[1] << 8 | header[2];
+    uint8_t type = header[3], flags = header[4];
+    uint32_t stream_id = ((uint32_t)header[5] << 24 | (uint32_t)header[6] << 16 |
+                          (uint32_t)header[7] << 8 | header[8]) &
+                         0x7fffffff;
+
+    if (type == NGHTTP2_GOAWAY)
+      return true;
+
+    if (offset + FRAME_HEADER_LEN + frame_len > len) // read more
+      return false;
+
+    if (type == NGHTTP2_HEADERS && stream_id == 1)
+    {
+      // the pad length field & the padding, then the priority fields
+      if (flags & NGHTTP2_FLAG_PADDED && frame_len)
+      {
+        size_t padding = *payload++ + 1U;
+        frame_len = frame_len > padding ? frame_len - padding : 0;
+      }
+
+      if (flags & NGHTTP2_FLAG_PRIORITY)
+      {
+        payload += frame_len >= 5 ? 5 : frame_len;
+        frame_len = frame_len >= 5 ? frame_len - 5 : 0;
+      }
+
+      *status = inflate_status(payload, frame_len);
+      return true;
+    }
+
+    offset += FRAME_HEADER_LEN + frame_len;
+  }
+
+  return false;
+}
+
+#else // without nghttp2, -2 is rejected by parse_args()
+
+bool setup_h2(void)
+{
+  memset(&h2_stats, 0, sizeof h2_stats);
+  return true;
+}
+
+void free_h2(void) {}
+
+bool speaks_h2(const Endpoint *upstream)
+{
+  (void)upstream;
+  return false;
+}
+
+void open_session(Connection *conn) { (void)conn; }
+
+bool attach_stream(Connection *conn)
+{
+  (void)conn;
+  return false;
+}
+
+void write_stream(Connection *conn) { (void)conn; }
+
+void read_stream(Connection *conn) { (void)conn; }
+
+void ack_stream(Connection *conn) { (void)conn; }
+
+void close_stream(Connection *conn) { (void)conn; }
+
+void move_stream(Connection *from, Connection *to)
+{
+  (void)from;
+  (void)to;
+}
+
+void continue_session(Connection *conn) { (void)conn; }
+
+void close_session(Connection *conn) { (void)conn; }
+
+void free_session(Connection *conn) { (void)conn; }
+
+void flush_sessions(void) {}
+
+bool fill_h2_probe(Endpoint *upstream, size_t member)
+{
+  (void)upstream;
+  (void)member;
+  errno = ENOTSUP;
+  return false;
+}
+
+bool find_h2_status(const Endpoint *upstream, unsigned int *status)
+{
+  (void)upstream;
+  *status = 0;
+  return true;
+}
+
+#endif
@@ -0,0 +1,464 @@
+#include <errno.h>
+#include <netdb.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "balancer.h"
+#include "connection.h"
+#include "event.h"
+#include "h2.h"
+#include "health.h"
+#include "main.h"
+#include "timeout.h"
+#include "upstream.h"
+#include "utils.h"
+
+_Thread_local MemberHealth *member_health = NULL;
+
+bool setup_health_checks(void)
+{
+  if (!config.health_checks)
+    return true;
+
+  if (!(member_health = calloc(upstreams_num, sizeof(MemberHealth))))
+    return err("calloc", strerror(errno));
+
+  for (size_t i = 0; i < upstreams_num; ++i)
+  {
+    Connection *probe = NULL;
+    if (!(probe = init_conn()))
+    {
+      free_health_checks();
+      return err("init_conn", NULL);
+    }
+
+    // not a client conn, the interval timeout is started with the loop instead
+    remove_timeout(&probe->conn_timeout);
+    probe->state = PROBE_UPSTREAM;
+    probe->member = i;
+    member_health[i].probe = probe;
+  }
+
+  return true;
+}
+
+// the next probe of a member starts an interval after the last one ended, so probes never overlap
+static void schedule_probe(Connection *probe, int64_t ttl)
+{
+  remove_timeout(&probe->conn_timeout);
+
+  fill_timeout(probe, HEALTH_INTERVAL, ttl);
+  enqueue_timeout(&probe->conn_timeout);
+}
+
+void start_health_checks(void)
+{
+  if (!member_health)
+    return;
+
+  for (size_t i = 0; i < upstreams_num; ++i)
+    schedule_probe(member_health[i].probe, 0);
+}
+
+void finish_probe(Connection *probe, bool passed)
+{
+  MemberHealth *health = member_health + probe->member;
+  const Upstream *member = upstreams + probe->member;
+  bool *healthy = &member_stats[probe->member].healthy, was_healthy = *healthy;
+
+  remove_timeout(&probe->state_timeout);
+  close_upstream(probe);
+  health->step = PROBE_IDLE;
+  schedule_probe(probe, config.health_interval);
+
+  if (passed)
+  {
+    health->fails = 0;
+    ++health->passes;
+  }
+  else
+  {
+    health->passes = 0;
+    ++health->fails;
+  }
+
+  if (health->checks == 1) // nothing is known before the first probe
+    *healthy = passed;
+  else if (!*healthy && health->passes >= HEALTH_RISE)
+    *healthy = true;
+  else if (*healthy && health->fails >= HEALTH_FALL)
+    *healthy = false;
+
+  if (*healthy == was_healthy)
+    return;
+
+  printf("Upstream %s:%s is %s\n", member->host, member->port,
+         *healthy ? "back in rotation" : "down, out of rotation");
+
+  if (!*healthy)
+  {
+    ++health->downs;
+    drop_idle_upstreams(probe->member); // requests already sent on them are left to finish
+  }
+}
+
+void start_probe(Connection *probe)
+{
+  if (!probe || probe->state != PROBE_UPSTREAM)
+    return;
+
+  MemberHealth *health = member_health + probe->member;
+
+  close_upstream(probe); // left by a probe that never finished, should not happen
+  ++health->checks;
+
+  // only needed till connect() is called
+  AddrSet *set = acquire_addrs(probe->member);
+
+  // every address once at most, the first one that does not fail right away is probed
+  for (size_t tried = 0; tried < set->addrs_num; ++tried)
+  {
+    const struct addrinfo *addr = set->addrs[health->next_addr++ % set->addrs_num];
+
+    int fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    addr->ai_protocol);
+    if (fd == -1)
+    {
+      err("socket", strerror(errno));
+      continue;
+    }
+
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen) == -1 && errno != EINPROGRESS)
+    {
+      warn("connect", strerror(errno));
+      close(fd);
+      continue;
+    }
+
+    if (!add_to_epoll(&probe->upstream, fd, EVENT_FLAGS))
+    {
+      err("add_to_epoll", NULL);
+      close_socket(fd);
+      continue;
+    }
+
+    // a connect done right away is found by the SO_ERROR check all the same
+    probe->upstream.fd = fd;
+    probe->upstream.readable = false;
+    probe->upstream.writable = true;
+    health->step = PROBE_CONNECTING;
+    release_addrs(set);
+
+    start_state_timeout(probe, HEALTH_PROBE);
+    continue_probe(probe);
+    return;
+  }
+
+  release_addrs(set);
+  finish_probe(probe, false);
+}
+
+// checks the connect of probe
+// errno is EINPROGRESS if the connect is still pending
+static bool probe_connected(Connection *probe)
+{
+  Endpoint *upstream = &probe->upstream;
+
+  int error = 0;
+  socklen_t len = sizeof error;
+  if (getsockopt(upstream->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+    error = errno;
+
+  if (error)
+  {
+    warn("probe_connect", strerror(error));
+    errno = error;
+    return false;
+  }
+
+  // a readiness left over from an earlier fd of the probe, the connect is still in progress
+  struct sockaddr_storage peer;
+  socklen_t peer_len = sizeof peer;
+  if (getpeername(upstream->fd, (struct sockaddr *)&peer, &peer_len) == -1)
+  {
+    upstream->writable = false;
+    errno = EINPROGRESS;
+    return false;
+  }
+
+  return true;
+}
+
+// fills the request of probe in its buffer, as http/2 frames if the member speaks h2 on the fd
+static bool fill_probe(Connection *probe)
+{
+  Endpoint *upstream = &probe->upstream;
+  MemberHealth *health = member_health + probe->member;
+
+  if ((health->h2 = speaks_h2(upstream)))
+    return fill_h2_probe(upstream, probe->member);
+
+  const Upstream *member = upstreams + probe->member;
+  int request_len = snprintf(upstream->buffer, BUFFER_SIZE,
+                             "GET %s HTTP/1.1\r\n"
+                             "Host: %s%s%s\r\n"
+                             "User-Agent: " SERVER "\r\n"
+                             "Connection: close\r\n\r\n",
+                             config.health_path, member->unix_socket ? "localhost" : member->host,
+                             member->unix_socket ? "" : ":", member->unix_socket ? "" : member->port);
+
+  if (request_len < 0 || (size_t)request_len >= BUFFER_SIZE)
+  {
+    errno = EMSGSIZE;
+    return err("snprintf", strerror(errno));
+  }
+
+  upstream->write_index = 0;
+  upstream->to_write = (size_t)request_len;
+  upstream->read_index = 0;
+
+  return true;
+}
+
+// advances the handshake of probe, returns true once done
+// failures end the probe, otherwise the direction it waits on is stored in handshake_flags
+static bool probe_handshake(Connection *probe)
+{
+  Endpoint *upstream = &probe->upstream;
+
+  ERR_clear_error();
+  int status = SSL_do_handshake(upstream->ssl);
+
+  if (status == 1)
+  {
+    ++session_cache.handshakes;
+    session_cache.resumed += SSL_session_reused(upstream->ssl) == 1;
+    return true;
+  }
+
+  switch (SSL_get_error(upstream->ssl, status))
+  {
+  case SSL_ERROR_WANT_READ:
+    upstream->handshake_flags = EPOLLIN;
+    upstream->readable = false;
+    return false;
+
+  case SSL_ERROR_WANT_WRITE:
+    upstream->handshake_flags = EPOLLOUT;
+    upstream->writable = false;
+    return false;
+
+  default:
+    ERR_print_errors_fp(stderr);
+    warn("probe_handshake", X509_verify_cert_error_string(SSL_get_verify_result(upstream->ssl)));
+    finish_probe(probe, false);
+    return false;
+  }
+}
+
+// sends the request or reads the response of a probe, through tls for https members
+// returns -1 with errno set to EAGAIN if the fd would block, clearing the readiness it waits on
+static ssize_t probe_io(Endpoint *upstream, bool sending, size_t len)
+{
+  char *buffer = upstream->buffer + (sending ? upstream->write_index : upstream->read_index);
+
+  if (!upstream->ssl)
+  {
+    ssize_t done = sending ? write_socket(upstream->fd, buffer, len)
+                           : read_socket(upstream->fd, buffer, len);
+
+    if (done == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      errno = EAGAIN;
+      *(sending ? &upstream->writable : &upstream->readable) = false;
+    }
+
+    return done;
+  }
+
+  ERR_clear_error();
+  int done = sending ? SSL_write(upstream->ssl, buffer, (int)len)
+                     : SSL_read(upstream->ssl, buffer, (int)len);
+
+  if (done > 0)
+    return done;
+
+  switch (SSL_get_error(upstream->ssl, done))
+  {
+  case SSL_ERROR_WANT_READ:
+    upstream->readable = false;
+    errno = EAGAIN;
+    return -1;
+
+  case SSL_ERROR_WANT_WRITE:
+    upstream->writable = false;
+    errno = EAGAIN;
+    return -1;
+
+  case SSL_ERROR_ZERO_RETURN: // close_notify
+    return 0;
+
+  default:
+    errno = EPROTO;
+    return -1;
+  }
+}
+
+void continue_probe(Connection *probe)
+{
+  if (!probe || probe->state != PROBE_UPSTREAM)
+    return;
+
+  MemberHealth *health = member_health + probe->member;
+  Endpoint *upstream = &probe->upstream;
+  ssize_t len = 0;
+
+  switch (health->step)
+  {
+  case PROBE_IDLE: // events of a probe that has already ended
+    return;
+
+  case PROBE_CONNECTING:
+    if (!upstream->writable)
+      return;
+
+    if (!probe_connected(probe))
+    {
+      if (errno != EINPROGRESS)
+        finish_probe(probe, false);
+      return;
+    }
+
+    health->step = PROBE_WRITING;
+
+    if (upstreams[probe->member].https)
+    {
+      // same as the conns of requests, so probes also keep the session cache warm
+      if (!setup_endpoint_tls(upstream, true))
+      {
+        err("setup_endpoint_tls", NULL);
+        finish_probe(probe, false);
+        return;
+      }
+
+      upstream->handshake_flags = EPOLLOUT;
+      health->step = PROBE_HANDSHAKE;
+    }
+    // fall through
+
+  case PROBE_HANDSHAKE:
+    if (health->step == PROBE_HANDSHAKE)
+    {
+      if (!IS_READY(upstream, upstream->handshake_flags) || !probe_handshake(probe))
+        return;
+
+      health->step = PROBE_WRITING;
+    }
+
+    if (!fill_probe(probe))
+    {
+      finish_probe(probe, false);
+      return;
+    }
+    // fall through
+
+  case PROBE_WRITING:
+    while (upstream->to_write)
+    {
+      if ((len = probe_io(upstream, true, upstream->to_write)) == -1)
+      {
+        if (errno == EAGAIN)
+          return;
+
+        warn("probe_send", strerror(errno));
+        finish_probe(probe, false);
+        return;
+      }
+
+      upstream->write_index += len;
+      upstream->to_write -= (size_t)len;
+    }
+
+    health->step = PROBE_READING;
+    // fall through
+
+  case PROBE_READING:
+    while (upstream->readable)
+    {
+      if ((len = probe_io(upstream, false, BUFFER_SIZE - 1 - (size_t)upstream->read_index)) == -1)
+      {
+        if (errno == EAGAIN)
+          return;
+
+        warn("probe_recv", strerror(errno));
+        finish_probe(probe, false);
+        return;
+      }
+
+      upstream->read_index += len;
+      upstream->buffer[upstream->read_index] = '\0';
+
+      // only the status line is needed, or the response HEADERS frame, 2xx & 3xx pass
+      unsigned int status = 0;
+      bool found = health->h2 ? find_h2_status(upstream, &status)
+                              : strstr(upstream->buffer, LINEBREAK) != NULL;
+
+      if (!len || found || (size_t)upstream->read_index == BUFFER_SIZE - 1)
+      {
+        if (!health->h2)
+          sscanf(upstream->buffer, "HTTP/%*u.%*u %u", &status);
+
+        bool passed = status >= 200 && status < 400;
+
+        if (!passed)
+          warn("probe_status", health->h2 ? "HTTP/2 probe failed" : upstream->buffer);
+
+        finish_probe(probe, passed);
+        return;
+      }
+    }
+    return;
+  }
+}
+
+void fail_probe(Connection *probe)
+{
+  if (!probe || probe->state != PROBE_UPSTREAM)
+    return;
+
+  warn("probe_timeout", "Health probe timed out");
+  finish_probe(probe, false);
+}
+
+void free_health_checks(void)
+{
+  if (!member_health)
+    return;
+
+  for (size_t i = 0; i < upstreams_num; ++i)
+    if (member_health[i].probe)
+    {
+      member_health[i].probe->member = NO_MEMBER; // not a request, nothing to finish
+      free_conn(&member_health[i].probe);
+    }
+
+  free(member_health);
+  member_health = NULL;
+}
+
+void print_health_stats(void)
+{
+  if (!member_health)
+    return;
+
+  for (size_t i = 0; i < upstreams_num; ++i)
+    printf("Upstream %s:%s: %s, %zu checks, %zu downs\n", upstreams[i].host, upstreams[i].port,
+           member_stats[i].healthy ? "healthy" : "unhealthy", member_health[i].checks,
+           member_health[i].downs);
+}
@@ -0,0 +1,249 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "balancer.h"
+#include "connection.h"
+#include "event.h"
+#include "h2.h"
+#include "hedge.h"
+#include "http.h"
+#include "main.h"
+#include "proxy.h"
+#include "timeout.h"
+#include "upstream.h"
+#include "utils.h"
+
+_Thread_local HedgeStats *hedge_stats = NULL;
+
+size_t max_hedges(void)
+{
+  return config.hedge_percentile ? config.max_conns * HEDGE_BUDGET / 100 + 1 : 0;
+}
+
+bool setup_hedging(void)
+{
+  if (!config.hedge_percentile)
+    return true;
+
+  if (!(hedge_stats = calloc(1, sizeof(HedgeStats))))
+    return err("calloc", strerror(errno));
+
+  hedge_stats->delay = -1;
+  return true;
+}
+
+void free_hedging(void)
+{
+  free(hedge_stats);
+  hedge_stats = NULL;
+}
+
+// walks the histogram till the percentile, only every HEDGE_RECOMPUTE samples
+static void update_delay(void)
+{
+  size_t target = hedge_stats->samples * config.hedge_percentile / 100, seen = 0;
+  int64_t delay = HEDGE_DELAY_MAX;
+
+  for (size_t ms = 0; ms <= HEDGE_DELAY_MAX; ++ms)
+    if ((seen += hedge_stats->histogram[ms]) > target)
+    {
+      delay = (int64_t)ms;
+      break;
+    }
+
+  hedge_stats->delay = delay < HEDGE_DELAY_MIN ? HEDGE_DELAY_MIN : delay;
+}
+
+// points a request line field of conn at the same bytes in the copied buffer of hedge,
+// fields not in the buffer are literals and kept as they are
+static Str rebase_field(const Connection *conn, Connection *hedge, Str field)
+{
+  if (field.data >= conn->client.buffer && field.data < conn->client.buffer + BUFFER_SIZE)
+    field.data = hedge->client.buffer + (field.data - conn->client.buffer);
+
+  return field;
+}
+
+static void record_latency(int64_t latency)
+{
+  size_t ms = latency < 0 ? 0 : latency > HEDGE_DELAY_MAX ? HEDGE_DELAY_MAX : (size_t)latency;
+  ++hedge_stats->histogram[ms];
+
+  // halving keeps the shape, and lets the percentile follow the recent latencies
+  if (++hedge_stats->samples >= HEDGE_SAMPLES_MAX)
+  {
+    hedge_stats->samples = 0;
+    for (size_t i = 0; i <= HEDGE_DELAY_MAX; ++i)
+      hedge_stats->samples += hedge_stats->histogram[i] /= 2;
+  }
+
+  if (hedge_stats->samples >= HEDGE_SAMPLES_MIN && !(hedge_stats->samples % HEDGE_RECOMPUTE))
+    update_delay();
+}
+
+void arm_hedge(Connection *conn)
+{
+  // a body is read from the client once, it cannot be sent twice
+  if (!hedge_stats || !conn || conn->shadow || conn->hedge ||
+      !is_idempotent(conn->client.headers.data) || conn->client.content_len ||
+      conn->client.chunked)
+    return;
+
+  ++hedge_stats->requests;
+
+  if (hedge_stats->delay < 0) // still learning the latencies
+    return;
+
+  remove_timeout(&conn->hedge_timeout);
+  fill_timeout(conn, HEDGE_DELAY, hedge_stats->delay);
+  enqueue_timeout(&conn->hedge_timeout);
+}
+
+void start_hedge(Connection *conn)
+{
+  if (!hedge_stats || !conn || conn->shadow || conn->hedge || conn->upstream.headers_found)
+    return;
+
+  // the response has not started, in any of these states
+  if (conn->state != CONNECTING_UPSTREAM && conn->state != TLS_UPSTREAM &&
+      conn->state != WRITE_REQUEST && conn->state != READ_RESPONSE)
+    return;
+
+  // hedges are extra load on the members, capped so they cannot add to an overload
+  if (hedge_stats->in_flight >= max_hedges() ||
+      hedge_stats->hedges * 100 >= hedge_stats->requests * HEDGE_BUDGET)
+    return;
+
+  Connection *hedge = NULL;
+  if (!(hedge = init_conn()))
+  {
+    warn("init_conn", "No slot left for a hedge conn");
+    return;
+  }
+
+  // lives as long as the request of conn, with the upstream state timeouts of its own
+  remove_timeout(&hedge->conn_timeout);
+
+  if (!select_other_member(hedge, conn->member))
+  {
+    free_conn(&hedge);
+    return;
+  }
+
+  // headers end the request, as only requests without a body are hedged
+  size_t len = (size_t)conn->client.headers.len;
+  memcpy(hedge->client.buffer, conn->client.buffer, len);
+  hedge->client.buffer[len] = '\0';
+  hedge->client.headers.len = (ptrdiff_t)len;
+  hedge->client.headers_found = true;
+  hedge->status = conn->status;
+  // an h2 stream sends these as its pseudo-headers, not the copied request line
+  hedge->http_ver = rebase_field(conn, hedge, conn->http_ver);
+  hedge->host = rebase_field(conn, hedge, conn->host);
+  hedge->path = rebase_field(conn, hedge, conn->path);
+
+  hedge->shadow = true;
+  hedge->hedge = conn;
+  conn->hedge = hedge;
+  ++hedge_stats->hedges;
+  ++hedge_stats->in_flight;
+
+  hedge->state = CONNECT_UPSTREAM;
+  handle_state(hedge);
+}
+
+// moves the upstream endpoint of hedge into its client conn, which gives up its own attempt
+static void promote_hedge(Connection *hedge)
+{
+  Connection *conn = hedge->hedge;
+  Endpoint *upstream = &conn->upstream;
+
+  stop_hedge(hedge);
+  remove_timeout(&conn->hedge_timeout);
+
+  // the losing attempt is not a failure of its member
+  close_connect_attempts(conn);
+  close_upstream(conn);
+  finish_member(conn, false);
+
+  ptrdiff_t headers_offset = hedge->upstream.headers.data - hedge->upstream.buffer;
+  memcpy(upstream, &hedge->upstream, sizeof(Endpoint));
+  upstream->conn = conn;
+  upstream->headers.data = upstream->buffer + headers_offset;
+
+  conn->member = hedge->member;
+  conn->member_since = hedge->member_since;
+  conn->latency = hedge->latency;
+  conn->state = hedge->state;
+  conn->complete = hedge->complete;
+  conn->upstream_keep_alive = hedge->upstream_keep_alive;
+
+  // owned by conn now, a stream has no fd of its own but its place in the session
+  move_stream(hedge, conn);
+  hedge->member = NO_MEMBER;
+  hedge->upstream.fd = -1;
+  hedge->upstream.ssl = NULL;
+  free_conn(&hedge);
+
+  ++hedge_stats->wins;
+
+  // event data of the fd still points to the endpoint of the hedge conn
+  if (upstream->fd >= 0 && !mod_in_epoll(upstream, upstream->fd, EVENT_FLAGS))
+  {
+    err("mod_in_epoll", NULL);
+    conn->status = 502;
+    conn->state = WRITE_ERROR;
+  }
+
+  handle_state(conn);
+}
+
+bool finish_hedge_race(Connection *conn)
+{
+  if (!hedge_stats || !conn)
+    return true;
+
+  record_latency(conn->latency);
+
+  if (!conn->shadow)
+  {
+    stop_hedge(conn); // the response came first, or no hedge was needed
+    return true;
+  }
+
+  promote_hedge(conn);
+  return false;
+}
+
+void stop_hedge(Connection *conn)
+{
+  if (!conn)
+    return;
+
+  remove_timeout(&conn->hedge_timeout);
+
+  Connection *other = conn->hedge;
+  if (!other)
+    return;
+
+  conn->hedge = other->hedge = NULL;
+  --hedge_stats->in_flight;
+
+  if (conn->shadow) // the client conn carries on alone
+    return;
+
+  close_upstream(other);
+  free_conn(&other);
+}
+
+void print_hedge_stats(void)
+{
+  if (!hedge_stats)
+    return;
+
+  printf("Hedging: %zu requests, %zu hedged, %zu won by the hedge, p%u delay %ldms\n",
+         hedge_stats->requests, hedge_stats->hedges, hedge_stats->wins, config.hedge_percentile,
+         hedge_stats->delay);
+}
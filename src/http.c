@@ -44,7 +44,32 @@ bool validate_host(const Str *header)
   return true;
 }
 
-bool validate_method(const Str method) { return equals(method, STR("GET")); }
+bool validate_method(const Str method)
+{
+  // CONNECT & TRACE are not proxied
+  return equals(method, STR("GET")) || equals(method, STR("HEAD")) ||
+         equals(method, STR("POST")) || equals(method, STR("PUT")) ||
+         equals(method, STR("DELETE")) || equals(method, STR("PATCH")) ||
+         equals(method, STR("OPTIONS"));
+}
+
+bool is_idempotent(const char *request)
+{
+  if (!request)
+    return false;
+
+  return !strncmp(request, "GET ", 4) || !strncmp(request, "HEAD ", 5);
+}
+
+uint get_response_status(const char *response)
+{
+  uint status = 0;
+
+  if (!response || sscanf(response, "HTTP/%*u.%*u %u", &status) != 1)
+    return 0;
+
+  return status;
+}
 
 bool validate_http(const Str http_ver)
 {
@@ -185,10 +210,16 @@ char *get_status_string(uint status_code)
     return "408 Request Timout";
   case 413:
     return "413 Content Too Large";
+  case 417:
+    return "417 Expectation Failed";
   case 431:
     return "431 Request Header Fields Too Large";
   case 500:
     return "500 Internal Server Error";
+  case 502:
+    return "502 Bad Gateway";
+  case 503:
+    return "503 Service Unavailable";
   case 504:
     return "504 Gateway Timeout";
   case 505:
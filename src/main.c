@@ -10,20 +10,39 @@
 #include <unistd.h>
 
 #include "args.h"
+#include "balancer.h"
+#include "h2.h"
+#include "hedge.h"
 #include "proxy.h"
+#include "resolver.h"
 #include "upstream.h"
 #include "utils.h"
+#include "worker.h"
 
-bool RUNNING = true;
+volatile bool RUNNING = true;
 Config config = {.port = NULL,
                  .canonical_host = NULL,
+                 .threads = 1,
+                 .processes = 1,
+                 .max_conns = MAX_CONNECTIONS,
+                 .max_idle = MAX_IDLE_UPSTREAMS,
+                 .lb_policy = ROUND_ROBIN,
+                 .adaptive_limit = false,
+                 .health_path = NULL,
+                 .health_interval = DEFAULT_HEALTH_INTERVAL,
+                 .health_checks = false,
+                 .dns_ttl = DNS_TTL,
+                 .upstream_ca = NULL,
+                 .hedge_percentile = 0,
+                 .upstream_h2 = false,
                  .accept_all = false,
+                 .huge_pages = false,
                  .upstream = NULL,
                  .log_warnings = false,
                  .client_https = false,
                  .upstream_https = false};
-int EPOLL_FD = -1;
 SSL_CTX *ssl_context = NULL;
+SSL_CTX *upstream_ssl_context = NULL;
 regex_t origin_regex;
 
 int main(int argc, char *argv[])
@@ -41,44 +60,92 @@ int main(int argc, char *argv[])
 
   config = parse_args(argc, argv);
 
-  int proxy_fd = -1;
-
-  if (!setup_proxy(&config, &proxy_fd))
+  // loading server info, into global vars in upstream.c, read only for the workers
+  if (!setup_upstreams(config.upstream))
   {
-    err("setup_proxy", NULL);
+    err("setup_upstreams", NULL);
     return -1;
   }
 
-  if (!setup_epoll(proxy_fd))
+  if (config.lb_policy == PATH_HASH && !setup_hash_ring())
   {
-    err("setup_epoll", NULL);
+    err("setup_hash_ring", NULL);
+    free_upstreams();
     return -1;
   }
 
-  if (EPOLL_FD == -1)
+  // a single upstream has nowhere else to send requests, unless asked for
+  if (upstreams_num > 1)
+    config.health_checks = true;
+
+  // every conn holds a client & an upstream fd, every worker keeps idle upstream fds,
+  // a probe fd per member, an upstream fd per hedge conn and one per http/2 session,
+  // and the two ends of a splice pipe per conn, or pooled
+  if (!raise_fd_limit((config.max_conns * 4 + PIPES_MAX * 2 + config.max_idle +
+                       (config.health_checks ? upstreams_num : 0) + max_hedges() +
+                       max_sessions()) *
+                          config.threads * config.processes +
+                      RESERVED_FDS))
+    warn("raise_fd_limit", NULL);
+
+  bool https_upstreams = false;
+  for (size_t i = 0; i < upstreams_num; ++i)
+    https_upstreams |= upstreams[i].https;
+
+  // ssl contexts are shared by all the workers
+  if (config.client_https && !(ssl_context = setup_tls()))
   {
-    err("verify_epoll_fd", "Epoll fd is not valid");
+    err("setup_tls", NULL);
+    free_upstreams();
+    free_hash_ring();
     return -1;
   }
 
-  // loading server info, into global var in proxy.c
-  if (!setup_upstream(config.upstream))
+  if (https_upstreams && !(upstream_ssl_context = setup_upstream_tls()))
   {
-    err("setup_upstream", NULL);
+    err("setup_upstream_tls", NULL);
+    free_upstreams();
+    free_hash_ring();
+    if (ssl_context)
+      SSL_CTX_free(ssl_context);
     return -1;
   }
 
-  if (!start_proxy())
+  // forked workers run a resolver each, as they do not share memory with the master
+  if (config.processes == 1 && !start_resolver())
+    warn("start_resolver", "Upstream addresses are not refreshed");
+
+  // single threaded mode runs the event loop on the main thread itself
+  if (config.processes > 1)
+  {
+    if (!start_processes(config.processes))
+    {
+      err("start_processes", NULL);
+      return -1;
+    }
+  }
+  else if (config.threads > 1)
+  {
+    if (!start_workers(config.threads))
+    {
+      err("start_workers", NULL);
+      return -1;
+    }
+  }
+  else if (!run_worker(0))
   {
-    err("start_proxy", strerror(errno));
+    err("run_worker", NULL);
     return -1;
   }
 
-  free_upstream_addrinfo();
-  free_active_conns();
+  stop_resolver();
+  free_upstreams();
+  free_hash_ring();
   free_config(&config);
   if (ssl_context)
     SSL_CTX_free(ssl_context);
+  if (upstream_ssl_context)
+    SSL_CTX_free(upstream_ssl_context);
   regfree(&origin_regex);
   EVP_cleanup();
   return 0;
@@ -0,0 +1,175 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "main.h"
+#include "pool.h"
+#include "utils.h"
+#include "zerocopy.h"
+
+_Thread_local ConnPool conn_pool = {0};
+
+bool grow_conn_pool(void)
+{
+  if (conn_pool.slabs_num == conn_pool.slabs_cap)
+  {
+    size_t cap = conn_pool.slabs_cap ? conn_pool.slabs_cap * 2 : 8;
+    void **tmp = realloc(conn_pool.slabs, cap * sizeof(void *));
+    if (!tmp)
+      return err("realloc", strerror(errno));
+
+    conn_pool.slabs = tmp;
+    conn_pool.slabs_cap = cap;
+  }
+
+  // prefaulting, so the first use of a conn does not page fault
+  void *slab = MAP_FAILED;
+
+  if (conn_pool.huge_pages)
+  {
+    slab = mmap(NULL, POOL_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+
+    if (slab != MAP_FAILED)
+      ++conn_pool.stats.huge_slabs;
+    else
+      warn("mmap", "Huge pages are not available, falling back to transparent huge pages");
+  }
+
+  if (slab == MAP_FAILED)
+  {
+    if ((slab = mmap(NULL, POOL_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0)) == MAP_FAILED)
+      return err("mmap", strerror(errno));
+
+    if (conn_pool.huge_pages)
+      madvise(slab, POOL_SLAB_SIZE, MADV_HUGEPAGE); // only a hint, failure is fine
+  }
+
+  conn_pool.slabs[conn_pool.slabs_num++] = slab;
+
+  // linking in reverse, so conns are handed out in address order
+  for (size_t i = conn_pool.per_slab; i-- > 0;)
+  {
+    FreeNode *node = (FreeNode *)((char *)slab + i * conn_pool.stride);
+    node->next = conn_pool.free_list;
+    conn_pool.free_list = node;
+  }
+
+  ++conn_pool.stats.growths;
+  conn_pool.stats.capacity += conn_pool.per_slab;
+
+  return true;
+}
+
+bool setup_conn_pool(bool huge_pages)
+{
+  memset(&conn_pool, 0, sizeof conn_pool);
+
+  conn_pool.huge_pages = huge_pages;
+  conn_pool.stride = (sizeof(Connection) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+  conn_pool.per_slab = POOL_SLAB_SIZE / conn_pool.stride;
+
+  if (!conn_pool.per_slab)
+  {
+    errno = EINVAL;
+    return err("verify_slab_size", "Connection does not fit in a slab");
+  }
+
+  return grow_conn_pool();
+}
+
+Connection *get_pooled_conn(void)
+{
+  if (!conn_pool.free_list)
+  {
+    if (!grow_conn_pool())
+    {
+      err("grow_conn_pool", NULL);
+      return NULL;
+    }
+  }
+  else
+    ++conn_pool.stats.hits;
+
+  FreeNode *node = conn_pool.free_list;
+  conn_pool.free_list = node->next;
+
+  ++conn_pool.stats.gets;
+  ++conn_pool.stats.in_use;
+
+  return (Connection *)node;
+}
+
+void put_pooled_conn(Connection *conn)
+{
+  if (!conn)
+    return;
+
+  --conn_pool.stats.in_use;
+
+  // the kernel may still read its ring, till the completions of its sends
+  FreeNode *node = (FreeNode *)conn;
+  if (conn->zc_num)
+  {
+    node->next = conn_pool.draining;
+    conn_pool.draining = node;
+    return;
+  }
+
+  node->next = conn_pool.retired;
+  conn_pool.retired = node;
+
+  if (!conn_pool.retired_tail)
+    conn_pool.retired_tail = node;
+}
+
+void recycle_pooled_conns(void)
+{
+  for (FreeNode **link = &conn_pool.draining; *link;)
+  {
+    FreeNode *node = *link;
+    if (!drain_zerocopy((Connection *)node))
+    {
+      link = &node->next;
+      continue;
+    }
+
+    *link = node->next;
+    node->next = conn_pool.free_list;
+    conn_pool.free_list = node;
+  }
+
+  if (!conn_pool.retired)
+    return;
+
+  conn_pool.retired_tail->next = conn_pool.free_list;
+  conn_pool.free_list = conn_pool.retired;
+  conn_pool.retired = conn_pool.retired_tail = NULL;
+}
+
+void free_conn_pool(void)
+{
+  // pinned pages outlive the unmapping, only the clients left to drain are closed
+  for (FreeNode *node = conn_pool.draining; node; node = node->next)
+    close(((Connection *)node)->client.fd);
+
+  for (size_t i = 0; i < conn_pool.slabs_num; ++i)
+    munmap(conn_pool.slabs[i], POOL_SLAB_SIZE);
+
+  free(conn_pool.slabs);
+  memset(&conn_pool, 0, sizeof conn_pool);
+}
+
+void print_pool_stats(void)
+{
+  const PoolStats *stats = &conn_pool.stats;
+
+  printf("Conn pool: %zu gets, %zu hits, %zu growths (%zu huge), %zu in use, %zu capacity\n",
+         stats->gets, stats->hits, stats->growths, stats->huge_slabs, stats->in_use,
+         stats->capacity);
+}
@@ -3,21 +3,31 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "balancer.h"
 #include "client.h"
 #include "connection.h"
+#include "event.h"
+#include "h2.h"
+#include "health.h"
+#include "hedge.h"
 #include "http.h"
 #include "main.h"
+#include "pool.h"
 #include "proxy.h"
+#include "splice.h"
 #include "timeout.h"
 #include "upstream.h"
 #include "utils.h"
+#include "zerocopy.h"
 
 SSL_CTX *setup_tls(void)
 {
@@ -78,15 +88,58 @@ cleanup:
   return NULL;
 }
 
+SSL_CTX *setup_upstream_tls(void)
+{
+  if (OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL) != 1)
+  {
+    err("OPENSSL_init_ssl", NULL);
+    return NULL;
+  }
+
+  SSL_CTX *context = SSL_CTX_new(TLS_client_method()); // the proxy is the client of upstreams
+
+  if (!context)
+  {
+    err("SSL_CTX_new", NULL);
+    ERR_print_errors_fp(stderr);
+    return NULL;
+  }
+
+  if (SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION) != 1)
+  {
+    err("SSL_CTX_set_min_proto_version", NULL);
+    goto cleanup;
+  }
+
+  // the host is set per conn by setup_endpoint_tls(), failing the handshake on a mismatch
+  SSL_CTX_set_verify(context, SSL_VERIFY_PEER, NULL);
+
+  if ((config.upstream_ca ? SSL_CTX_load_verify_locations(context, config.upstream_ca, NULL)
+                          : SSL_CTX_set_default_verify_paths(context)) != 1)
+  {
+    err("SSL_CTX_load_verify_locations", config.upstream_ca);
+    goto cleanup;
+  }
+
+  // sessions are only kept in the per worker cache, keyed by member, so the lookup never takes
+  // the lock of the internal cache that every worker would share
+  SSL_CTX_set_session_cache_mode(context,
+                                 SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(context, cache_session);
+
+  return context;
+
+cleanup:
+  ERR_print_errors_fp(stderr);
+  SSL_CTX_free(context);
+  return NULL;
+}
+
 bool setup_proxy(const Config *config, int *proxy_fd)
 {
   if (!config || !proxy_fd)
     return set_efault();
 
-  if (config->client_https || config->upstream_https)
-    if (!(ssl_context = setup_tls()))
-      return err("setup_ssl", NULL);
-
   struct addrinfo hints, *out, *current;
   memset(&hints, 0, sizeof hints);
   hints.ai_family = AF_INET6;
@@ -122,6 +175,16 @@ bool setup_proxy(const Config *config, int *proxy_fd)
       continue;
     }
 
+    // every worker thread binds its own listening socket to the same port,
+    // the kernel then load balances incoming conns across them
+    if (config->threads > 1 &&
+        setsockopt(*proxy_fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) == -1)
+    {
+      close(*proxy_fd);
+      *proxy_fd = -2;
+      continue;
+    }
+
     // Adding timeouts for read and write
     struct timeval time = {.tv_sec = 5, .tv_usec = 0};
     if (setsockopt(*proxy_fd, SOL_SOCKET, SO_RCVTIMEO, &time, sizeof time) == -1)
@@ -167,16 +230,13 @@ bool setup_proxy(const Config *config, int *proxy_fd)
   if (!set_non_block(*proxy_fd))
     return err("set_non_block", NULL);
 
-  printf("\nProxy Listening on port: %s\n\n", config->port);
-
   return true;
 }
 
 bool setup_epoll(int proxy_fd)
 {
-  EPOLL_FD = epoll_create(1);
-  if (EPOLL_FD == -1)
-    return err("epoll_create", strerror(errno));
+  if (!setup_events())
+    return err("setup_events", NULL);
 
   // adding proxy_fd to epoll as the listening socket
   Connection *conn = NULL;
@@ -187,15 +247,16 @@ bool setup_epoll(int proxy_fd)
   conn->state = ACCEPT_CLIENT;
 
   // EPOLLERR & EPOLLHUP do not need to be added manually
-  if (!add_to_epoll(conn, proxy_fd, EPOLLIN | EPOLLERR | EPOLLHUP))
+  if (!add_to_epoll(&conn->client, proxy_fd, EPOLLIN | EPOLLERR | EPOLLHUP))
     return err("add_to_epoll", NULL);
 
   return true;
 }
 
-bool start_proxy(void)
+bool start_proxy(const sigset_t *wait_mask)
 {
-  timeouts_head = timeouts_tail = NULL;
+  setup_timeouts();
+  start_health_checks();
 
   int ready_events = -1;
   struct epoll_event epoll_events[MAX_EVENTS]; // this will be filled with the fds that are ready
@@ -203,20 +264,28 @@ bool start_proxy(void)
 
   while (RUNNING)
   {
-    time_t now = time(NULL);
-    time_t timeout = timeouts_head ? EXPIRES(timeouts_head) : -1; // for first wait, should be -1
+    // conns freed by the last iteration, none of its events can reach them anymore
+    recycle_pooled_conns();
+
+    int timeout = next_expiry(), idle_timeout = next_idle_expiry(); // for first wait, -1
+
+    if (idle_timeout >= 0 && (timeout < 0 || idle_timeout < timeout))
+      timeout = idle_timeout;
 
-    if ((ready_events = epoll_wait(EPOLL_FD, epoll_events, MAX_EVENTS, (int)timeout * 1000)) == -1)
+    if ((ready_events = wait_events(epoll_events, MAX_EVENTS, timeout, wait_mask)) == -1)
     {
       if (errno == EINTR && !RUNNING) // ctrl c for example, will not work if
                                       // sighandler is not used first
                                       // otherwise the program just crashes
         break;
 
-      return err("epoll_wait", strerror(errno));
+      return err("wait_events", strerror(errno));
     }
 
+    // the only clock read of the iteration, every timeout started while handling uses it
+    update_loop_time();
     clear_expired();
+    expire_idle_upstreams();
 
     // all subsequent calls should be NON BLOCKING to make epoll make sense
     // all sockets should be set to not block
@@ -224,46 +293,57 @@ bool start_proxy(void)
     for (int i = 0; i < ready_events; ++i)
     {
       uint32_t events = epoll_events[i].events;
-      Connection *conn = epoll_events[i].data.ptr;
+      Endpoint *endpoint = epoll_events[i].data.ptr;
+      Connection *conn = endpoint->conn;
+
+      // closed by an earlier event of the same batch, its memory is not reused till the next one,
+      // or a freed client waiting for its zerocopy completions, reaped by recycle_pooled_conns()
+      if (!conn->self_ptr)
+        continue;
 
       if (conn->state == ACCEPT_CLIENT) // new client
+      {
         accept_client(conn->proxy_fd);
+        continue;
+      }
 
-      else if (conn->state == READ_REQUEST && events & EPOLLIN) // read from client
-        read_request(conn);
-
-      else if (conn->state == WRITE_ERROR && events & EPOLLOUT) // write error without upstream
-        handle_error_response(conn);
-
-      else if (conn->state == WRITE_REQUEST && events & EPOLLOUT) // send to upstream
-        write_request(conn);
-
-      else if (conn->state == READ_RESPONSE && events & EPOLLIN) // read from upstream
-        read_response(conn);
-
-      else if (conn->state == WRITE_RESPONSE && events & EPOLLOUT) // send to client
-        write_response(conn);
+      // only caching the readiness, the state decides which endpoint it needs
+      // errors & hang ups are surfaced by the next read/write on the endpoint
+      if (events & READABLE_FLAGS)
+        endpoint->readable = true;
+      if (events & WRITABLE_FLAGS)
+        endpoint->writable = true;
 
-      else if (events & EPOLLHUP)
+      if (conn->state == PROBE_UPSTREAM)
       {
-        warn("check_state", "Hang up detected");
-        conn->state = CLOSE_CONN;
+        continue_probe(conn);
+        continue;
       }
-      else if (events & EPOLLRDHUP)
+
+      if (conn->state == H2_SESSION)
       {
-        warn("check_state", "Read hang up detected");
-        conn->state = CLOSE_CONN;
+        continue_session(conn);
+        continue;
       }
-      else if (events & EPOLLERR)
+
+      // completions of zerocopy sends are queued as errors of the client, without being any
+      if (endpoint == &conn->client && events & EPOLLERR && conn->zerocopy && reap_zerocopy(conn))
+        events &= ~(uint32_t)EPOLLERR;
+
+      // nothing can be sent to a client that is gone, whatever the state is
+      if (endpoint == &conn->client && events & (EPOLLHUP | EPOLLERR))
       {
-        warn("check_state", "Error detected on file descriptor");
+        warn("check_state", events & EPOLLERR ? "Error detected on client" : "Client hang up");
         conn->state = CLOSE_CONN;
       }
-      else
-        printf("Unexpected state for epoll_wait(): %s\n", get_state_string(conn->state));
 
       handle_state(conn);
     }
+
+    // once every request the iteration finished has freed its slot
+    drain_wait_queue();
+    // window updates & resets queued by streams, outside of the events of their session
+    flush_sessions();
   }
 
   puts("\nShutting Down...");
@@ -272,41 +352,73 @@ bool start_proxy(void)
 
 void handle_state(Connection *conn)
 {
-  if (conn->state == ACCEPT_CLIENT)
+  if (conn->state == ACCEPT_CLIENT || conn->state == PROBE_UPSTREAM || conn->state == H2_SESSION)
     return;
 
-  int *client_fd = &conn->client.fd, *upstream_fd = &conn->upstream.fd;
+  Endpoint *client = &conn->client, *upstream = &conn->upstream;
+  bool headers_found = false;
 
 again:
-  // when handle_state returns, conn.state should be one that start_proxy loop can handle
+  // a failed hedge conn has no client to answer, the client conn carries on with its own attempt
+  if (conn->shadow && (conn->state == WRITE_ERROR || conn->state == CLOSE_CONN))
+  {
+    close_upstream(conn);
+    free_conn(&conn);
+    return;
+  }
+
+  // every state does its I/O while the endpoint it needs is ready, then loops to the next state
+  // when handle_state returns, conn waits for an edge on the endpoint it needs, or a timeout
   switch (conn->state)
   {
   case ACCEPT_CLIENT:
     err("verify_state", "Cannot accept client in handle_state. Logic error");
     break;
 
-  case TLS_CLIENT:
-    if (!config.client_https || (config.client_https && setup_endpoint_tls(&conn->client)))
+  case PROBE_UPSTREAM:
+    err("verify_state", "Cannot probe upstream in handle_state. Logic error");
+    break;
+
+  case H2_SESSION:
+    err("verify_state", "Cannot run an http/2 session in handle_state. Logic error");
+    break;
+
+  case TLS_CLIENT: // resumed on every edge in the direction the handshake waits on
+    if (!config.client_https)
     {
-      add_to_epoll(conn, *client_fd, READ_FLAGS);
       conn->state = READ_REQUEST;
+      goto again;
     }
-    else
-    { // for client error cannot send any response, just close
-      err("setup_endpoint_tls", NULL);
-      conn->state = CLOSE_CONN;
+
+    if (!client->ssl)
+    { // first entry, the client speaks first
+      if (!setup_endpoint_tls(client, false))
+      { // for client error cannot send any response, just close
+        err("setup_endpoint_tls", NULL);
+        conn->state = CLOSE_CONN;
+        goto again;
+      }
+      client->handshake_flags = EPOLLIN;
+      start_state_timeout(conn, CLIENT_HANDSHAKE);
     }
-    break;
+
+    if (!IS_READY(client, client->handshake_flags))
+      break;
+
+    continue_handshake(conn, client);
+    goto again;
 
   case READ_REQUEST:
-    mod_in_epoll(conn, *client_fd, READ_FLAGS);
     start_state_timeout(conn, REQUEST_READ);
-    break;
 
-  case VERIFY_REQUEST:
-    if (*upstream_fd >= 0) // if reusing a upstream from previous res
-      conn->state = WRITE_REQUEST;
-    else if (verify_request(conn))
+    if (!client->readable)
+      break;
+
+    read_request(conn);
+    goto again;
+
+  case VERIFY_REQUEST: // every request is verified, even the ones of a kept alive client
+    if (verify_request(conn))
       conn->state = CONNECT_UPSTREAM;
     else
       conn->state = WRITE_ERROR;
@@ -316,47 +428,150 @@ again:
   case WRITE_ERROR:
     remove_timeout(&conn->conn_timeout);
     remove_timeout(&conn->state_timeout);
-    mod_in_epoll(conn, *client_fd, WRITE_FLAGS);
     // do not add timeout here to prevent creating a loop
-    break;
 
-  case CONNECT_UPSTREAM:
-    if (connect_upstream(upstream_fd))
-      conn->state = TLS_UPSTREAM;
-    else
+    if (!client->writable)
+      break;
+
+    handle_error_response(conn);
+    goto again;
+
+  case CONNECT_UPSTREAM: // a request handed a member by drain_wait_queue() already has one
+    if (conn->member == NO_MEMBER && !admit_request(conn))
     {
-      conn->status = 500;
-      conn->state = WRITE_ERROR;
+      // every member is down or the queue is full, failing fast instead of connecting
+      if (errno != EAGAIN || !queue_request(conn))
+      {
+        conn->status = 503;
+        conn->state = WRITE_ERROR;
+        goto again;
+      }
+
+      conn->state = WAIT_UPSTREAM;
+      start_state_timeout(conn, QUEUE_WAIT);
+      break;
+    }
+
+    arm_hedge(conn);
+
+    // a session to the member with room takes the request as a stream, without a conn of its own
+    if (!conn->retries && attach_stream(conn))
+      goto again;
+
+    // an idle conn is already connected & past its handshake, retries take a fresh one
+    if (!conn->retries && checkout_upstream(conn))
+    {
+      conn->state = WRITE_REQUEST;
+      goto again;
     }
+
+    // kept till connected, even if the resolver swaps in new addresses meanwhile
+    conn->addrs = acquire_addrs(conn->member);
+    conn->next_addr = 0;
+    conn->state = CONNECTING_UPSTREAM;
+    start_state_timeout(conn, UPSTREAM_CONNECT);
+    start_connect_attempt(conn); // may connect or fail right away
     goto again;
 
-  case TLS_UPSTREAM:
-    if (!config.upstream_https || (config.upstream_https && setup_endpoint_tls(&conn->upstream)))
+  case WAIT_UPSTREAM: // resumed by drain_wait_queue(), or failed by the QUEUE_WAIT timeout
+    break;
+
+  case CONNECTING_UPSTREAM: // any attempt becoming writable is an edge on the upstream endpoint
+    if (!upstream->writable)
+      break;
+
+    upstream->writable = false; // set again by finish_connect() for the winner
+    check_connect_attempts(conn);
+    goto again;
+
+  case TLS_UPSTREAM: // upstream fd is already registered, by the connect attempt
+    if (!upstreams[conn->member].https)
     {
-      add_to_epoll(conn, *upstream_fd, WRITE_FLAGS);
       conn->state = WRITE_REQUEST;
+      goto again;
     }
-    else
-    { // for upstream error, send error response to client
-      err("setup_endpoint_tls", NULL);
-      conn->status = 500;
-      conn->state = WRITE_ERROR;
+
+    if (!upstream->ssl)
+    { // first entry, the client hello can be sent right away
+      if (!setup_endpoint_tls(upstream, true))
+      { // for upstream error, send error response to client
+        err("setup_endpoint_tls", NULL);
+        conn->status = 500;
+        conn->state = WRITE_ERROR;
+        goto again;
+      }
+      upstream->handshake_flags = EPOLLOUT;
+      start_state_timeout(conn, UPSTREAM_HANDSHAKE);
     }
-    break;
+
+    if (!IS_READY(upstream, upstream->handshake_flags))
+      break;
+
+    continue_handshake(conn, upstream);
+    goto again;
 
   case WRITE_REQUEST:
-    mod_in_epoll(conn, *upstream_fd, WRITE_FLAGS);
-    start_state_timeout(conn, REQUEST_WRITE);
+    if (speaks_h2(upstream)) // the new conn becomes a session, sending the request as a stream
+    {
+      open_session(conn);
+      goto again;
+    }
+
+    write_request(conn);
+    if (conn->state != WRITE_REQUEST)
+      goto again;
+
+    // both ends would block, a body left in the ring waits on the upstream
+    start_state_timeout(conn, conn->sent < (size_t)client->headers.len || client->to_write
+                                  ? REQUEST_WRITE
+                                  : REQUEST_READ);
     break;
 
   case READ_RESPONSE:
-    mod_in_epoll(conn, *upstream_fd, READ_FLAGS);
     start_state_timeout(conn, RESPONSE_READ);
-    break;
+
+    if (!upstream->readable)
+      break;
+
+    headers_found = upstream->headers_found;
+    read_response(conn);
+
+    if (!headers_found && upstream->headers_found)
+    {
+      record_outcome(conn->member, get_response_status(upstream->buffer) >= 500);
+
+      // a hedge conn that wins is freed, its client conn was handled with the response
+      if (!finish_hedge_race(conn))
+        return;
+    }
+    goto again;
 
   case WRITE_RESPONSE:
-    mod_in_epoll(conn, *upstream_fd, WRITE_FLAGS);
     start_state_timeout(conn, RESPONSE_WRITE);
+
+    if (!client->writable)
+      break;
+
+    write_response(conn);
+    goto again;
+
+  case RELAY_RESPONSE: // resumed by an edge on either endpoint
+    relay_response(conn);
+    if (conn->state != RELAY_RESPONSE)
+      goto again;
+
+    // both ends would block, a ring with bytes in it waits on the client, or on its acks
+    start_state_timeout(conn,
+                        upstream->to_write || upstream->held ? RESPONSE_WRITE : RESPONSE_READ);
+    break;
+
+  case SPLICE_RESPONSE: // resumed by an edge on either endpoint
+    splice_response(conn);
+    if (conn->state != SPLICE_RESPONSE)
+      goto again;
+
+    // both ends would block, a pipe with bytes in it waits on the client
+    start_state_timeout(conn, conn->piped ? RESPONSE_WRITE : RESPONSE_READ);
     break;
 
   case CHECK_CONN:
@@ -364,11 +579,11 @@ again:
     goto again;
 
   case CLOSE_CONN:
-    if (*client_fd >= 0)
-      del_from_epoll(*client_fd);
+    if (client->fd >= 0)
+      del_from_epoll(client->fd);
 
-    if (*upstream_fd >= 0)
-      del_from_epoll(*upstream_fd);
+    if (upstream->fd >= 0)
+      del_from_epoll(upstream->fd);
 
     free_conn(&conn);
     break;
@@ -381,7 +596,13 @@ again:
 
 void free_active_conns(void)
 {
-  for (int i = 0; i < MAX_CONNECTIONS; ++i)
+  for (size_t i = 0; i < active_conns_cap; ++i)
     if (active_conns[i])
       free_conn(active_conns + i);
+
+  free(active_conns);
+  free(free_slots);
+  active_conns = NULL;
+  free_slots = NULL;
+  active_conns_cap = free_slots_top = 0;
 }
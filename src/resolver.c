@@ -0,0 +1,130 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "main.h"
+#include "resolver.h"
+#include "upstream.h"
+#include "utils.h"
+
+static pthread_t resolver_thread;
+static pthread_mutex_t resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolver_wake;
+static bool resolver_started = false;
+static bool resolver_stopping = false; // under resolver_lock
+
+static void refresh_upstreams(void)
+{
+  for (size_t i = 0; i < upstreams_num; ++i)
+  {
+    if (upstreams[i].numeric)
+      continue;
+
+    AddrSet *set = NULL;
+    if (!(set = resolve_addrs(upstreams + i)))
+    {
+      warn("resolve_addrs", "Keeping the last addresses of the upstream");
+      continue;
+    }
+
+    // only the resolver swaps, so the current set can be read without taking a reference
+    if (same_addrs(set, upstreams[i].addrs))
+    {
+      release_addrs(set);
+      continue;
+    }
+
+    printf("Upstream %s:%s re-resolved to %zu address(es)\n", upstreams[i].host,
+           upstreams[i].port, set->addrs_num);
+    swap_addrs(i, set);
+  }
+}
+
+static void *resolve_loop(void *arg)
+{
+  (void)arg;
+
+  pthread_mutex_lock(&resolver_lock);
+
+  while (!resolver_stopping)
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += config.dns_ttl;
+
+    // woken up early only to stop
+    while (!resolver_stopping &&
+           pthread_cond_timedwait(&resolver_wake, &resolver_lock, &deadline) != ETIMEDOUT)
+      ;
+
+    if (resolver_stopping)
+      break;
+
+    // lookups may block for secs, stop_resolver() must be able to take the lock meanwhile
+    pthread_mutex_unlock(&resolver_lock);
+    refresh_upstreams();
+    pthread_mutex_lock(&resolver_lock);
+  }
+
+  pthread_mutex_unlock(&resolver_lock);
+  return NULL;
+}
+
+bool start_resolver(void)
+{
+  if (!config.dns_ttl)
+    return true;
+
+  bool needed = false;
+  for (size_t i = 0; i < upstreams_num; ++i)
+    needed |= !upstreams[i].numeric;
+
+  if (!needed)
+    return true;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // deadlines immune to wall clock jumps
+  errno = pthread_cond_init(&resolver_wake, &attr);
+  pthread_condattr_destroy(&attr);
+
+  if (errno)
+    return err("pthread_cond_init", strerror(errno));
+
+  // signals are left to the event loops, the thread inherits the mask
+  sigset_t all, previous;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &previous);
+
+  resolver_stopping = false;
+  errno = pthread_create(&resolver_thread, NULL, resolve_loop, NULL);
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+  if (errno)
+  {
+    pthread_cond_destroy(&resolver_wake);
+    return err("pthread_create", strerror(errno));
+  }
+
+  resolver_started = true;
+  return true;
+}
+
+void stop_resolver(void)
+{
+  if (!resolver_started)
+    return;
+
+  pthread_mutex_lock(&resolver_lock);
+  resolver_stopping = true;
+  pthread_cond_signal(&resolver_wake);
+  pthread_mutex_unlock(&resolver_lock);
+
+  pthread_join(resolver_thread, NULL);
+  pthread_cond_destroy(&resolver_wake);
+  resolver_started = false;
+}
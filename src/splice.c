@@ -0,0 +1,218 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "main.h"
+#include "splice.h"
+#include "utils.h"
+
+_Thread_local PipePool pipe_pool = {0};
+
+bool setup_pipe_pool(void)
+{
+  memset(&pipe_pool, 0, sizeof pipe_pool);
+
+  if (!(pipe_pool.pipes = calloc(PIPES_MAX, sizeof(int[2]))))
+    return err("calloc", strerror(errno));
+
+  pipe_pool.pipes_cap = PIPES_MAX;
+  return true;
+}
+
+void free_pipe_pool(void)
+{
+  for (size_t i = 0; i < pipe_pool.pipes_num; ++i)
+  {
+    close(pipe_pool.pipes[i][0]);
+    close(pipe_pool.pipes[i][1]);
+  }
+
+  free(pipe_pool.pipes);
+  pipe_pool.pipes = NULL;
+  pipe_pool.pipes_num = pipe_pool.pipes_cap = 0;
+}
+
+bool can_splice(const Connection *conn)
+{
+  if (!conn)
+    return false;
+
+#ifdef USE_IO_URING
+  // the recv in flight on the upstream would race splice() for its bytes
+  return false;
+#endif
+
+  const Endpoint *client = &conn->client, *upstream = &conn->upstream;
+
+  return !conn->pipe_failed && client->fd >= 0 && upstream->fd >= 0 && !client->ssl &&
+         !upstream->ssl && upstream->headers_found &&
+         (upstream->content_len || upstream->until_eof) && !upstream->next_index &&
+         upstream->to_read >= SPLICE_MIN && !upstream->to_write && !upstream->held;
+}
+
+// takes an empty pipe from the pool, or opens one
+static bool acquire_pipe(Connection *conn)
+{
+  if (pipe_pool.pipes_num)
+  {
+    --pipe_pool.pipes_num;
+    conn->pipe_fds[0] = pipe_pool.pipes[pipe_pool.pipes_num][0];
+    conn->pipe_fds[1] = pipe_pool.pipes[pipe_pool.pipes_num][1];
+    return true;
+  }
+
+  if (pipe2(conn->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1)
+  {
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    return err("pipe2", strerror(errno));
+  }
+
+  // the default already, unless lowered by the system
+  fcntl(conn->pipe_fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+  ++pipe_pool.created;
+
+  return true;
+}
+
+void release_pipe(Connection *conn)
+{
+  if (!conn || conn->pipe_fds[0] < 0)
+    return;
+
+  // leftover bytes would be spliced into the next response
+  if (!conn->piped && pipe_pool.pipes_num < pipe_pool.pipes_cap)
+  {
+    pipe_pool.pipes[pipe_pool.pipes_num][0] = conn->pipe_fds[0];
+    pipe_pool.pipes[pipe_pool.pipes_num][1] = conn->pipe_fds[1];
+    ++pipe_pool.pipes_num;
+  }
+  else
+  {
+    close(conn->pipe_fds[0]);
+    close(conn->pipe_fds[1]);
+  }
+
+  conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+  conn->piped = 0;
+}
+
+void splice_response(Connection *conn)
+{
+  if (!conn)
+    return;
+
+  Endpoint *client = &conn->client, *upstream = &conn->upstream;
+
+  if (conn->pipe_fds[0] < 0)
+  {
+    if (!acquire_pipe(conn))
+    {
+      ++pipe_pool.fallback;
+      conn->pipe_failed = true;
+      conn->state = RELAY_RESPONSE;
+      return;
+    }
+
+    ++pipe_pool.relays;
+  }
+
+  bool progress = true;
+
+  while (progress)
+  {
+    progress = false;
+
+    // bytes past the content length are never taken, they belong to no response
+    while (upstream->to_read && upstream->readable && conn->piped < SPLICE_PIPE_SIZE)
+    {
+      size_t len = SPLICE_PIPE_SIZE - conn->piped;
+      ssize_t moved = splice(upstream->fd, NULL, conn->pipe_fds[1], NULL,
+                             len < upstream->to_read ? len : upstream->to_read,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+      if (moved > 0)
+      {
+        conn->piped += (size_t)moved;
+        upstream->to_read -= (size_t)moved;
+        pipe_pool.spliced += (size_t)moved;
+        progress = true;
+        continue;
+      }
+
+      if (!moved && upstream->until_eof) // the end of the body
+      {
+        upstream->to_read = 0;
+        upstream->readable = false;
+        break;
+      }
+
+      if (!moved)
+      {
+        warn("splice", "Upstream EOF received");
+        conn->state = CLOSE_CONN;
+        return;
+      }
+
+      if (errno == EINTR && RUNNING)
+        continue;
+
+      if (errno != EAGAIN)
+      {
+        err("splice", strerror(errno));
+        conn->state = CLOSE_CONN;
+        return;
+      }
+
+      // a pipe full of small socket buffers also returns EAGAIN, only an empty one tells the
+      // socket has nothing more till the next edge
+      if (!conn->piped)
+        upstream->readable = false;
+      break;
+    }
+
+    while (conn->piped && client->writable)
+    {
+      ssize_t moved = splice(conn->pipe_fds[0], NULL, client->fd, NULL, conn->piped,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+      if (moved > 0)
+      {
+        conn->piped -= (size_t)moved;
+        progress = true;
+        continue;
+      }
+
+      if (moved == -1 && errno == EINTR && RUNNING)
+        continue;
+
+      if (moved == -1 && errno == EAGAIN) // cannot write till the next edge
+      {
+        client->writable = false;
+        break;
+      }
+
+      err("splice", moved ? strerror(errno) : "No write status");
+      conn->state = CLOSE_CONN;
+      return;
+    }
+
+    if (!upstream->to_read && !conn->piped)
+    {
+      release_pipe(conn);
+      conn->complete = true;
+      conn->state = CHECK_CONN;
+      return;
+    }
+  }
+}
+
+void print_pipe_pool_stats(void)
+{
+  printf("Splice relays: %zu responses, %zu bytes spliced, %zu pipes opened, %zu copied "
+         "without a pipe\n",
+         pipe_pool.relays, pipe_pool.spliced, pipe_pool.created, pipe_pool.fallback);
+}
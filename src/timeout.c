@@ -1,76 +1,193 @@
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
+#include "balancer.h"
 #include "connection.h"
+#include "h2.h"
+#include "health.h"
+#include "hedge.h"
 #include "main.h"
 #include "proxy.h"
 #include "timeout.h"
+#include "upstream.h"
 #include "utils.h"
 
 // see TimeoutType enum for order
-const int TimeoutVals[TIMEOUTTYPES] = {15, 10, 30, 10, 45};
+// connection attempt delay is the 250ms recommended by RFC 8305
+// health interval is always passed from config
+// idle http/2 sessions are closed like idle upstream conns in the pool
+const int TimeoutVals[TIMEOUTTYPES] = {15000,          10000, 30000, 10000,          45000, 10000,
+                                       250,            10000, 10000, 0,              HEALTH_TIMEOUT,
+                                       QUEUE_TIMEOUT, 0,     IDLE_UPSTREAM_TIMEOUT};
 
-Timeout *timeouts_head = NULL, *timeouts_tail = NULL;
+_Thread_local int64_t loop_time = 0;
 
-void enqueue_timeout(Timeout *timeout)
+_Thread_local Timeout *timeout_wheel[WHEEL_SLOTS + 1] = {0};
+_Thread_local uint64_t wheel_occupied[WHEEL_SLOTS / 64] = {0};
+_Thread_local int64_t wheel_time = 0;
+_Thread_local size_t timeouts_num = 0;
+
+void update_loop_time(void)
 {
-  if (!timeout)
-    return;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  loop_time = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-  Timeout *current = timeouts_head;
-  time_t now = time(NULL);
+void setup_timeouts(void)
+{
+  memset(timeout_wheel, 0, sizeof timeout_wheel);
+  memset(wheel_occupied, 0, sizeof wheel_occupied);
+  update_loop_time();
+  wheel_time = loop_time / WHEEL_TICK;
+  timeouts_num = 0;
+}
 
-  timeout->active = true;
+void push_timeout(Timeout *timeout, size_t slot)
+{
+  timeout->slot = slot;
+  timeout->prev = NULL;
+  timeout->next = timeout_wheel[slot];
 
-  if (!current)
-  { // new start
-    timeouts_head = timeouts_tail = timeout;
-    return;
-  }
+  if (timeout->next)
+    timeout->next->prev = timeout;
 
-  if (EXPIRES(timeout) >= EXPIRES(timeouts_tail))
-  { // insert at end
-    timeouts_tail->next = timeout;
-    timeouts_tail = timeout;
+  timeout_wheel[slot] = timeout;
+
+  if (slot != EXPIRED_SLOT)
+    wheel_occupied[slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+void unlink_timeout(Timeout *timeout)
+{
+  if (timeout->prev)
+    timeout->prev->next = timeout->next;
+  else
+    timeout_wheel[timeout->slot] = timeout->next;
+
+  if (timeout->next)
+    timeout->next->prev = timeout->prev;
+
+  if (timeout->slot != EXPIRED_SLOT && !timeout_wheel[timeout->slot])
+    wheel_occupied[timeout->slot / 64] &= ~((uint64_t)1 << (timeout->slot % 64));
+
+  timeout->next = timeout->prev = NULL;
+}
+
+void enqueue_timeout(Timeout *timeout)
+{
+  if (!timeout)
     return;
-  }
 
-  while (current->next && EXPIRES(timeout) > EXPIRES(current->next))
-    current = current->next; // look for nearest ttl
+  // rounding up, so the timeout never fires early
+  int64_t tick = (timeout->expires + WHEEL_TICK - 1) / WHEEL_TICK;
 
-  if (!current->next)
-    timeouts_tail = timeout;
+  // a timeout due in an already expired tick would only be visited after a full revolution
+  if (tick <= wheel_time)
+    tick = wheel_time + 1;
 
-  timeout->next = current->next;
-  current->next = timeout;
+  push_timeout(timeout, (size_t)tick & (WHEEL_SLOTS - 1));
+  timeout->active = true;
+  ++timeouts_num;
 }
 
 Timeout *dequeue_timeout(void)
 {
-  time_t now = time(NULL);
+  Timeout *timeout = timeout_wheel[EXPIRED_SLOT];
 
-  if (!timeouts_head || EXPIRES(timeouts_head))
+  if (!timeout)
     return NULL;
 
-  Timeout *timeout = timeouts_head;
-  timeouts_head = timeouts_head->next;
-  if (!timeouts_head)
-    timeouts_tail = NULL;
-
+  unlink_timeout(timeout);
   timeout->active = false;
+  --timeouts_num;
 
   return timeout;
 }
 
 void clear_expired(void)
 {
+  int64_t now = loop_time, now_tick = now / WHEEL_TICK;
+
+  // only one revolution has to be visited, no matter how long it has been
+  int64_t from = now_tick - wheel_time > WHEEL_SLOTS ? now_tick - WHEEL_SLOTS : wheel_time;
+
+  // collecting first, as handling a timeout may remove other timeouts of the same conn
+  for (int64_t tick = from + 1; tick <= now_tick; ++tick)
+  {
+    Timeout *current = timeout_wheel[(size_t)tick & (WHEEL_SLOTS - 1)], *next = NULL;
+
+    for (; current; current = next)
+    {
+      next = current->next;
+
+      if (current->expires > now) // due in a later revolution
+        continue;
+
+      unlink_timeout(current);
+      push_timeout(current, EXPIRED_SLOT);
+    }
+  }
+
+  if (now_tick > wheel_time)
+    wheel_time = now_tick;
+
   Timeout *current = NULL;
 
   while ((current = dequeue_timeout()))
   {
-    warn("clear_timeout", current->type == CONNECTION ? "Connection timeout" : "State timeout");
     Connection *conn = current->conn;
-    if (current->type == REQUEST_READ || current->type == REQUEST_WRITE)
+
+    // not an error, the pending attempt keeps racing the next one
+    if (current->type == CONNECT_ATTEMPT)
+    {
+      start_connect_attempt(conn);
+      handle_state(conn);
+      continue;
+    }
+
+    if (current->type == HEALTH_INTERVAL)
+    {
+      start_probe(conn);
+      continue;
+    }
+
+    if (current->type == HEALTH_PROBE)
+    {
+      fail_probe(conn);
+      continue;
+    }
+
+    if (current->type == HEDGE_DELAY)
+    {
+      start_hedge(conn);
+      continue;
+    }
+
+    if (current->type == SESSION_IDLE)
+    {
+      close_session(conn);
+      continue;
+    }
+
+    warn("clear_timeout", current->type == CONNECTION ? "Connection timeout" : "State timeout");
+    if (current->type == UPSTREAM_CONNECT || current->type == UPSTREAM_HANDSHAKE)
+    {
+      if (!retry_request(conn))
+      {
+        conn->status = 504;
+        conn->state = WRITE_ERROR;
+      }
+    }
+    else if (current->type == QUEUE_WAIT) // shedding load, instead of queueing without bound
+    {
+      leave_wait_queue(conn);
+      ++wait_queue.expired;
+      conn->status = 503;
+      conn->state = WRITE_ERROR;
+    }
+    else if (current->type == REQUEST_READ || current->type == REQUEST_WRITE)
     {
       conn->status = 408;
       conn->state = WRITE_ERROR;
@@ -86,7 +203,38 @@ void clear_expired(void)
   }
 }
 
-void start_conn_timeout(Connection *conn, time_t ttl)
+int next_expiry(void)
+{
+  if (!timeouts_num)
+    return -1;
+
+  // an overdue tick has to be handled right away
+  if (loop_time / WHEEL_TICK > wheel_time || timeout_wheel[EXPIRED_SLOT])
+    return 0;
+
+  // looking for the first occupied slot after wheel_time, wrapping around the bitmap once
+  size_t start = ((size_t)wheel_time + 1) & (WHEEL_SLOTS - 1);
+
+  for (size_t checked = 0; checked < WHEEL_SLOTS;)
+  {
+    size_t slot = (start + checked) & (WHEEL_SLOTS - 1);
+    uint64_t word = wheel_occupied[slot / 64] >> (slot % 64);
+
+    if (word)
+    {
+      // slot is due at the start of tick: wheel_time + distance + 1
+      int64_t due =
+          (wheel_time + (int64_t)(checked + (size_t)__builtin_ctzll(word)) + 1) * WHEEL_TICK;
+      return due > loop_time ? (int)(due - loop_time) : 0;
+    }
+
+    checked += 64 - slot % 64;
+  }
+
+  return WHEEL_SLOTS * WHEEL_TICK;
+}
+
+void start_conn_timeout(Connection *conn, int64_t ttl)
 {
   if (!conn)
     return;
@@ -108,32 +256,25 @@ void start_state_timeout(Connection *conn, TimeoutType type)
   enqueue_timeout(&conn->state_timeout);
 }
 
-void remove_timeout(Timeout *timeout)
+void start_attempt_timeout(Connection *conn)
 {
-  if (!timeout || !timeout->active || !timeouts_head)
-    return;
-
-  if (timeouts_head == timeout)
-  {
-    timeouts_head = timeouts_head->next;
-    if (!timeouts_head)
-      timeouts_tail = NULL;
-    timeout->active = false;
+  if (!conn)
     return;
-  }
 
-  Timeout *current = timeouts_head;
+  remove_timeout(&conn->attempt_timeout);
 
-  for (; current->next != timeout; current = current->next)
-    if (!current->next) // not found
-      return;
-
-  current->next = timeout->next;
+  fill_timeout(conn, CONNECT_ATTEMPT, -1);
+  enqueue_timeout(&conn->attempt_timeout);
+}
 
-  if (timeouts_tail == timeout)
-    timeouts_tail = current;
+void remove_timeout(Timeout *timeout)
+{
+  if (!timeout || !timeout->active)
+    return;
 
+  unlink_timeout(timeout);
   timeout->active = false;
+  --timeouts_num;
 }
 
 const char *get_type_string(TimeoutType type)
@@ -150,34 +291,58 @@ const char *get_type_string(TimeoutType type)
     return "Response_write";
   case CONNECTION:
     return "Connection";
+  case UPSTREAM_CONNECT:
+    return "Upstream_connect";
+  case CONNECT_ATTEMPT:
+    return "Connect_attempt";
+  case CLIENT_HANDSHAKE:
+    return "Client_handshake";
+  case UPSTREAM_HANDSHAKE:
+    return "Upstream_handshake";
+  case HEALTH_INTERVAL:
+    return "Health_interval";
+  case HEALTH_PROBE:
+    return "Health_probe";
+  case QUEUE_WAIT:
+    return "Queue_wait";
+  case HEDGE_DELAY:
+    return "Hedge_delay";
+  case SESSION_IDLE:
+    return "Session_idle";
   default:
     return "";
   }
 }
 
-void fill_timeout(Connection *conn, TimeoutType type, time_t ttl)
+void fill_timeout(Connection *conn, TimeoutType type, int64_t ttl)
 {
   if (!conn)
     return;
 
-  Timeout *timeout = type == CONNECTION ? &conn->conn_timeout : &conn->state_timeout;
+  Timeout *timeout =
+      type == CONNECTION || type == HEALTH_INTERVAL || type == SESSION_IDLE ? &conn->conn_timeout
+      : type == CONNECT_ATTEMPT                                             ? &conn->attempt_timeout
+      : type == HEDGE_DELAY                                                 ? &conn->hedge_timeout
+                                                                            : &conn->state_timeout;
 
   timeout->conn = conn;
   timeout->type = type;
-  timeout->start = time(NULL);
+  timeout->start = loop_time;
   timeout->ttl = ttl == -1 ? TimeoutVals[type] : ttl;
-  timeout->next = NULL;
+  timeout->expires = timeout->start + timeout->ttl;
+  timeout->next = timeout->prev = NULL;
 }
 
 void print_timeouts(void)
 {
   int i = 0;
-  time_t now = time(NULL);
+  int64_t now = loop_time;
   puts("Timeouts: [");
 
-  for (Timeout *current = timeouts_head; current; current = current->next)
-    printf("\t{%d - Type: %s, Time: %ld, Expires: %ld }\n", ++i, get_type_string(current->type),
-           current->ttl, EXPIRES(current));
+  for (size_t slot = 0; slot <= EXPIRED_SLOT; ++slot)
+    for (Timeout *current = timeout_wheel[slot]; current; current = current->next)
+      printf("\t{%d - Type: %s, Slot: %zu, Time: %ldms, Expires: %ldms }\n", ++i,
+             get_type_string(current->type), current->slot, current->ttl, EXPIRES(current));
 
   printf("] Len: %d\n", i);
 }
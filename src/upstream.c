@@ -4,62 +4,195 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <openssl/ssl.h>
+#include <poll.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "args.h"
+#include "balancer.h"
 #include "connection.h"
+#include "event.h"
+#include "h2.h"
 #include "http.h"
 #include "main.h"
+#include "splice.h"
+#include "timeout.h"
 #include "upstream.h"
 #include "utils.h"
+#include "zerocopy.h"
 
-// global var that stores a linked list of struct addrinfo containing info about
-// upstream server
-struct addrinfo *upstream_addrinfo = NULL;
+// members of the upstream group, read only for the workers
+Upstream *upstreams = NULL;
+size_t upstreams_num = 0;
 
-bool setup_upstream(char *upstream)
+pthread_mutex_t addrs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+_Thread_local IdlePool idle_pool = {0};
+
+_Thread_local SessionCache session_cache = {0};
+
+bool split_weight(char *member, unsigned int *weight)
 {
-  if (!upstream)
+  if (!member || !weight)
+    return set_efault();
+
+  *weight = 1;
+
+  char *at = strrchr(member, '@');
+  if (!at)
+    return true;
+
+  *at = '\0'; // member is only the origin from here on
+
+  char *end;
+  const long num = strtol(at + 1, &end, 10);
+  if (*end != '\0' || end == at + 1)
+  {
+    errno = EINVAL;
+    return false;
+  }
+  if (num < 1 || num > MAX_UPSTREAM_WEIGHT)
+  {
+    errno = ERANGE;
+    return false;
+  }
+
+  *weight = (unsigned int)num;
+  return true;
+}
+
+bool parse_upstream(char *origin, Upstream *upstream)
+{
+  if (!origin || !upstream)
     return set_efault();
 
+  if (!split_weight(origin, &upstream->weight))
+    return err("split_weight", strerror(errno));
+
   // removing / at the end, if found
-  size_t len = strlen(upstream);
-  while (upstream[--len] == '/')
-    upstream[len] = '\0';
+  size_t len = strlen(origin);
+  while (len && origin[len - 1] == '/')
+    origin[--len] = '\0';
 
-  // upstream may contain port at the end, parsing it
-  // else using if any http protocol is specificed
+  if (!strncmp(origin, UNIX_SCHEME, sizeof UNIX_SCHEME - 1))
+  {
+    // logged as unix:<path> like the other members, nothing to resolve or to encrypt
+    upstream->https = false;
+    upstream->numeric = true;
+    upstream->unix_socket = true;
+
+    if (!(upstream->host = strdup("unix")) ||
+        !(upstream->port = strdup(origin + sizeof UNIX_SCHEME - 1)))
+      return err("strdup", strerror(errno));
+
+    return true;
+  }
+
+  // scheme decides tls & the default port, -S applies to members without one
   // otherwise using FALLBACK_UPSTREAM_PORT
-  char *colon = upstream, *port = NULL, *tmp = NULL, *revert = NULL;
-  while ((tmp = strchr(colon, ':')))
-    colon = ++tmp;
+  char *host = origin;
+  const char *port = NULL;
 
-  if (colon == upstream) // no : found
-    port = FALLBACK_UPSTREAM_PORT;
+  if (!strncmp(host, "https://", 8))
+  {
+    upstream->https = true;
+    port = "443";
+    host += 8;
+  }
+  else if (!strncmp(host, "http://", 7))
+  {
+    upstream->https = false;
+    port = "80";
+    host += 7;
+  }
   else
   {
-    --colon; // now colon is at ':', makes reasoning a little easier
-    if (colon[1] == '/')
-    { // the colon is followed after http or https
-      if (colon[-1] == 's')
-        port = "443";
-      else
-        port = "80";
-    }
-    else
-    {                 // the colon is followed by the port at the end
-      *colon = '\0';  // now the port and origin are separated by a null terminator
-      revert = colon; // need to revert it back to the original format to be
-                      // able to compare to the host header of the request
-      port = ++colon;
-    }
+    upstream->https = config.upstream_https;
+    port = config.upstream_https ? "443" : FALLBACK_UPSTREAM_PORT;
+  }
+
+  // upstream may contain port at the end, after the scheme
+  char *colon = strrchr(host, ':');
+  if (colon)
+    port = colon + 1;
+
+  if (!(upstream->host = strndup(host, colon ? (size_t)(colon - host) : strlen(host))) ||
+      !(upstream->port = strdup(port)))
+    return err("strdup", strerror(errno));
+
+  struct in6_addr addr;
+  upstream->numeric = inet_pton(AF_INET, upstream->host, &addr) == 1 ||
+                      inet_pton(AF_INET6, upstream->host, &addr) == 1;
+
+  return true;
+}
+
+// a single address without an addrinfo list, the addrinfo & the sockaddr live in the same
+// block as addrs, freed along with it
+static AddrSet *unix_addrs(const Upstream *upstream)
+{
+  struct unix_addr
+  {
+    struct addrinfo *addrs[1];
+    struct addrinfo info;
+    struct sockaddr_un sun;
+  } *addr = NULL;
+
+  size_t path_len = strlen(upstream->port);
+  if (path_len >= sizeof addr->sun.sun_path)
+  {
+    errno = ENAMETOOLONG;
+    err("unix_addrs", strerror(errno));
+    return NULL;
+  }
+
+  AddrSet *set = NULL;
+  if (!(set = calloc(1, sizeof(AddrSet))) || !(addr = calloc(1, sizeof(struct unix_addr))))
+  {
+    err("calloc", strerror(errno));
+    free(set);
+    return NULL;
+  }
+
+  addr->sun.sun_family = AF_UNIX;
+  memcpy(addr->sun.sun_path, upstream->port, path_len);
+
+  addr->info.ai_family = AF_UNIX;
+  addr->info.ai_socktype = SOCK_STREAM;
+  addr->info.ai_addr = (struct sockaddr *)&addr->sun;
+  addr->info.ai_addrlen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path_len + 1);
+  addr->addrs[0] = &addr->info;
+
+  set->addrs = addr->addrs;
+  set->addrs_num = 1;
+  atomic_init(&set->refs, 1);
+  return set;
+}
+
+AddrSet *resolve_addrs(const Upstream *upstream)
+{
+  if (!upstream)
+  {
+    set_efault();
+    return NULL;
+  }
+
+  if (upstream->unix_socket)
+    return unix_addrs(upstream);
+
+  AddrSet *set = NULL;
+  if (!(set = calloc(1, sizeof(AddrSet))))
+  {
+    err("calloc", strerror(errno));
+    return NULL;
   }
 
   struct addrinfo hints;
@@ -68,59 +201,603 @@ bool setup_upstream(char *upstream)
   hints.ai_socktype = SOCK_STREAM;
 
   int status = 0;
-  // targetting port based on the protocol of the upstream
-  if ((status = getaddrinfo(upstream, port, &hints, &upstream_addrinfo)) != 0)
-    return err("getaddrinfo", gai_strerror(status));
+  if ((status = getaddrinfo(upstream->host, upstream->port, &hints, &set->addrinfo)) != 0)
+  {
+    err("getaddrinfo", gai_strerror(status));
+    free(set);
+    return NULL;
+  }
 
   // getaddrinfo() makes system calls that may sometime set errno, even if getaddrinfo returns 0
   errno = 0;
 
-  if (revert)
-    *revert = ':';
+  if (!order_addrs(set))
+  {
+    err("order_addrs", strerror(errno));
+    freeaddrinfo(set->addrinfo);
+    free(set);
+    return NULL;
+  }
+
+  atomic_init(&set->refs, 1);
+  return set;
+}
+
+bool setup_upstreams(const char *list)
+{
+  if (!list)
+    return set_efault();
+
+  char *copy = NULL, *save = NULL, *member = NULL;
+  if (!(copy = strdup(list)))
+    return err("strdup", strerror(errno));
+
+  size_t members = 1;
+  for (const char *c = list; *c; ++c)
+    members += *c == ',';
+
+  if (!(upstreams = calloc(members, sizeof(Upstream))))
+  {
+    free(copy);
+    return err("calloc", strerror(errno));
+  }
+
+  for (member = strtok_r(copy, ",", &save); member; member = strtok_r(NULL, ",", &save))
+  {
+    Upstream *upstream = upstreams + upstreams_num++;
+
+    if (!parse_upstream(member, upstream) || !(upstream->addrs = resolve_addrs(upstream)))
+    {
+      free(copy);
+      return err("setup_upstream", member);
+    }
+
+    printf("Upstream %s:%s, weight %u, %zu address(es)%s\n", upstream->host, upstream->port,
+           upstream->weight, upstream->addrs->addrs_num, upstream->https ? ", HTTPS" : "");
+  }
+
+  free(copy);
+
+  if (!upstreams_num)
+  {
+    errno = EINVAL;
+    return err("setup_upstreams", "No upstream passed");
+  }
+
+  return true;
+}
+
+bool order_addrs(AddrSet *set)
+{
+  size_t total = 0;
+  for (struct addrinfo *current = set->addrinfo; current; current = current->ai_next)
+    ++total;
+
+  if (!total)
+  {
+    errno = ENOENT;
+    return false;
+  }
+
+  if (!(set->addrs = malloc(total * sizeof(struct addrinfo *))))
+    return false;
+
+  // getaddrinfo() already sorts by preference (RFC 6724), the first family is tried first
+  int first_family = set->addrinfo->ai_family;
+  struct addrinfo *first = set->addrinfo, *second = set->addrinfo;
+
+  // alternating families, keeping the order within each family
+  while (set->addrs_num < total)
+  {
+    bool first_turn = set->addrs_num % 2 == 0;
+    struct addrinfo **turn = first_turn ? &first : &second;
+
+    while (*turn && (((*turn)->ai_family == first_family) != first_turn))
+      *turn = (*turn)->ai_next;
+
+    if (!*turn) // one family ran out, the rest are of the other one
+    {
+      turn = first_turn ? &second : &first;
+      while (*turn && (((*turn)->ai_family == first_family) == first_turn))
+        *turn = (*turn)->ai_next;
+    }
+
+    set->addrs[set->addrs_num++] = *turn;
+    *turn = (*turn)->ai_next;
+  }
+
+  return true;
+}
+
+bool same_addrs(const AddrSet *first, const AddrSet *second)
+{
+  if (!first || !second || first->addrs_num != second->addrs_num)
+    return false;
+
+  for (size_t i = 0; i < first->addrs_num; ++i)
+    if (first->addrs[i]->ai_addrlen != second->addrs[i]->ai_addrlen ||
+        memcmp(first->addrs[i]->ai_addr, second->addrs[i]->ai_addr, first->addrs[i]->ai_addrlen))
+      return false;
+
+  return true;
+}
+
+AddrSet *acquire_addrs(size_t member)
+{
+  // the lock keeps the set from being released by a swap between loading & counting it
+  pthread_mutex_lock(&addrs_lock);
+
+  AddrSet *set = upstreams[member].addrs;
+  atomic_fetch_add_explicit(&set->refs, 1, memory_order_relaxed);
+
+  pthread_mutex_unlock(&addrs_lock);
+  return set;
+}
+
+void release_addrs(AddrSet *set)
+{
+  if (!set || atomic_fetch_sub_explicit(&set->refs, 1, memory_order_acq_rel) != 1)
+    return;
+
+  if (set->addrinfo) // NULL for unix members
+    freeaddrinfo(set->addrinfo);
+  free(set->addrs);
+  free(set);
+}
+
+void swap_addrs(size_t member, AddrSet *set)
+{
+  pthread_mutex_lock(&addrs_lock);
+
+  AddrSet *previous = upstreams[member].addrs;
+  upstreams[member].addrs = set;
+
+  pthread_mutex_unlock(&addrs_lock);
+  release_addrs(previous);
+}
+
+void start_connect_attempt(Connection *conn)
+{
+  if (!conn || conn->state != CONNECTING_UPSTREAM || !conn->addrs)
+    return;
+
+  const AddrSet *set = conn->addrs;
+
+  while (conn->next_addr < set->addrs_num && conn->attempts_num < MAX_CONNECT_ATTEMPTS)
+  {
+    const struct addrinfo *addr = set->addrs[conn->next_addr++];
+
+    int fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    addr->ai_protocol);
+    if (fd == -1)
+    {
+      err("socket", strerror(errno));
+      continue;
+    }
+
+    // right away on loopback & unix sockets, the latter fail with EAGAIN on a full backlog
+    bool connected = connect(fd, addr->ai_addr, addr->ai_addrlen) == 0;
+    if (!connected && errno != EINPROGRESS)
+    {
+      warn("connect", strerror(errno));
+      close(fd);
+      continue;
+    }
+
+    // registered in both cases, attempts report to the upstream endpoint and the winner stays
+    // registered as the upstream fd
+    if (!add_to_epoll(&conn->upstream, fd, EVENT_FLAGS))
+    {
+      err("add_to_epoll", NULL);
+      close_socket(fd);
+      continue;
+    }
+
+    if (connected)
+    {
+      finish_connect(conn, fd);
+      return;
+    }
+
+    for (size_t i = 0; i < MAX_CONNECT_ATTEMPTS; ++i)
+      if (conn->attempt_fds[i] == -1)
+      {
+        conn->attempt_fds[i] = fd;
+        break;
+      }
+    ++conn->attempts_num;
+
+    // next address is raced in parallel, if this one does not connect in time
+    if (conn->next_addr < set->addrs_num)
+      start_attempt_timeout(conn);
+
+    return;
+  }
+
+  if (!conn->attempts_num)
+  { // every address failed
+    err("connect_upstream", "No upstream address reachable");
+    close_connect_attempts(conn);
+
+    if (retry_request(conn))
+      return;
+
+    conn->status = 502;
+    conn->state = WRITE_ERROR;
+  }
+}
+
+void check_connect_attempts(Connection *conn)
+{
+  if (!conn)
+    return;
+
+  assert(conn->state == CONNECTING_UPSTREAM);
+
+  // every attempt shares the conn as its event data, so polling all of them for the ready ones
+  struct pollfd fds[MAX_CONNECT_ATTEMPTS];
+  nfds_t fds_num = 0;
+
+  for (size_t i = 0; i < MAX_CONNECT_ATTEMPTS; ++i)
+    if (conn->attempt_fds[i] >= 0)
+      fds[fds_num++] = (struct pollfd){.fd = conn->attempt_fds[i], .events = POLLOUT};
+
+  if (poll(fds, fds_num, 0) == -1)
+  {
+    err("poll", strerror(errno));
+    return;
+  }
+
+  bool failed = false;
+
+  for (nfds_t i = 0; i < fds_num; ++i)
+  {
+    if (!fds[i].revents)
+      continue;
+
+    int error = 0;
+    socklen_t len = sizeof error;
+    if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+      error = errno;
+
+    if (!error)
+    {
+      finish_connect(conn, fds[i].fd);
+      return;
+    }
+
+    warn("connect", strerror(error));
+    drop_connect_attempt(conn, fds[i].fd);
+    failed = true;
+  }
+
+  // not waiting for the attempt delay after a failure
+  if (failed)
+    start_connect_attempt(conn);
+}
+
+void finish_connect(Connection *conn, int fd)
+{
+  if (!conn)
+    return;
+
+  // winner is not an attempt anymore, so it is not closed with the rest
+  for (size_t i = 0; i < MAX_CONNECT_ATTEMPTS; ++i)
+    if (conn->attempt_fds[i] == fd)
+    {
+      conn->attempt_fds[i] = -1;
+      --conn->attempts_num;
+    }
+
+  close_connect_attempts(conn);
+
+  // the EPOLLOUT edge of the connect has been used up, a connected socket is writable
+  conn->upstream.fd = fd;
+  conn->upstream.readable = false;
+  conn->upstream.writable = true;
+  conn->state = TLS_UPSTREAM;
+}
+
+void drop_connect_attempt(Connection *conn, int fd)
+{
+  if (!conn)
+    return;
+
+  for (size_t i = 0; i < MAX_CONNECT_ATTEMPTS; ++i)
+    if (conn->attempt_fds[i] == fd)
+    {
+      del_from_epoll(fd);
+      close_socket(fd);
+      conn->attempt_fds[i] = -1;
+      --conn->attempts_num;
+    }
+}
+
+void close_connect_attempts(Connection *conn)
+{
+  if (!conn)
+    return;
+
+  for (size_t i = 0; i < MAX_CONNECT_ATTEMPTS; ++i)
+    if (conn->attempt_fds[i] >= 0)
+      drop_connect_attempt(conn, conn->attempt_fds[i]);
+
+  remove_timeout(&conn->attempt_timeout);
+
+  release_addrs(conn->addrs);
+  conn->addrs = NULL;
+}
+
+bool retry_request(Connection *conn)
+{
+  if (!conn || conn->member == NO_MEMBER || conn->upstream.headers_found)
+    return false;
+
+  Endpoint *client = &conn->client, *upstream = &conn->upstream;
+
+  // a closed idle conn sent nothing, any conn to the member could have been picked instead
+  bool stale = conn->reused && !upstream->read_index;
+  size_t failed = conn->member;
+
+  if (!stale)
+    record_outcome(failed, true);
+
+  // a hedge conn that fails is dropped, its client conn is still waiting on its own upstream
+  if (conn->shadow || conn->retries >= UPSTREAM_RETRIES || !RUNNING)
+    return false;
+
+  // written in part or in full, so the member may have acted on it
+  if (conn->sent && !is_idempotent(client->headers.data))
+    return false;
+
+  // the body is read from the client once, & only the ring is kept of it
+  if (client->ring_start)
+    return false;
+
+  warn("retry_request", stale ? "Idle upstream conn was closed, retrying on a fresh conn"
+                              : "Upstream failed, retrying the request");
+
+  close_connect_attempts(conn);
+  close_upstream(conn);
+
+  // only a real failure cuts the concurrency limit of the member
+  uint status = conn->status;
+  conn->status = stale ? 0 : 502;
+  finish_member(conn, false);
+  conn->status = status;
+
+  reset_endpoint(upstream);
+  conn->sent = 0;
+
+  if (!select_other_member(conn, stale ? NO_MEMBER : failed))
+    return false;
+
+  ++member_stats[failed].retries;
+  ++conn->retries; // skips the idle pool, its conns to the member may be as stale
+  conn->state = CONNECT_UPSTREAM;
+
+  return true;
+}
+
+void free_upstreams(void)
+{
+  for (size_t i = 0; i < upstreams_num; ++i)
+  {
+    free(upstreams[i].host);
+    free(upstreams[i].port);
+    release_addrs(upstreams[i].addrs);
+  }
+
+  free(upstreams);
+  upstreams = NULL;
+  upstreams_num = 0;
+}
+
+bool setup_idle_pool(size_t capacity)
+{
+  memset(&idle_pool, 0, sizeof idle_pool);
+
+  if (!capacity) // pooling disabled
+    return true;
+
+  if (!(idle_pool.idle = malloc(capacity * sizeof(IdleUpstream))))
+    return err("malloc", strerror(errno));
+
+  idle_pool.idle_cap = capacity;
+  return true;
+}
+
+// closes a conn that has left the pool
+static void close_idle_upstream(IdleUpstream *idle)
+{
+  if (idle->ssl)
+    SSL_free(idle->ssl); // no close_notify, the upstream treats it like a closed idle conn
+
+  close_socket(idle->fd);
+}
+
+bool release_upstream(Connection *conn)
+{
+  if (!conn)
+    return set_efault();
+
+  Endpoint *upstream = &conn->upstream;
+
+  // leftover bytes after the response would be read as the start of the next one
+  if (upstream->fd < 0 || !conn->complete || !conn->upstream_keep_alive || upstream->next_index ||
+      idle_pool.idle_num == idle_pool.idle_cap || !RUNNING)
+    return false;
+
+  // idle conns are not watched, whatever arrives on them is found by checkout_upstream()
+  if (!del_from_epoll(upstream->fd))
+    return false;
+
+  idle_pool.idle[idle_pool.idle_num++] = (IdleUpstream){
+      .fd = upstream->fd, .ssl = upstream->ssl, .member = conn->member, .since = loop_time};
+
+  upstream->fd = -1;
+  upstream->ssl = NULL;
+  upstream->readable = upstream->writable = false;
 
   return true;
 }
 
-bool connect_upstream(int *upstream_fd)
+bool checkout_upstream(Connection *conn)
 {
-  if (!upstream_addrinfo)
-    return err("verify_upstream", "Upstream address info is NULL");
+  if (!conn)
+    return set_efault();
 
-  for (struct addrinfo *current = upstream_addrinfo; current; current = current->ai_next)
+  // newest first, only conns to the member selected for this request
+  for (size_t i = idle_pool.idle_num; i-- > 0;)
   {
-    if ((*upstream_fd = socket(current->ai_family, current->ai_socktype, current->ai_protocol)) ==
-        -1)
+    if (idle_pool.idle[i].member != conn->member)
       continue;
 
-    if (connect(*upstream_fd, current->ai_addr, current->ai_addrlen) == -1)
+    IdleUpstream idle = idle_pool.idle[i];
+    memmove(idle_pool.idle + i, idle_pool.idle + i + 1,
+            (--idle_pool.idle_num - i) * sizeof(IdleUpstream));
+
+    if (loop_time - idle.since >= IDLE_UPSTREAM_TIMEOUT || peek_socket(idle.fd))
+    {
+      close_idle_upstream(&idle);
+      ++idle_pool.stale;
+      continue;
+    }
+
+    if (!add_to_epoll(&conn->upstream, idle.fd, EVENT_FLAGS))
     {
-      close(*upstream_fd);
-      *upstream_fd = -2;
+      err("add_to_epoll", NULL);
+      close_idle_upstream(&idle);
       continue;
     }
 
-    // If a valid socket is connected to then break
-    break;
-  };
+    // nothing to read on an idle conn, and the send buffer is empty
+    conn->upstream.fd = idle.fd;
+    conn->upstream.ssl = idle.ssl;
+    conn->upstream.readable = false;
+    conn->upstream.writable = true;
+    conn->reused = true;
+    ++idle_pool.reuses;
 
-  if (*upstream_fd < 0)
-  { // dealing with different errors
-    if (*upstream_fd == -1)
-      return err("socket", strerror(errno));
-    else if (*upstream_fd == -2)
-      return err("connect", strerror(errno));
+    return true;
   }
 
-  if (!set_non_block(*upstream_fd))
-    return err("set_non_block", NULL);
+  return false;
+}
+
+void expire_idle_upstreams(void)
+{
+  size_t expired = 0;
+
+  while (expired < idle_pool.idle_num &&
+         loop_time - idle_pool.idle[expired].since >= IDLE_UPSTREAM_TIMEOUT)
+    close_idle_upstream(idle_pool.idle + expired++);
+
+  if (!expired)
+    return;
+
+  idle_pool.idle_num -= expired;
+  memmove(idle_pool.idle, idle_pool.idle + expired, idle_pool.idle_num * sizeof(IdleUpstream));
+  idle_pool.stale += expired;
+}
+
+void drop_idle_upstreams(size_t member)
+{
+  size_t kept = 0;
+
+  // keeping the order, the oldest conns stay at the bottom
+  for (size_t i = 0; i < idle_pool.idle_num; ++i)
+    if (idle_pool.idle[i].member == member)
+      close_idle_upstream(idle_pool.idle + i);
+    else
+      idle_pool.idle[kept++] = idle_pool.idle[i];
+
+  idle_pool.idle_num = kept;
+}
+
+int next_idle_expiry(void)
+{
+  if (!idle_pool.idle_num)
+    return -1;
+
+  int64_t left = idle_pool.idle->since + IDLE_UPSTREAM_TIMEOUT - loop_time;
+  return left > 0 ? (int)left : 0;
+}
+
+void free_idle_pool(void)
+{
+  for (size_t i = 0; i < idle_pool.idle_num; ++i)
+    close_idle_upstream(idle_pool.idle + i);
+
+  free(idle_pool.idle);
+  memset(&idle_pool, 0, sizeof idle_pool);
+}
+
+void print_idle_pool_stats(void)
+{
+  printf("Idle upstream pool: %zu reuses, %zu stale, %zu idle, %zu capacity\n", idle_pool.reuses,
+         idle_pool.stale, idle_pool.idle_num, idle_pool.idle_cap);
+}
+
+bool setup_session_cache(void)
+{
+  memset(&session_cache, 0, sizeof session_cache);
+
+  if (!upstream_ssl_context) // no https member
+    return true;
+
+  if (!(session_cache.sessions = calloc(upstreams_num, sizeof(SSL_SESSION *))))
+    return err("calloc", strerror(errno));
 
   return true;
 }
 
-void free_upstream_addrinfo(void)
+int cache_session(SSL *ssl, SSL_SESSION *session)
 {
-  if (upstream_addrinfo)
-    freeaddrinfo(upstream_addrinfo);
+  // member + 1, so a missing app data is 0
+  size_t member = (size_t)(uintptr_t)SSL_get_app_data(ssl);
+
+  // called on the thread doing I/O on ssl, which owns the cache
+  if (!member-- || member >= upstreams_num || !session_cache.sessions)
+    return 0; // not taken, openssl frees it
+
+  if (session_cache.sessions[member])
+    SSL_SESSION_free(session_cache.sessions[member]);
+
+  session_cache.sessions[member] = session;
+  return 1;
+}
+
+void resume_session(SSL *ssl, size_t member)
+{
+  if (!ssl || !session_cache.sessions || member >= upstreams_num)
+    return;
+
+  SSL_SESSION *session = session_cache.sessions[member];
+
+  // an expired session would only cost a full handshake, not an error
+  if (session && SSL_SESSION_is_resumable(session))
+    SSL_set_session(ssl, session);
+}
+
+void free_session_cache(void)
+{
+  if (session_cache.sessions)
+    for (size_t i = 0; i < upstreams_num; ++i)
+      if (session_cache.sessions[i])
+        SSL_SESSION_free(session_cache.sessions[i]);
+
+  free(session_cache.sessions);
+  memset(&session_cache, 0, sizeof session_cache);
+}
+
+void print_session_cache_stats(void)
+{
+  if (!upstream_ssl_context)
+    return;
+
+  printf("Upstream TLS: %zu handshakes, %zu resumed\n", session_cache.handshakes,
+         session_cache.resumed);
 }
 
 void read_response(Connection *conn)
@@ -128,6 +805,15 @@ void read_response(Connection *conn)
   if (!conn)
     goto error;
 
+  // the session of a stream has read the response into the buffer already
+  if (conn->stream_id)
+  {
+    read_stream(conn);
+    if (conn->upstream.headers_found)
+      sample_member(conn);
+    return;
+  }
+
   assert(conn->state == READ_RESPONSE);
   assert(!conn->complete);
 
@@ -140,84 +826,46 @@ void read_response(Connection *conn)
     goto error;
   }
 
-  // after finding the headers
-  // must have written the buffer to client in full, before reading again
-  if (upstream->headers_found)
-  {
-    upstream->read_index = 0;
-    *upstream->buffer = '\0';
-  }
-
   ssize_t read_status = 0;
-  size_t max_read = BUFFER_SIZE - (size_t)upstream->read_index - 1;
+  size_t max_read = 0;
 
-  while ((max_read -= (size_t)read_status) &&
+  // headers are read into the start of the buffer, parse_headers() needs them in one piece
+  while ((max_read = BUFFER_SIZE - (size_t)upstream->read_index - 1) &&
          (read_status =
               upstream->ssl
                   ? SSL_read(upstream->ssl, upstream->buffer + upstream->read_index, (int)max_read)
-                  : read(upstream->fd, upstream->buffer + upstream->read_index, max_read)) > 0)
+                  : read_socket(upstream->fd, upstream->buffer + upstream->read_index,
+                                max_read)) > 0)
   {
-    {
-      upstream->read_index += read_status;
-      upstream->buffer[upstream->read_index] = '\0';
-    }
-
-    if (!upstream->headers_found)
-    {
-      if (!parse_headers(conn, upstream))
-        goto error;
-
-      // no content len or encoding was specified or full response read
-      if (upstream->headers_found && !upstream->to_read)
-        goto complete;
-    }
-    else if (upstream->content_len)
-    { // bytes left from content len
-      size_t extra =
-          (size_t)read_status > upstream->to_read ? (size_t)read_status - upstream->to_read : 0;
+    upstream->read_index += read_status;
+    upstream->buffer[upstream->read_index] = '\0';
 
-      if (extra)
-      {
-        upstream->to_read = 0;
-        upstream->next_index = upstream->read_index - (ptrdiff_t)extra;
-      }
-      else
-        upstream->to_read -= (size_t)read_status;
-
-      if (!upstream->to_read)
-        goto complete;
-    }
-    else if (upstream->chunked)
-    { // checking for last chunk, was not received during parse_headers()
-      if (find_last_chunk(upstream))
-        goto complete;
-    }
-    else
-    {
-      err("verify_upstream_read", "No read condition met. Logic error!");
+    if (!parse_headers(conn, upstream))
       goto error;
-    }
+
+    if (upstream->headers_found)
+      goto headers_found;
   }
 
   if (read_status == 0)
   { // upstream disconnect
-    conn->state = CLOSE_CONN;
     warn("read", "Upstream EOF received");
+
+    if (retry_request(conn))
+      return;
+
+    // nothing was sent to the client yet, so it can still get an error
+    conn->status = 502;
+    conn->state = WRITE_ERROR;
     return;
   }
 
-  // write whats in buffer, only if headers are found
-  // this is because parse_headers() requires all the headers to be present in one continuous memory
-  // else continue to read more
-  if (upstream->headers_found)
-    conn->state = WRITE_RESPONSE;
-
   if (read_status == -1)
   {
     if (errno == EINTR && !RUNNING) // shutdown
-      NULL;
-    else if (errno == EAGAIN || errno == EWOULDBLOCK) // no more data right now
-      NULL;
+      upstream->readable = false;
+    else if (errno == EAGAIN || errno == EWOULDBLOCK) // no more data till the next edge
+      upstream->readable = false;
     else
     {
       err("read", strerror(errno));
@@ -227,12 +875,52 @@ void read_response(Connection *conn)
 
   return;
 
-complete:
-  conn->complete = true;
-  conn->state = WRITE_RESPONSE;
+headers_found:
+  // the round trip of the member ends here, the rest is paced by the client
+  sample_member(conn);
+
+  // no body follows these, whatever their headers say
+  uint status = get_response_status(upstream->buffer);
+  if (!strncmp(conn->client.headers.data, "HEAD ", 5) || status == 204 || status == 304)
+  {
+    if (upstream->read_index > upstream->headers.len)
+      upstream->next_index = upstream->headers.len;
+    upstream->to_read = 0;
+    upstream->content_len = 0;
+    upstream->chunked = upstream->until_eof = false;
+  }
+
+  // the conn is closed by the upstream to end the body
+  if (upstream->until_eof)
+    conn->upstream_keep_alive = false;
+
+  // bytes past the end of the response are not the start of another one, the upstream is not
+  // in sync with its requests anymore
+  if (upstream->next_index)
+  {
+    upstream->read_index = upstream->next_index;
+    upstream->next_index = 0;
+    conn->upstream_keep_alive = false;
+  }
+
+  // nor is a member that answered before taking the whole request body
+  if (conn->client.ring_start && (conn->client.to_write || !body_received(&conn->client)))
+    conn->upstream_keep_alive = false;
+
+  // the buffer becomes the ring, with the headers & the body read along as its first bytes
+  upstream->write_index = 0;
+  upstream->to_write = (size_t)upstream->read_index;
+  upstream->read_index %= (ptrdiff_t)RING_SIZE;
+
+  // no content len or encoding was specified or full response read
+  conn->complete = !upstream->to_read;
+  conn->state = RELAY_RESPONSE;
   return;
 
 error:
+  if (retry_request(conn))
+    return;
+
   conn->status = 500;
   conn->state = WRITE_ERROR;
   return;
@@ -355,8 +1043,8 @@ bool write_error_response(Connection *conn)
          (write_status = client->ssl
                              ? SSL_write(client->ssl, upstream->buffer + upstream->write_index,
                                          (int)upstream->to_write)
-                             : write(client->fd, upstream->buffer + upstream->write_index,
-                                     upstream->to_write)) > 0)
+                             : write_socket(client->fd, upstream->buffer + upstream->write_index,
+                                            upstream->to_write)) > 0)
     upstream->write_index += write_status;
 
   if (!write_status)
@@ -366,8 +1054,8 @@ bool write_error_response(Connection *conn)
   {
     if (errno == EINTR && !RUNNING) // shutdown
       NULL;
-    else if (errno == EAGAIN || errno == EWOULDBLOCK) // cannot write now
-      NULL;
+    else if (errno == EAGAIN || errno == EWOULDBLOCK) // cannot write till the next edge
+      client->writable = false;
     else
       return err("write", strerror(errno));
   }
@@ -397,8 +1085,8 @@ void write_response(Connection *conn)
          (write_status = client->ssl
                              ? SSL_write(client->ssl, upstream->buffer + upstream->write_index,
                                          (int)upstream->to_write)
-                             : write(client->fd, upstream->buffer + upstream->write_index,
-                                     upstream->to_write)) > 0)
+                             : write_socket(client->fd, upstream->buffer + upstream->write_index,
+                                            upstream->to_write)) > 0)
     upstream->write_index += write_status;
 
   if (!write_status)
@@ -410,9 +1098,9 @@ void write_response(Connection *conn)
   if (write_status == -1)
   {
     if (errno == EINTR && !RUNNING) // shutdown
-      NULL;
-    else if (errno == EAGAIN || errno == EWOULDBLOCK) // cannot write now
-      NULL;
+      client->writable = false;
+    else if (errno == EAGAIN || errno == EWOULDBLOCK) // cannot write till the next edge
+      client->writable = false;
     else
     {
       err("write", strerror(errno));
@@ -420,10 +1108,17 @@ void write_response(Connection *conn)
     }
   }
 
+  // rest of the buffer is written on the next edge, before reading into it again
+  if (upstream->to_write)
+    return;
+
   if (conn->complete)
     conn->state = CHECK_CONN;
   else
+  {
+    ack_stream(conn); // the stream window is opened again, now that the buffer is free
     conn->state = READ_RESPONSE;
+  }
 
   return;
 
@@ -432,3 +1127,132 @@ error:
   conn->state = WRITE_ERROR;
   return;
 }
+
+void relay_response(Connection *conn)
+{
+  if (!conn)
+    return;
+
+  assert(conn->state == RELAY_RESPONSE);
+
+  Endpoint *client = &conn->client, *upstream = &conn->upstream;
+  bool progress = true;
+
+  while (progress)
+  {
+    progress = false;
+
+    // the rest of a long body skips the ring, once it was drained
+    if (!upstream->to_write && !conn->complete && can_splice(conn))
+    {
+      conn->state = SPLICE_RESPONSE;
+      return;
+    }
+
+    size_t len = 0;
+
+    // a content-length body is read no further than its end, a chunked one is cut by the parser,
+    // & one without a length is read till the EOF
+    while (!conn->complete && upstream->readable && (len = ring_space(upstream)))
+    {
+      if (upstream->content_len && len > upstream->to_read)
+        len = upstream->to_read;
+
+      char *start = upstream->buffer + upstream->read_index;
+      ssize_t read_status = upstream->ssl ? SSL_read(upstream->ssl, start, (int)len)
+                                          : read_socket(upstream->fd, start, len);
+
+      if (read_status > 0)
+      {
+        size_t parsed = (size_t)read_status;
+
+        if (upstream->chunked && !parse_chunks(upstream, start, (size_t)read_status, &parsed, NULL))
+        {
+          conn->state = CLOSE_CONN;
+          return;
+        }
+
+        ring_push(upstream, parsed);
+        progress = true;
+
+        if (upstream->chunked)
+        {
+          conn->complete = upstream->chunk_state == CHUNK_DONE;
+          if (parsed < (size_t)read_status) // not the start of another response
+            conn->upstream_keep_alive = false;
+        }
+        else if (!upstream->until_eof)
+          conn->complete = !(upstream->to_read -= (size_t)read_status);
+
+        continue;
+      }
+
+      if (!read_status && upstream->until_eof)
+      {
+        upstream->to_read = 0;
+        upstream->readable = false;
+        conn->complete = true;
+        break;
+      }
+
+      if (!read_status)
+      { // the headers were sent already, the client can only be told by closing
+        warn("read", "Upstream EOF received");
+        conn->state = CLOSE_CONN;
+        return;
+      }
+
+      if (errno == EINTR && !RUNNING) // shutdown
+        upstream->readable = false;
+      else if (errno == EAGAIN || errno == EWOULDBLOCK) // no more data till the next edge
+        upstream->readable = false;
+      else
+      {
+        err("read", strerror(errno));
+        conn->state = CLOSE_CONN;
+        return;
+      }
+    }
+
+    while (upstream->to_write && client->writable)
+    {
+      len = ring_data(upstream);
+
+      char *start = upstream->buffer + upstream->write_index;
+      ssize_t write_status = client->ssl ? SSL_write(client->ssl, start, (int)len)
+                                         : send_ring(conn, start, len);
+
+      if (write_status > 0)
+      {
+        ring_pop(upstream, (size_t)write_status);
+        progress = true;
+        continue;
+      }
+
+      if (!write_status)
+      {
+        err("write", "No write status");
+        conn->state = CLOSE_CONN;
+        return;
+      }
+
+      if (errno == EINTR && !RUNNING) // shutdown
+        client->writable = false;
+      else if (errno == EAGAIN || errno == EWOULDBLOCK) // cannot write till the next edge
+        client->writable = false;
+      else
+      {
+        err("write", strerror(errno));
+        conn->state = CLOSE_CONN;
+        return;
+      }
+    }
+
+    // the buffer is reused by the next response, zerocopy sends have to be done with it first
+    if (conn->complete && !upstream->to_write && !upstream->held)
+    {
+      conn->state = CHECK_CONN;
+      return;
+    }
+  }
+}
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <time.h>
 
 #include "connection.h"
@@ -106,7 +107,7 @@ bool set_efault()
 
 bool setup_sig_handler(void)
 {
-  struct sigaction sa_shutdown, sa_pipe;
+  struct sigaction sa_shutdown, sa_pipe, sa_wakeup;
 
   // Shutdown
   sa_shutdown.sa_handler = handle_shutdown;
@@ -118,11 +119,17 @@ bool setup_sig_handler(void)
   sigemptyset(&sa_pipe.sa_mask);
   sa_pipe.sa_flags = 0;
 
+  // Wakeup, no SA_RESTART so that blocking calls of workers return with EINTR
+  sa_wakeup.sa_handler = handle_wakeup;
+  sigemptyset(&sa_wakeup.sa_mask);
+  sa_wakeup.sa_flags = 0;
+
   // SIGINT (signal interput) is sent when Ctrl+C is pressed
   // SIGTERM (signal terminate) is sent when the process is killed from like
   // terminal with kill command
   if (sigaction(SIGINT, &sa_shutdown, NULL) == -1 || sigaction(SIGTERM, &sa_shutdown, NULL) == -1 ||
-      sigaction(SIGPIPE, &sa_pipe, NULL) == -1)
+      sigaction(SIGPIPE, &sa_pipe, NULL) == -1 ||
+      sigaction(WAKEUP_SIGNAL, &sa_wakeup, NULL) == -1)
     return err("sigaction", strerror(errno));
 
   return true;
@@ -136,6 +143,12 @@ void handle_shutdown(int sig)
   return;
 }
 
+void handle_wakeup(int sig)
+{
+  (void)sig;
+  return;
+}
+
 void handle_sigpipe(int sig)
 {
   (void)sig;
@@ -145,6 +158,28 @@ void handle_sigpipe(int sig)
 
 void print_active_num(void) { printf("Num of active connections: %d\n", active_conns_num); }
 
+bool raise_fd_limit(size_t needed)
+{
+  struct rlimit limit;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+    return err("getrlimit", strerror(errno));
+
+  if (limit.rlim_cur >= needed)
+    return true;
+
+  limit.rlim_cur = limit.rlim_max != RLIM_INFINITY && limit.rlim_max < needed ? limit.rlim_max
+                                                                              : (rlim_t)needed;
+
+  if (setrlimit(RLIMIT_NOFILE, &limit) == -1)
+    return err("setrlimit", strerror(errno));
+
+  if (limit.rlim_cur < needed)
+    warn("raise_fd_limit", "Open files limit is lower than the max connections require");
+
+  return true;
+}
+
 void print_banner(void)
 {
   puts("\033[1;37m");
@@ -160,8 +195,10 @@ void print_banner(void)
 // does not handle 0 & only works for positive num
 void int_to_string(int num, char *out)
 {
-  static ptrdiff_t pos = 0; // the chars have to be written from the beginning, therefore this
-                            // would serve as the index where the char would go
+  // the chars have to be written from the beginning, therefore this
+  // would serve as the index where the char would go
+  // thread local, as workers may generate error responses at the same time
+  static _Thread_local ptrdiff_t pos = 0;
 
   pos = 0; // may have a value from previous calls
 
@@ -221,6 +258,10 @@ const char *get_state_string(int state)
     return "write_error";
   case CONNECT_UPSTREAM:
     return "connect_upstream";
+  case WAIT_UPSTREAM:
+    return "wait_upstream";
+  case CONNECTING_UPSTREAM:
+    return "connecting_upstream";
   case TLS_UPSTREAM:
     return "tls_upstream";
   case WRITE_REQUEST:
@@ -229,6 +270,10 @@ const char *get_state_string(int state)
     return "read_response";
   case WRITE_RESPONSE:
     return "write_response";
+  case RELAY_RESPONSE:
+    return "relay_response";
+  case SPLICE_RESPONSE:
+    return "splice_response";
   case CHECK_CONN:
     return "check_conn";
   case CLOSE_CONN:
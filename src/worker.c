@@ -0,0 +1,427 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "balancer.h"
+#include "connection.h"
+#include "event.h"
+#include "h2.h"
+#include "health.h"
+#include "hedge.h"
+#include "main.h"
+#include "pool.h"
+#include "proxy.h"
+#include "resolver.h"
+#include "splice.h"
+#include "upstream.h"
+#include "utils.h"
+#include "worker.h"
+#include "zerocopy.h"
+
+bool block_signals(const sigset_t *handled, sigset_t *wait_mask)
+{
+  if (!handled || !wait_mask)
+    return set_efault();
+
+  if ((errno = pthread_sigmask(SIG_BLOCK, handled, wait_mask)))
+    return err("pthread_sigmask", strerror(errno));
+
+  const int signals[] = {SIGINT, SIGTERM, WAKEUP_SIGNAL};
+
+  for (size_t i = 0; i < sizeof signals / sizeof(int); ++i)
+    if (sigismember(handled, signals[i]))
+      sigdelset(wait_mask, signals[i]);
+
+  return true;
+}
+
+bool serve(int proxy_fd, const sigset_t *wait_mask)
+{
+  bool status = false, served = false;
+
+  // probe conns of the health checks, hedge conns & http/2 sessions take slots of their own
+  // every free_*() below is a no-op for what was not set up, so a failed setup jumps to cleanup
+  if (!setup_active_conns(config.max_conns + (config.health_checks ? upstreams_num : 0) +
+                          max_hedges() + max_sessions()))
+    return err("setup_active_conns", NULL);
+
+  if (!setup_conn_pool(config.huge_pages))
+  {
+    err("setup_conn_pool", NULL);
+    goto cleanup;
+  }
+
+  if (!setup_idle_pool(config.max_idle))
+  {
+    err("setup_idle_pool", NULL);
+    goto cleanup;
+  }
+
+  if (!setup_member_stats())
+  {
+    err("setup_member_stats", NULL);
+    goto cleanup;
+  }
+
+  if (!setup_session_cache())
+  {
+    err("setup_session_cache", NULL);
+    goto cleanup;
+  }
+
+  if (!setup_hedging())
+  {
+    err("setup_hedging", NULL);
+    goto cleanup;
+  }
+
+  if (!setup_h2())
+  {
+    err("setup_h2", NULL);
+    goto cleanup;
+  }
+
+  if (!setup_pipe_pool())
+  {
+    err("setup_pipe_pool", NULL);
+    goto cleanup;
+  }
+
+  if (!setup_epoll(proxy_fd))
+  {
+    err("setup_epoll", NULL);
+    goto cleanup;
+  }
+
+  if (!setup_health_checks())
+  {
+    err("setup_health_checks", NULL);
+    goto cleanup;
+  }
+
+  served = true;
+  if (!(status = start_proxy(wait_mask)))
+    err("start_proxy", strerror(errno));
+
+cleanup:
+  // probe conns are freed first, as they are not requests to finish on a member
+  if (served)
+    print_health_stats();
+  free_health_checks();
+
+  // listening conn is also an active conn, and every conn goes back to the pools below
+  free_active_conns();
+
+  if (served)
+  {
+    print_pool_stats();
+    print_idle_pool_stats();
+    print_member_stats();
+    print_session_cache_stats();
+    print_hedge_stats();
+    print_h2_stats();
+    print_pipe_pool_stats();
+    print_zerocopy_stats();
+  }
+
+  free_conn_pool();
+  free_idle_pool();
+  free_member_stats();
+  free_session_cache();
+  free_hedging();
+  free_h2();
+  free_pipe_pool();
+  free_events();
+
+  return status;
+}
+
+bool run_worker(unsigned int id)
+{
+  // single threaded mode reacts to shutdown signals itself,
+  // while worker threads are only woken up by the main thread
+  sigset_t handled, wait_mask;
+  sigemptyset(&handled);
+
+  if (config.threads > 1)
+    sigaddset(&handled, WAKEUP_SIGNAL);
+  else
+  {
+    sigaddset(&handled, SIGINT);
+    sigaddset(&handled, SIGTERM);
+  }
+
+  if (!block_signals(&handled, &wait_mask))
+    return err("block_signals", NULL);
+
+  int proxy_fd = -1;
+
+  if (!setup_proxy(&config, &proxy_fd))
+    return err("setup_proxy", NULL);
+
+  if (!id)
+    printf("\nProxy Listening on port: %s\n\n", config.port);
+
+  bool status = serve(proxy_fd, &wait_mask);
+  close(proxy_fd);
+
+  return status;
+}
+
+void *worker_thread(void *arg)
+{
+  Worker *worker = arg;
+
+  // a worker that cannot run brings the whole proxy down, like a failed bind() would in
+  // single threaded mode
+  if (!run_worker(worker->id) && RUNNING)
+  {
+    err("run_worker", NULL);
+    kill(getpid(), SIGTERM);
+  }
+
+  return NULL;
+}
+
+bool start_workers(unsigned int num)
+{
+  if (!num || num > MAX_WORKERS)
+  {
+    errno = ERANGE;
+    return err("verify_workers", strerror(errno));
+  }
+
+  Worker workers[MAX_WORKERS];
+  memset(workers, 0, sizeof workers);
+
+  // shutdown signals are only received by this thread with sigwait()
+  // wakeup signal is kept blocked in workers, except while they wait for events
+  // threads inherit the mask of the creating thread
+  sigset_t shutdown_set, blocked_set;
+  sigemptyset(&shutdown_set);
+  sigaddset(&shutdown_set, SIGINT);
+  sigaddset(&shutdown_set, SIGTERM);
+  blocked_set = shutdown_set;
+  sigaddset(&blocked_set, WAKEUP_SIGNAL);
+
+  if ((errno = pthread_sigmask(SIG_BLOCK, &blocked_set, NULL)))
+    return err("pthread_sigmask", strerror(errno));
+
+  unsigned int started = 0;
+
+  for (unsigned int i = 0; i < num; ++i)
+  {
+    workers[i].id = i;
+
+    if ((errno = pthread_create(&workers[i].thread, NULL, worker_thread, workers + i)))
+    {
+      err("pthread_create", strerror(errno));
+      RUNNING = false;
+      break;
+    }
+
+    workers[i].started = true;
+    ++started;
+  }
+
+  int sig = 0;
+  if (RUNNING && !sigwait(&shutdown_set, &sig))
+    handle_shutdown(sig);
+
+  RUNNING = false;
+
+  for (unsigned int i = 0; i < num; ++i)
+  {
+    if (!workers[i].started)
+      continue;
+
+    pthread_kill(workers[i].thread, WAKEUP_SIGNAL);
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  return started == num;
+}
+
+bool spawn_process(Worker *worker, int proxy_fd)
+{
+  if (!worker)
+    return set_efault();
+
+  pid_t pid = fork();
+
+  if (pid == -1)
+    return err("fork", strerror(errno));
+
+  if (pid)
+  { // master
+    worker->pid = pid;
+    worker->spawned = time(NULL);
+    return true;
+  }
+
+  // worker reacts to the shutdown signals forwarded by the master
+  sigset_t handled, wait_mask, child_set;
+  sigemptyset(&handled);
+  sigaddset(&handled, SIGINT);
+  sigaddset(&handled, SIGTERM);
+  sigemptyset(&child_set);
+  sigaddset(&child_set, SIGCHLD);
+
+  if (!block_signals(&handled, &wait_mask) ||
+      (errno = pthread_sigmask(SIG_UNBLOCK, &child_set, NULL)))
+  {
+    err("block_signals", NULL);
+    exit(EXIT_FAILURE);
+  }
+  sigdelset(&wait_mask, SIGCHLD);
+
+  if (!start_resolver())
+    warn("start_resolver", "Upstream addresses are not refreshed");
+
+  bool status = serve(proxy_fd, &wait_mask);
+  close(proxy_fd);
+  stop_resolver();
+
+  exit(status ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+bool start_processes(unsigned int num)
+{
+  if (!num || num > MAX_WORKERS)
+  {
+    errno = ERANGE;
+    return err("verify_workers", strerror(errno));
+  }
+
+  // everything shared is set up once, before forking
+  int proxy_fd = -1;
+  if (!setup_proxy(&config, &proxy_fd))
+    return err("setup_proxy", NULL);
+
+  printf("\nProxy Listening on port: %s\n\n", config.port);
+  fflush(stdout); // buffered output would be duplicated in every worker
+
+  // master only sleeps in sigwait(), waiting for shutdown or a dead worker
+  sigset_t master_set;
+  sigemptyset(&master_set);
+  sigaddset(&master_set, SIGINT);
+  sigaddset(&master_set, SIGTERM);
+  sigaddset(&master_set, SIGCHLD);
+
+  if ((errno = pthread_sigmask(SIG_BLOCK, &master_set, NULL)))
+  {
+    close(proxy_fd);
+    return err("pthread_sigmask", strerror(errno));
+  }
+
+  Worker workers[MAX_WORKERS];
+  memset(workers, 0, sizeof workers);
+
+  bool status = true;
+
+  for (unsigned int i = 0; i < num; ++i)
+  {
+    workers[i].id = i;
+
+    if (!spawn_process(workers + i, proxy_fd))
+    {
+      err("spawn_process", NULL);
+      status = RUNNING = false;
+      break;
+    }
+  }
+
+  int sig = 0;
+
+  while (RUNNING)
+  {
+    // dead workers are spawned again once due, a failed spawn is retried after a while
+    time_t now = time(NULL), next = 0;
+
+    for (unsigned int i = 0; i < num; ++i)
+    {
+      if (workers[i].pid || !workers[i].respawn)
+        continue;
+
+      if (workers[i].respawn <= now)
+      {
+        if (spawn_process(workers + i, proxy_fd))
+        {
+          workers[i].respawn = 0;
+          continue;
+        }
+
+        err("spawn_process", NULL);
+        workers[i].respawn = now + MIN_WORKER_LIFETIME;
+      }
+
+      if (!next || workers[i].respawn < next)
+        next = workers[i].respawn;
+    }
+
+    // the master never sleeps past a pending respawn, & keeps handling shutdown meanwhile
+    struct timespec wait_time = {.tv_sec = next - now, .tv_nsec = 0};
+    sig = next ? sigtimedwait(&master_set, NULL, &wait_time) : sigwaitinfo(&master_set, NULL);
+
+    if (sig == -1)
+    {
+      if (errno == EAGAIN || errno == EINTR)
+        continue;
+
+      err("sigwait", strerror(errno));
+      break;
+    }
+
+    if (sig != SIGCHLD)
+    {
+      handle_shutdown(sig);
+      break;
+    }
+
+    int wstatus = 0;
+    pid_t pid = 0;
+
+    // multiple SIGCHLDs may be merged into one
+    while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0)
+      for (unsigned int i = 0; i < num; ++i)
+      {
+        if (workers[i].pid != pid)
+          continue;
+
+        workers[i].pid = 0;
+
+        if (WIFSIGNALED(wstatus))
+          fprintf(stderr, "Worker %u (pid %d) killed by signal: %s\n", i, pid,
+                  strsignal(WTERMSIG(wstatus)));
+        else
+          fprintf(stderr, "Worker %u (pid %d) exited with status: %d\n", i, pid,
+                  WEXITSTATUS(wstatus));
+
+        // a worker that cannot even start should not be respawned in a tight loop
+        now = time(NULL);
+        workers[i].respawn =
+            now - workers[i].spawned < MIN_WORKER_LIFETIME ? now + MIN_WORKER_LIFETIME : now;
+        break;
+      }
+  }
+
+  RUNNING = false;
+
+  // forwarding shutdown to every live worker & waiting for them to finish their loops
+  for (unsigned int i = 0; i < num; ++i)
+    if (workers[i].pid > 0)
+      kill(workers[i].pid, sig == SIGINT ? SIGINT : SIGTERM);
+
+  for (unsigned int i = 0; i < num; ++i)
+    if (workers[i].pid > 0 && waitpid(workers[i].pid, NULL, 0) == -1)
+      err("waitpid", strerror(errno));
+
+  close(proxy_fd);
+  return status;
+}
@@ -0,0 +1,231 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h> // before errqueue.h, which uses struct timespec
+#include <unistd.h>
+
+#include <linux/errqueue.h>
+
+#include "connection.h"
+#include "event.h"
+#include "main.h"
+#include "utils.h"
+#include "zerocopy.h"
+
+_Thread_local ZerocopyStats zerocopy_stats = {0};
+
+// io_uring sends a copy of the bytes, the kernel would never pin the pages of the ring
+#if defined(USE_ZEROCOPY) && !defined(USE_IO_URING)
+
+// asked for on the first send large enough, most clients never get one
+static bool enable_zerocopy(Connection *conn)
+{
+  int on = 1;
+  if (setsockopt(conn->client.fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof on) == -1)
+  {
+    warn("setsockopt", strerror(errno));
+    conn->zerocopy_off = true;
+    ++zerocopy_stats.fallback;
+    return false;
+  }
+
+  conn->zerocopy = true;
+  return true;
+}
+
+ssize_t send_ring(Connection *conn, const char *data, size_t len)
+{
+  if (!conn)
+  {
+    errno = EFAULT;
+    return -1;
+  }
+
+  Endpoint *client = &conn->client, *upstream = &conn->upstream;
+
+  if (!upstream->held &&
+      (len < ZEROCOPY_MIN || conn->zerocopy_off || (!conn->zerocopy && !enable_zerocopy(conn))))
+    return write_socket(client->fd, data, len);
+
+  // a completion wakes the client up again, as EPOLLERR is a writable event too
+  if (conn->zerocopy_off || conn->zc_num == ZEROCOPY_SENDS_MAX)
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  ssize_t status = send(client->fd, data, len, MSG_ZEROCOPY | MSG_NOSIGNAL);
+
+  // the pages pinned by the socket are over its limit
+  if (status == -1 && errno == ENOBUFS)
+  {
+    if (conn->zc_num) // till a completion
+    {
+      errno = EAGAIN;
+      return -1;
+    }
+
+    return write_socket(client->fd, data, len);
+  }
+
+  if (status <= 0)
+    return status;
+
+  size_t slot = conn->zc_next % ZEROCOPY_SENDS_MAX;
+  conn->zc_lens[slot] = (size_t)status;
+  conn->zc_done[slot] = false;
+  ++conn->zc_next;
+  ++conn->zc_num;
+
+  upstream->held += (size_t)status;
+  ++zerocopy_stats.sends;
+  zerocopy_stats.bytes += (size_t)status;
+
+  return status;
+}
+
+bool reap_zerocopy(Connection *conn)
+{
+  if (!conn)
+    return set_efault();
+
+  Endpoint *client = &conn->client, *upstream = &conn->upstream;
+
+  while (true)
+  {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct msghdr msg = {.msg_control = control, .msg_controllen = sizeof control};
+
+    if (recvmsg(client->fd, &msg, MSG_ERRQUEUE) == -1)
+    {
+      if (errno == EINTR && RUNNING)
+        continue;
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK) // queue drained
+        break;
+
+      return err("recvmsg", strerror(errno));
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || !((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                   (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+      return err("recvmsg", "Unknown error queue entry");
+
+    struct sock_extended_err serr;
+    memcpy(&serr, CMSG_DATA(cmsg), sizeof serr);
+
+    if (serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+      return err("recvmsg", strerror((int)serr.ee_errno));
+
+    // the pages could not be sent from, a copy was made on top of pinning them
+    if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+    {
+      ++zerocopy_stats.copied;
+      if (!conn->zerocopy_off)
+        ++zerocopy_stats.fallback;
+      conn->zerocopy_off = true;
+    }
+
+    // the ids from ee_info to ee_data are done, consecutive sends are acked as a range
+    for (uint32_t id = serr.ee_info;; ++id)
+    {
+      uint32_t age = conn->zc_next - id;
+      if (age && age <= conn->zc_num)
+        conn->zc_done[id % ZEROCOPY_SENDS_MAX] = true;
+
+      if (id == serr.ee_data)
+        break;
+    }
+  }
+
+  while (conn->zc_num)
+  {
+    size_t slot = (conn->zc_next - (uint32_t)conn->zc_num) % ZEROCOPY_SENDS_MAX;
+    if (!conn->zc_done[slot])
+      break;
+
+    ring_release(upstream, conn->zc_lens[slot]);
+    conn->zc_done[slot] = false;
+    --conn->zc_num;
+  }
+
+  return true;
+}
+
+bool abort_zerocopy(Connection *conn)
+{
+  if (!conn || !conn->zc_num || conn->client.fd < 0)
+    return false;
+
+  // disconnecting purges the queues of the socket with a reset, so the sends complete soon,
+  // while the fd is left to read their completions from. the fd stays in epoll too, its events
+  // wake the loop but are skipped, as the conn is freed
+  if (connect(conn->client.fd, &(struct sockaddr){.sa_family = AF_UNSPEC},
+              sizeof(struct sockaddr)) == -1)
+    warn("connect", strerror(errno)); // acked or timed out by tcp, sooner or later
+
+  return true;
+}
+
+bool drain_zerocopy(Connection *conn)
+{
+  if (!conn || !conn->zc_num)
+    return true;
+
+  reap_zerocopy(conn);
+  if (conn->zc_num)
+    return false;
+
+  close(conn->client.fd);
+  conn->client.fd = -1;
+  ++zerocopy_stats.drained;
+
+  return true;
+}
+
+void print_zerocopy_stats(void)
+{
+  printf("Zerocopy sends: %zu sends, %zu bytes, %zu copied by the kernel, %zu clients moved to "
+         "plain writes, %zu freed conns drained\n",
+         zerocopy_stats.sends, zerocopy_stats.bytes, zerocopy_stats.copied,
+         zerocopy_stats.fallback, zerocopy_stats.drained);
+}
+
+#else // plain writes only
+
+ssize_t send_ring(Connection *conn, const char *data, size_t len)
+{
+  if (!conn)
+  {
+    errno = EFAULT;
+    return -1;
+  }
+
+  return write_socket(conn->client.fd, data, len);
+}
+
+bool reap_zerocopy(Connection *conn)
+{
+  (void)conn;
+  return false;
+}
+
+bool abort_zerocopy(Connection *conn)
+{
+  (void)conn;
+  return false;
+}
+
+bool drain_zerocopy(Connection *conn)
+{
+  (void)conn;
+  return true;
+}
+
+void print_zerocopy_stats(void) {}
+
+#endif
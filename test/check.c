@@ -0,0 +1,307 @@
+#include <errno.h>
+#include <openssl/ssl.h>
+#include <regex.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "args.h"
+#include "balancer.h"
+#include "connection.h"
+#include "health.h"
+#include "main.h"
+#include "pool.h"
+#include "proxy.h"
+#include "timeout.h"
+#include "upstream.h"
+#include "utils.h"
+
+// unit checks of the health checks & member selection, run by `make check`
+// linked against every object but main.o, so the globals of main.c are defined here
+
+volatile bool RUNNING = true;
+Config config = {.threads = 1,
+                 .processes = 1,
+                 .max_conns = MAX_CONNECTIONS,
+                 .lb_policy = ROUND_ROBIN,
+                 .health_interval = DEFAULT_HEALTH_INTERVAL,
+                 .health_checks = true};
+SSL_CTX *ssl_context = NULL;
+SSL_CTX *upstream_ssl_context = NULL;
+regex_t origin_regex;
+
+static size_t failed = 0;
+
+#define CHECK(cond)                                                                                \
+  do                                                                                               \
+  {                                                                                                \
+    if (!(cond))                                                                                   \
+    {                                                                                              \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);                              \
+      ++failed;                                                                                    \
+    }                                                                                              \
+  } while (0)
+
+static Upstream members[] = {{.host = "a", .port = "80", .weight = 2},
+                             {.host = "b", .port = "80", .weight = 1},
+                             {.host = "c", .port = "80", .weight = 1}};
+#define MEMBERS_NUM (sizeof members / sizeof(Upstream))
+
+static Connection request; // only the member & path of a conn are used by the selection
+
+// puts every member back in rotation, without requests
+static void reset_members(void)
+{
+  for (size_t i = 0; i < MEMBERS_NUM; ++i)
+    member_stats[i] = (MemberStats){.healthy = true, .limit = CONCURRENCY_INITIAL};
+
+  config.adaptive_limit = false;
+  request.member = NO_MEMBER;
+}
+
+// member of a selection that is finished right away, NO_MEMBER if none was selected
+static size_t pick(void)
+{
+  if (!select_member(&request))
+    return NO_MEMBER;
+
+  size_t member = request.member;
+  finish_member(&request, true);
+  return member;
+}
+
+// probe of member as started by start_probe(), passed or failed
+static void probe(size_t member, bool passed)
+{
+  ++member_health[member].checks;
+  finish_probe(member_health[member].probe, passed);
+}
+
+static void check_health(void)
+{
+  bool *healthy = &member_stats[0].healthy;
+
+  // nothing is known before the first probe, it decides right away
+  probe(0, false);
+  CHECK(!*healthy);
+  CHECK(member_health[0].downs == 1);
+
+  for (int i = 0; i < HEALTH_RISE - 1; ++i)
+    probe(0, true);
+  CHECK(!*healthy);
+
+  probe(0, true);
+  CHECK(*healthy);
+
+  // a pass in between starts the failures over
+  for (int i = 0; i < HEALTH_FALL - 1; ++i)
+    probe(0, false);
+  probe(0, true);
+  for (int i = 0; i < HEALTH_FALL - 1; ++i)
+    probe(0, false);
+  CHECK(*healthy);
+
+  probe(0, false);
+  CHECK(!*healthy);
+  CHECK(member_health[0].downs == 2);
+
+  // a fail in between starts the passes over
+  for (int i = 0; i < HEALTH_RISE - 1; ++i)
+    probe(0, true);
+  probe(0, false);
+  for (int i = 0; i < HEALTH_RISE - 1; ++i)
+    probe(0, true);
+  CHECK(!*healthy);
+
+  probe(0, true);
+  CHECK(*healthy);
+  CHECK(member_health[0].downs == 2);
+
+  // the first probe of a healthy member keeps it in rotation
+  probe(1, true);
+  CHECK(member_stats[1].healthy);
+  CHECK(member_health[1].downs == 0);
+}
+
+static void check_round_robin(void)
+{
+  config.lb_policy = ROUND_ROBIN;
+  reset_members();
+
+  size_t picks[MEMBERS_NUM] = {0};
+  for (int i = 0; i < 40; ++i)
+    ++picks[pick()];
+
+  // by weight
+  CHECK(picks[0] == 20 && picks[1] == 10 && picks[2] == 10);
+
+  // never twice in a row for a member of weight 1
+  size_t last = pick();
+  for (int i = 0; i < 40; ++i)
+  {
+    size_t member = pick();
+    CHECK(member == 0 || member != last);
+    last = member;
+  }
+
+  member_stats[0].healthy = false;
+  memset(picks, 0, sizeof picks);
+  for (int i = 0; i < 40; ++i)
+    ++picks[pick()];
+  CHECK(picks[0] == 0 && picks[1] == 20 && picks[2] == 20);
+}
+
+static void check_least_outstanding(void)
+{
+  config.lb_policy = LEAST_OUTSTANDING;
+  reset_members();
+
+  // outstanding by weight: 0.5, 1 & 1
+  member_stats[0].outstanding = member_stats[1].outstanding = member_stats[2].outstanding = 1;
+  CHECK(pick() == 0);
+
+  member_stats[0].outstanding = 4;
+  size_t member = pick();
+  CHECK(member == 1 || member == 2);
+
+  member_stats[1].outstanding = 3;
+  CHECK(pick() == 2);
+
+  // an ejected member is skipped however idle it is
+  member_stats[2].outstanding = 0;
+  member_stats[2].ejected_till = loop_time + 1000;
+  for (int i = 0; i < 4; ++i)
+    CHECK(pick() != 2);
+}
+
+static void check_two_choices(void)
+{
+  config.lb_policy = TWO_CHOICES;
+  reset_members();
+
+  // the loaded member loses every comparison
+  member_stats[0].outstanding = 50;
+
+  size_t picks[MEMBERS_NUM] = {0};
+  for (int i = 0; i < 100; ++i)
+    ++picks[pick()];
+  CHECK(picks[0] == 0 && picks[1] > 0 && picks[2] > 0);
+
+  // a single member with room is picked without comparing
+  member_stats[1].healthy = member_stats[2].healthy = false;
+  CHECK(pick() == 0);
+}
+
+static void check_path_hash(void)
+{
+  config.lb_policy = PATH_HASH;
+  reset_members();
+
+  request.path = STR("/static/app.js");
+  size_t owner = pick();
+  CHECK(owner != NO_MEMBER);
+
+  for (int i = 0; i < 10; ++i)
+    CHECK(pick() == owner);
+
+  // keys move while their member is out of rotation, and come back with it
+  member_stats[owner].healthy = false;
+  size_t moved = pick();
+  CHECK(moved != NO_MEMBER && moved != owner);
+
+  member_stats[owner].healthy = true;
+  CHECK(pick() == owner);
+
+  // paths spread over every member
+  char path[32];
+  size_t picks[MEMBERS_NUM] = {0};
+  for (int i = 0; i < 300; ++i)
+  {
+    request.path.data = path;
+    request.path.len = snprintf(path, sizeof path, "/item/%d", i);
+    ++picks[pick()];
+  }
+  CHECK(picks[0] > picks[1] && picks[0] > picks[2] && picks[1] > 0 && picks[2] > 0);
+
+  request.path = ERR_STR;
+}
+
+static void check_no_member(void)
+{
+  config.lb_policy = ROUND_ROBIN;
+  reset_members();
+
+  // members in rotation at their limit, waiting for a slot helps
+  config.adaptive_limit = true;
+  for (size_t i = 0; i < MEMBERS_NUM; ++i)
+    member_stats[i].limit = 1;
+
+  static Connection held[MEMBERS_NUM];
+  for (size_t i = 0; i < MEMBERS_NUM; ++i)
+  {
+    held[i].path = ERR_STR;
+    CHECK(select_member(held + i));
+  }
+
+  errno = 0;
+  CHECK(!select_member(&request) && errno == EAGAIN);
+
+  // the only full members are down or ejected, the request fails fast
+  member_stats[0].healthy = false;
+  member_stats[1].healthy = false;
+  member_stats[2].ejected_till = loop_time + 1000;
+  errno = 0;
+  CHECK(!select_member(&request) && errno == EHOSTUNREACH);
+
+  // a full member back in rotation
+  member_stats[2].ejected_till = 0;
+  errno = 0;
+  CHECK(!select_member(&request) && errno == EAGAIN);
+
+  for (size_t i = 0; i < MEMBERS_NUM; ++i)
+    finish_member(held + i, true);
+  CHECK(select_member(&request) && request.member == 2);
+  finish_member(&request, true);
+
+  // every member down, without any limit
+  config.adaptive_limit = false;
+  member_stats[2].healthy = false;
+  errno = 0;
+  CHECK(!select_member(&request) && errno == EHOSTUNREACH);
+}
+
+int main(void)
+{
+  upstreams = members;
+  upstreams_num = MEMBERS_NUM;
+
+  setup_timeouts();
+
+  if (!setup_active_conns(upstreams_num) || !setup_conn_pool(false) || !setup_member_stats() ||
+      !setup_hash_ring() || !setup_health_checks())
+  {
+    err("setup", NULL);
+    return 1;
+  }
+
+  check_health();
+  check_round_robin();
+  check_least_outstanding();
+  check_two_choices();
+  check_path_hash();
+  check_no_member();
+
+  free_health_checks();
+  free_active_conns();
+  free_conn_pool();
+  free_hash_ring();
+  free_member_stats();
+
+  if (failed)
+  {
+    printf("%zu checks failed\n", failed);
+    return 1;
+  }
+
+  puts("All checks passed");
+  return 0;
+}